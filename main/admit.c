@@ -0,0 +1,207 @@
+/*
+ * HTTP admission control
+ *
+ * Everything here runs in the httpd task: the open and close callbacks
+ * and every request, so the client table needs no lock. The server has
+ * no callback for the connections it purges, so a close is counted as
+ * a purge when every socket was open, the server rather than a handler
+ * chose it, and the client had not gone away.
+ */
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <sys/param.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include "lwip/sockets.h"
+#include "admit.h"
+#include "config.h"
+#include "metrics.h"
+
+#define ADMIT_CLIENTS   8           // addresses with a token bucket, the oldest is reused
+
+static const char *TAG = "admit";
+
+typedef struct {
+    uint32_t addr;
+    uint32_t tokens;                // thousandths of a request
+    int64_t last_us;                // last refill, 0 = unused
+} admit_client_t;
+
+static admit_client_t admit_clients[ADMIT_CLIENTS];
+static atomic_uint admit_sessions;
+static unsigned admit_max;          // 0 until the server is started
+static int admit_closing = -1;      // socket a handler or admit_request() gave up on
+static int admit_last = -1;         // socket that took the last slot, kept for /ctrl
+
+/* A connection accepted into the last free slot may only be used for
+ * /ctrl, everyone else gets max - 1. With LRU purge the server frees a
+ * slot before it accepts, so the newest connection is the one limited */
+static esp_err_t admit_open_fn(httpd_handle_t hd, int sockfd)
+{
+    unsigned open = atomic_fetch_add(&admit_sessions, 1) + 1;
+
+    if (admit_max && open >= admit_max)
+        admit_last = sockfd;
+    return ESP_OK;
+}
+
+/* Setting close_fn leaves closing the socket to us */
+static void admit_close_fn(httpd_handle_t hd, int sockfd)
+{
+    unsigned open = atomic_fetch_sub(&admit_sessions, 1);
+    char c;
+
+    // Any close frees a slot, so the last one is no longer the last
+    admit_last = -1;
+
+    if (sockfd == admit_closing) {
+        admit_closing = -1;
+    } else if (open >= admit_max) {
+        int n = recv(sockfd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+        if (n > 0 || (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)))
+            atomic_fetch_add(&metric_http_purged, 1);
+    }
+    close(sockfd);
+}
+
+/* Socket limits and timeouts from the settings, before httpd_start() */
+void admit_config(httpd_config_t *config)
+{
+    config_t cfg;
+
+    config_get(&cfg);
+    config->max_open_sockets = MIN(cfg.http_sockets, CONFIG_LWIP_MAX_SOCKETS - ADMIT_SOCKETS_USED);
+    config->lru_purge_enable = true;
+    config->recv_wait_timeout = cfg.http_timeout;
+    config->send_wait_timeout = cfg.http_timeout;
+    config->open_fn = admit_open_fn;
+    config->close_fn = admit_close_fn;
+
+    // A restarted server begins with no connections
+    admit_max = config->max_open_sockets;
+    admit_closing = -1;
+    admit_last = -1;
+    atomic_store(&admit_sessions, 0);
+    ESP_LOGI(TAG, "%u connections, %us timeout, %u/s burst %u per client",
+             admit_max, cfg.http_timeout, cfg.http_rate, cfg.http_burst);
+}
+
+/* Client address as a table key, the low word of an IPv6 address is
+ * enough to tell clients on one LAN apart. 0 if the peer is unknown */
+static uint32_t admit_addr(httpd_req_t *req)
+{
+    struct sockaddr_in6 addr;
+    socklen_t len = sizeof(addr);
+    uint32_t key;
+
+    if (getpeername(httpd_req_to_sockfd(req), (struct sockaddr *)&addr, &len) != 0)
+        return 0;
+    if (addr.sin6_family == AF_INET)
+        return ((struct sockaddr_in *)&addr)->sin_addr.s_addr;
+    memcpy(&key, &addr.sin6_addr.s6_addr[12], sizeof(key));
+    return key;
+}
+
+/* Take one request from the client's bucket, false if it is empty */
+static bool admit_take(uint32_t addr, unsigned rate, unsigned burst)
+{
+    int64_t now = esp_timer_get_time();
+    admit_client_t *client = &admit_clients[0];
+
+    for (int i = 0; i < ADMIT_CLIENTS; i++) {
+        if (admit_clients[i].last_us && admit_clients[i].addr == addr) {
+            client = &admit_clients[i];
+            break;
+        }
+        if (admit_clients[i].last_us < client->last_us)
+            client = &admit_clients[i];
+    }
+    if (client->last_us == 0 || client->addr != addr) {
+        // New or evicted, a client starts with a full bucket
+        client->addr = addr;
+        client->tokens = burst * 1000;
+    } else {
+        uint64_t refill = (uint64_t)(now - client->last_us) * rate / 1000;
+        client->tokens = MIN(client->tokens + refill, burst * 1000);
+    }
+    client->last_us = now;
+
+    if (client->tokens < 1000)
+        return false;
+    client->tokens -= 1000;
+    return true;
+}
+
+typedef enum { ADMIT_OK, ADMIT_RESERVED, ADMIT_LIMITED } admit_t;
+
+/* Check the reserved connection and the client's bucket, counting a refusal */
+static admit_t admit_check(httpd_req_t *req, bool priority)
+{
+    config_t cfg;
+
+    if (priority)
+        return ADMIT_OK;
+
+    // This connection took the last slot, which is kept for /ctrl.
+    // Closing it makes room again.
+    if (httpd_req_to_sockfd(req) == admit_last) {
+        atomic_fetch_add(&metric_http_reserved, 1);
+        return ADMIT_RESERVED;
+    }
+
+    config_get(&cfg);
+    if (cfg.http_rate == 0 || admit_take(admit_addr(req), cfg.http_rate, MAX(cfg.http_burst, 1)))
+        return ADMIT_OK;
+    atomic_fetch_add(&metric_http_rate_limited, 1);
+    return ADMIT_LIMITED;
+}
+
+/* Decide whether a request may run. If not it has been answered and
+ * *ret is what the URI handler should return. priority requests are
+ * never limited and may take the last connection */
+bool admit_request(httpd_req_t *req, bool priority, esp_err_t *ret)
+{
+    switch (admit_check(req, priority)) {
+    case ADMIT_OK:
+        return true;
+    case ADMIT_RESERVED:
+        httpd_resp_set_status(req, "503 Service Unavailable");
+        httpd_resp_set_hdr(req, "Retry-After", "1");
+        httpd_resp_set_hdr(req, "Connection", "close");
+        httpd_resp_send(req, "Busy, try again\n", HTTPD_RESP_USE_STRLEN);
+        *ret = ESP_FAIL;
+        return false;
+    case ADMIT_LIMITED:
+        break;
+    }
+    httpd_resp_set_status(req, "429 Too Many Requests");
+    httpd_resp_set_hdr(req, "Retry-After", "1");
+    // Rather than read a body that will not be used, drop the connection
+    if (req->content_len)
+        httpd_resp_set_hdr(req, "Connection", "close");
+    httpd_resp_send(req, "Too many requests\n", HTTPD_RESP_USE_STRLEN);
+    *ret = req->content_len ? ESP_FAIL : ESP_OK;
+    return false;
+}
+
+/* Same checks for a WebSocket handshake. The server has already sent
+ * 101 Switching Protocols by then, so a refused client gets no answer
+ * and the handler must fail to close it */
+bool admit_upgrade(httpd_req_t *req)
+{
+    return admit_check(req, false) == ADMIT_OK;
+}
+
+/* A failed request closes its connection, which is not a purge */
+void admit_done(httpd_req_t *req, esp_err_t err)
+{
+    if (err != ESP_OK)
+        admit_closing = httpd_req_to_sockfd(req);
+}
+
+unsigned admit_open(void)
+{
+    return atomic_load(&admit_sessions);
+}
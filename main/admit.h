@@ -0,0 +1,25 @@
+/*
+ * HTTP admission control
+ *
+ * Caps the open connections, closing the least recently used one when a
+ * new client arrives, and keeps the last for POST /ctrl so a monitor
+ * polling the device or a forgotten browser tab cannot lock out a boot
+ * selection. Each client address also gets a token bucket, a client
+ * that runs it dry is answered 429 until it refills.
+ */
+
+#ifndef ADMIT_H_
+#define ADMIT_H_
+
+#include <stdbool.h>
+#include <esp_http_server.h>
+
+#define ADMIT_SOCKETS_USED  5       // httpd's own three, UDP control and Wake-on-LAN
+
+void admit_config(httpd_config_t *config);
+bool admit_request(httpd_req_t *req, bool priority, esp_err_t *ret);
+bool admit_upgrade(httpd_req_t *req);
+void admit_done(httpd_req_t *req, esp_err_t err);
+unsigned admit_open(void);
+
+#endif /* ADMIT_H_ */
@@ -0,0 +1,44 @@
+# Prepare the embedded web assets
+#
+# Each file in www-data is minified (HTML only, leading indentation and
+# blank lines dropped) to <name>.min and gzipped to <name>.gz. A content
+# hash of the minified file is written to www-data/assets.h for use as
+# a strong ETag, with a distinct tag for the gzip encoding.
+
+set(ASSET_DIR ${CMAKE_CURRENT_LIST_DIR}/www-data)
+set(ASSET_FILES index.html config.html favicon.ico)
+
+# Re-run when a source asset changes, index.html comes from index.html.in
+set_property(DIRECTORY APPEND PROPERTY CMAKE_CONFIGURE_DEPENDS
+             ${ASSET_DIR}/index.html.in ${ASSET_DIR}/config.html ${ASSET_DIR}/favicon.ico)
+
+set(ASSET_HDR "/* Generated by assets.cmake, do not edit */\n")
+foreach(name ${ASSET_FILES})
+    set(src ${ASSET_DIR}/${name})
+    set(min ${ASSET_DIR}/${name}.min)
+
+    if (name MATCHES "\\.html$")
+        file(READ ${src} text)
+        string(REGEX REPLACE "\r" "" text "${text}")
+        string(REGEX REPLACE "\n[ \t]+" "\n" text "${text}")
+        string(REGEX REPLACE "[ \t]+\n" "\n" text "${text}")
+        string(REGEX REPLACE "\n\n+" "\n" text "${text}")
+        file(WRITE ${min} "${text}")
+    else()
+        configure_file(${src} ${min} COPYONLY)
+    endif()
+
+    # A raw archive of one file is just the gzipped file
+    file(ARCHIVE_CREATE OUTPUT ${ASSET_DIR}/${name}.gz PATHS ${min}
+         FORMAT raw COMPRESSION GZip COMPRESSION_LEVEL 9)
+
+    file(SHA256 ${min} hash)
+    string(SUBSTRING "${hash}" 0 16 hash)
+    string(MAKE_C_IDENTIFIER "${name}" id)
+    string(TOUPPER "${id}" id)
+    string(APPEND ASSET_HDR "#define ASSET_${id}_ETAG \"\\\"${hash}\\\"\"\n")
+    string(APPEND ASSET_HDR "#define ASSET_${id}_ETAG_GZ \"\\\"${hash}-gz\\\"\"\n")
+endforeach()
+
+# Only touch the header when a hash changes
+file(CONFIGURE OUTPUT ${ASSET_DIR}/assets.h CONTENT "${ASSET_HDR}" @ONLY)
@@ -0,0 +1,563 @@
+/*
+ * Settings cache over NVS
+ *
+ * The RAM copy is guarded by a sequence count, odd while a writer is
+ * changing it, so readers retry instead of taking a lock. Writers are
+ * serialized by a mutex. A flush takes a copy of what changed under that
+ * mutex and writes it to flash after letting go, so neither readers nor
+ * writers ever wait for a commit.
+ */
+
+#include <stddef.h>
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include <esp_log.h>
+#include <esp_system.h>
+#include <esp_timer.h>
+#include <nvs_flash.h>
+#include "config.h"
+#include "tasks.h"
+
+static const char *TAG = "config";
+
+#define COMMIT_TASK_PRIORITY    1       // just above idle, commits are never urgent
+
+typedef enum {
+    CFG_STR,
+    CFG_U8,
+    CFG_U32,
+    CFG_BLOB,
+} config_type_t;
+
+/* Schema, indexed by config_field_t */
+typedef struct {
+    const char *key;        // NVS key in "storage"
+    config_type_t type;
+    size_t offset;
+    size_t size;
+} config_desc_t;
+
+static const config_desc_t config_desc[CFG_FIELDS] = {
+    [CFG_WIFI_SSID]    = { "WIFI_SSID",    CFG_STR, offsetof(config_t, wifi_ssid),     sizeof(((config_t *)0)->wifi_ssid) },
+    [CFG_WIFI_PASS]    = { "WIFI_PASS",    CFG_STR, offsetof(config_t, wifi_pass),     sizeof(((config_t *)0)->wifi_pass) },
+    [CFG_WIFI_PS]      = { "WIFI_PS",      CFG_U8,  offsetof(config_t, wifi_ps),       sizeof(uint8_t) },
+    [CFG_HTTP_SOCKETS] = { "HTTP_SOCKETS", CFG_U8,  offsetof(config_t, http_sockets),  sizeof(uint8_t) },
+    [CFG_HTTP_TIMEOUT] = { "HTTP_TIMEOUT", CFG_U8,  offsetof(config_t, http_timeout),  sizeof(uint8_t) },
+    [CFG_HTTP_RATE]    = { "HTTP_RATE",    CFG_U8,  offsetof(config_t, http_rate),     sizeof(uint8_t) },
+    [CFG_HTTP_BURST]   = { "HTTP_BURST",   CFG_U8,  offsetof(config_t, http_burst),    sizeof(uint8_t) },
+};
+
+/* Records, indexed by config_rec_t. Keys and types are the ones the
+ * owners wrote before the cache existed */
+static const config_desc_t config_rec_desc[CFG_RECS] = {
+    [CFG_REC_ARMED]      = { "ARMED",      CFG_BLOB, 0, CFG_REC_SIZE },
+    [CFG_REC_WIFI_CACHE] = { "WIFI_CACHE", CFG_BLOB, 0, CFG_REC_SIZE },
+    [CFG_REC_UDP_SEQ]    = { "UDP_SEQ",    CFG_U32,  0, sizeof(uint32_t) },
+};
+
+static const config_t config_defaults = {
+    .wifi_ssid = CONFIG_ESP_WIFI_SSID,
+    .wifi_pass = CONFIG_ESP_WIFI_PASSWORD,
+#if CONFIG_WEBSTER_WIFI_PS_MAX_MODEM
+    .wifi_ps = 2,
+#elif CONFIG_WEBSTER_WIFI_PS_MIN_MODEM
+    .wifi_ps = 1,
+#else
+    .wifi_ps = 0,
+#endif
+    .http_sockets = CONFIG_WEBSTER_HTTP_MAX_SOCKETS,
+    .http_timeout = CONFIG_WEBSTER_HTTP_TIMEOUT,
+    .http_rate = CONFIG_WEBSTER_HTTP_RATE,
+    .http_burst = CONFIG_WEBSTER_HTTP_BURST,
+};
+
+typedef struct {
+    uint8_t data[CFG_REC_SIZE];
+    uint8_t len;
+    bool present;           // else absent, or its key waits to be erased
+} config_rec_buf_t;
+
+/* Profiles are stored as "P_<name>" */
+typedef struct {
+    seq_profile_t prof;
+    bool used;              // else free, or its key waits to be erased
+} config_prof_t;
+
+/* Everything kept in RAM, and what a flush writes out */
+typedef struct {
+    config_t cfg;
+    config_rec_buf_t recs[CFG_RECS];
+    config_prof_t profs[CFG_PROFILES];
+    uint32_t dirty;         // bit per field
+    uint32_t rec_dirty;     // bit per record
+    uint32_t prof_dirty;    // bit per profile slot
+    bool ver_dirty;
+} config_state_t;
+
+static config_state_t config_ram;       // changed under config_lock
+static config_state_t config_out;       // under config_flush_lock
+static uint32_t config_prof_flushing;   // slots being written, not to be reused yet
+static atomic_uint config_seq = 0;
+static SemaphoreHandle_t config_lock = NULL;
+static SemaphoreHandle_t config_flush_lock = NULL;
+static esp_timer_handle_t config_timer = NULL;
+static TaskHandle_t config_task_handle = NULL;
+
+/* Bracket a change to config_ram readers may see, under config_lock */
+static void config_write_begin(void)
+{
+    unsigned seq = atomic_load_explicit(&config_seq, memory_order_relaxed);
+    atomic_store_explicit(&config_seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+}
+
+static void config_write_end(void)
+{
+    unsigned seq = atomic_load_explicit(&config_seq, memory_order_relaxed);
+    atomic_store_explicit(&config_seq, seq + 1, memory_order_release);
+}
+
+/* Start or restart the commit delay, under config_lock. Restarting the
+ * timer batches a burst of changes into one commit */
+static void config_schedule(void)
+{
+    esp_timer_stop(config_timer);
+    esp_timer_start_once(config_timer, CONFIG_WEBSTER_CONFIG_COMMIT_MS * 1000ULL);
+}
+
+/* Take a consistent copy, retrying if a writer was mid-update */
+void config_get(config_t *cfg)
+{
+    unsigned seq;
+
+    do {
+        seq = atomic_load_explicit(&config_seq, memory_order_acquire);
+        memcpy(cfg, &config_ram.cfg, sizeof(*cfg));
+        atomic_thread_fence(memory_order_acquire);
+    } while ((seq & 1) || seq != atomic_load_explicit(&config_seq, memory_order_relaxed));
+}
+
+static void config_prof_key(const char *name, char *key)
+{
+    strcpy(key, "P_");
+    strcat(key, name);
+}
+
+/* Write what changed in the copy taken by config_flush() */
+static esp_err_t config_write(nvs_handle_t nvsHandle, const config_state_t *out)
+{
+    char key[16];
+    esp_err_t err = ESP_OK;
+
+    for (int i = 0; i < CFG_FIELDS && err == ESP_OK; i++) {
+        const config_desc_t *d = &config_desc[i];
+        const char *p = (const char *)&out->cfg + d->offset;
+
+        if (!(out->dirty & (1u << i)))
+            continue;
+        if (d->type == CFG_STR)
+            err = nvs_set_str(nvsHandle, d->key, p);
+        else
+            err = nvs_set_u8(nvsHandle, d->key, *(const uint8_t *)p);
+    }
+    for (int i = 0; i < CFG_RECS && err == ESP_OK; i++) {
+        const config_desc_t *d = &config_rec_desc[i];
+        const config_rec_buf_t *r = &out->recs[i];
+        uint32_t v;
+
+        if (!(out->rec_dirty & (1u << i)))
+            continue;
+        if (!r->present) {
+            err = nvs_erase_key(nvsHandle, d->key);
+        } else if (d->type == CFG_U32) {
+            memcpy(&v, r->data, sizeof(v));
+            err = nvs_set_u32(nvsHandle, d->key, v);
+        } else {
+            err = nvs_set_blob(nvsHandle, d->key, r->data, r->len);
+        }
+        if (err == ESP_ERR_NVS_NOT_FOUND)
+            err = ESP_OK;
+    }
+    for (int i = 0; i < CFG_PROFILES && err == ESP_OK; i++) {
+        const config_prof_t *s = &out->profs[i];
+
+        if (!(out->prof_dirty & (1u << i)))
+            continue;
+        config_prof_key(s->prof.name, key);
+        if (s->used)
+            err = nvs_set_blob(nvsHandle, key, &s->prof, sizeof(s->prof));
+        else if ((err = nvs_erase_key(nvsHandle, key)) == ESP_ERR_NVS_NOT_FOUND)
+            err = ESP_OK;
+    }
+    if (err == ESP_OK && out->ver_dirty)
+        err = nvs_set_u16(nvsHandle, "CFG_VER", CONFIG_SCHEMA_VERSION);
+    return err;
+}
+
+/* Write every change with one commit */
+esp_err_t config_flush(void)
+{
+    nvs_handle_t nvsHandle;
+    config_state_t *out = &config_out;
+    esp_err_t err;
+
+    xSemaphoreTake(config_flush_lock, portMAX_DELAY);
+    xSemaphoreTake(config_lock, portMAX_DELAY);
+    if (config_ram.dirty == 0 && config_ram.rec_dirty == 0 && config_ram.prof_dirty == 0 &&
+        !config_ram.ver_dirty) {
+        xSemaphoreGive(config_lock);
+        xSemaphoreGive(config_flush_lock);
+        return ESP_OK;
+    }
+    *out = config_ram;
+    config_prof_flushing = out->prof_dirty;
+    config_ram.dirty = config_ram.rec_dirty = config_ram.prof_dirty = 0;
+    config_ram.ver_dirty = false;
+    xSemaphoreGive(config_lock);
+
+    err = nvs_open("storage", NVS_READWRITE, &nvsHandle);
+    if (err == ESP_OK) {
+        err = config_write(nvsHandle, out);
+        if (err == ESP_OK)
+            err = nvs_commit(nvsHandle);
+        nvs_close(nvsHandle);
+    }
+
+    xSemaphoreTake(config_lock, portMAX_DELAY);
+    if (err == ESP_OK) {
+        ESP_LOGI(TAG, "Committed 0x%"PRIx32" 0x%"PRIx32" 0x%"PRIx32, out->dirty, out->rec_dirty, out->prof_dirty);
+    } else {
+        // Keep them dirty so the next change retries them
+        ESP_LOGI(TAG, "Error (%s) writing settings to NVS", esp_err_to_name(err));
+        config_ram.dirty |= out->dirty;
+        config_ram.rec_dirty |= out->rec_dirty;
+        config_ram.prof_dirty |= out->prof_dirty;
+        config_ram.ver_dirty |= out->ver_dirty;
+    }
+    config_prof_flushing = 0;
+    xSemaphoreGive(config_lock);
+    xSemaphoreGive(config_flush_lock);
+    return err;
+}
+
+/* Flash writes can stall for tens of milliseconds, far too long for
+ * the esp_timer task, which also times the key sequencer */
+static void config_task(void *arg)
+{
+    while (1) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        config_flush();
+    }
+}
+
+static void config_timer_cb(void *arg)
+{
+    xTaskNotifyGive(config_task_handle);
+}
+
+/* Nothing may be left in RAM only across esp_restart() */
+static void config_shutdown(void)
+{
+    config_flush();
+}
+
+/* Update one field in RAM if it differs, and schedule the flush */
+static esp_err_t config_set(config_field_t field, const void *value, size_t len, bool *changed)
+{
+    const config_desc_t *d = &config_desc[field];
+    char *p = (char *)&config_ram.cfg + d->offset;
+
+    xSemaphoreTake(config_lock, portMAX_DELAY);
+    if (memcmp(p, value, len) == 0 && (d->type != CFG_STR || p[len] == '\0')) {
+        xSemaphoreGive(config_lock);
+        return ESP_OK;
+    }
+
+    config_write_begin();
+    memset(p, 0, d->size);
+    memcpy(p, value, len);
+    config_write_end();
+
+    config_ram.dirty |= 1u << field;
+    if (changed)
+        *changed = true;
+    config_schedule();
+    xSemaphoreGive(config_lock);
+    return ESP_OK;
+}
+
+esp_err_t config_set_str(config_field_t field, const char *value, bool *changed)
+{
+    size_t len = strlen(value);
+
+    if (field >= CFG_FIELDS || config_desc[field].type != CFG_STR)
+        return ESP_ERR_INVALID_ARG;
+    if (len >= config_desc[field].size)
+        return ESP_ERR_INVALID_SIZE;
+    return config_set(field, value, len, changed);
+}
+
+esp_err_t config_set_u8(config_field_t field, uint8_t value, bool *changed)
+{
+    if (field >= CFG_FIELDS || config_desc[field].type != CFG_U8)
+        return ESP_ERR_INVALID_ARG;
+    return config_set(field, &value, sizeof(value), changed);
+}
+
+/* Copy out a record, ESP_ERR_NOT_FOUND if none is stored */
+esp_err_t config_get_rec(config_rec_t rec, void *data, size_t len)
+{
+    esp_err_t err = ESP_OK;
+
+    if (rec >= CFG_RECS)
+        return ESP_ERR_INVALID_ARG;
+    xSemaphoreTake(config_lock, portMAX_DELAY);
+    if (!config_ram.recs[rec].present)
+        err = ESP_ERR_NOT_FOUND;
+    else if (config_ram.recs[rec].len != len)
+        err = ESP_ERR_INVALID_SIZE;     // stored by an older layout
+    else
+        memcpy(data, config_ram.recs[rec].data, len);
+    xSemaphoreGive(config_lock);
+    return err;
+}
+
+/* Replace a record, or erase it if data is NULL. Only a change is written */
+esp_err_t config_set_rec(config_rec_t rec, const void *data, size_t len)
+{
+    config_rec_buf_t *r;
+
+    if (rec >= CFG_RECS || (data && (len == 0 || len > config_rec_desc[rec].size)))
+        return ESP_ERR_INVALID_ARG;
+    r = &config_ram.recs[rec];
+    xSemaphoreTake(config_lock, portMAX_DELAY);
+    if (data ? (r->present && r->len == len && memcmp(r->data, data, len) == 0) : !r->present) {
+        xSemaphoreGive(config_lock);
+        return ESP_OK;
+    }
+    if (data)
+        memcpy(r->data, data, len);
+    r->len = data ? len : 0;
+    r->present = data != NULL;
+    config_ram.rec_dirty |= 1u << rec;
+    config_schedule();
+    xSemaphoreGive(config_lock);
+    return ESP_OK;
+}
+
+static bool config_prof_name_ok(const char *name)
+{
+    size_t len = strlen(name);
+
+    return len > 0 && len < SEQ_PROFILE_NAME_LEN;
+}
+
+/* Slot holding a profile, or -1. Readers call it in a sequence count retry */
+static int config_prof_find(const char *name)
+{
+    for (int i = 0; i < CFG_PROFILES; i++) {
+        if (config_ram.profs[i].used &&
+            strncmp(config_ram.profs[i].prof.name, name, SEQ_PROFILE_NAME_LEN) == 0)
+            return i;
+    }
+    return -1;
+}
+
+/* Copy out a stored profile, ESP_ERR_NOT_FOUND if there is none */
+esp_err_t config_get_profile(const char *name, seq_profile_t *prof)
+{
+    unsigned seq;
+    int slot;
+
+    if (!config_prof_name_ok(name))
+        return ESP_ERR_INVALID_ARG;
+    do {
+        seq = atomic_load_explicit(&config_seq, memory_order_acquire);
+        slot = config_prof_find(name);
+        if (slot >= 0)
+            memcpy(prof, &config_ram.profs[slot].prof, sizeof(*prof));
+        atomic_thread_fence(memory_order_acquire);
+    } while ((seq & 1) || seq != atomic_load_explicit(&config_seq, memory_order_relaxed));
+    return slot >= 0 ? ESP_OK : ESP_ERR_NOT_FOUND;
+}
+
+/* Store a profile, replacing one of the same name */
+esp_err_t config_set_profile(const seq_profile_t *prof)
+{
+    int slot;
+
+    if (!config_prof_name_ok(prof->name))
+        return ESP_ERR_INVALID_ARG;
+    xSemaphoreTake(config_lock, portMAX_DELAY);
+    slot = config_prof_find(prof->name);
+    if (slot >= 0 && memcmp(&config_ram.profs[slot].prof, prof, sizeof(*prof)) == 0) {
+        xSemaphoreGive(config_lock);
+        return ESP_OK;
+    }
+    // A slot waiting to have its key erased is not free yet
+    for (int i = 0; i < CFG_PROFILES && slot < 0; i++) {
+        uint32_t bit = 1u << i;
+        if (!config_ram.profs[i].used && !((config_ram.prof_dirty | config_prof_flushing) & bit))
+            slot = i;
+    }
+    if (slot < 0) {
+        xSemaphoreGive(config_lock);
+        ESP_LOGI(TAG, "No room for profile %s", prof->name);
+        return ESP_ERR_NO_MEM;
+    }
+    config_write_begin();
+    config_ram.profs[slot].prof = *prof;
+    config_ram.profs[slot].used = true;
+    config_write_end();
+    config_ram.prof_dirty |= 1u << slot;
+    config_schedule();
+    xSemaphoreGive(config_lock);
+    return ESP_OK;
+}
+
+/* Remove a stored profile, its slot is free again once the key is erased */
+esp_err_t config_delete_profile(const char *name)
+{
+    int slot;
+
+    if (!config_prof_name_ok(name))
+        return ESP_ERR_INVALID_ARG;
+    xSemaphoreTake(config_lock, portMAX_DELAY);
+    if ((slot = config_prof_find(name)) < 0) {
+        xSemaphoreGive(config_lock);
+        return ESP_ERR_NOT_FOUND;
+    }
+    config_write_begin();
+    config_ram.profs[slot].used = false;
+    config_write_end();
+    config_ram.prof_dirty |= 1u << slot;
+    config_schedule();
+    xSemaphoreGive(config_lock);
+    return ESP_OK;
+}
+
+/* Copy out up to max stored profiles, returns the number copied */
+int config_list_profiles(seq_profile_t *profs, int max)
+{
+    unsigned seq;
+    int count;
+
+    do {
+        seq = atomic_load_explicit(&config_seq, memory_order_acquire);
+        count = 0;
+        for (int i = 0; i < CFG_PROFILES && count < max; i++) {
+            if (config_ram.profs[i].used)
+                memcpy(&profs[count++], &config_ram.profs[i].prof, sizeof(*profs));
+        }
+        atomic_thread_fence(memory_order_acquire);
+    } while ((seq & 1) || seq != atomic_load_explicit(&config_seq, memory_order_relaxed));
+    return count;
+}
+
+/* Read every record, a missing or unreadable one is left absent */
+static void config_load_recs(nvs_handle_t nvsHandle)
+{
+    for (int i = 0; i < CFG_RECS; i++) {
+        const config_desc_t *d = &config_rec_desc[i];
+        config_rec_buf_t *r = &config_ram.recs[i];
+        size_t len = sizeof(r->data);
+        uint32_t v;
+        esp_err_t err;
+
+        if (d->type == CFG_U32) {
+            if ((err = nvs_get_u32(nvsHandle, d->key, &v)) == ESP_OK)
+                memcpy(r->data, &v, sizeof(v));
+            len = sizeof(v);
+        } else {
+            err = nvs_get_blob(nvsHandle, d->key, r->data, &len);
+        }
+        r->present = (err == ESP_OK);
+        r->len = r->present ? len : 0;
+        if (err != ESP_OK && err != ESP_ERR_NVS_NOT_FOUND)
+            ESP_LOGI(TAG, "Error (%s) reading %s", esp_err_to_name(err), d->key);
+    }
+}
+
+/* Read the stored profiles into free slots */
+static void config_load_profiles(nvs_handle_t nvsHandle)
+{
+    nvs_iterator_t it = NULL;
+    nvs_entry_info_t info;
+    int count = 0;
+
+    esp_err_t err = nvs_entry_find(NVS_DEFAULT_PART_NAME, "storage", NVS_TYPE_BLOB, &it);
+    while (err == ESP_OK) {
+        seq_profile_t *prof = &config_ram.profs[count].prof;
+        size_t len = sizeof(*prof);
+
+        nvs_entry_info(it, &info);
+        if (strncmp(info.key, "P_", 2) == 0) {
+            if (count == CFG_PROFILES) {
+                ESP_LOGW(TAG, "More than %d profiles, %s not loaded", CFG_PROFILES, info.key + 2);
+            } else if (nvs_get_blob(nvsHandle, info.key, prof, &len) == ESP_OK &&
+                       len == sizeof(*prof)) {
+                // The key is what it is filed under, whatever the blob says
+                strlcpy(prof->name, info.key + 2, sizeof(prof->name));
+                config_ram.profs[count++].used = true;
+            }
+        }
+        err = nvs_entry_next(&it);
+    }
+    nvs_release_iterator(it);
+}
+
+/* Load every setting, must run after nvs_init() and before any reader */
+void config_init(void)
+{
+    nvs_handle_t nvsHandle;
+    uint16_t ver = 0;
+
+    config_lock = xSemaphoreCreateMutex();
+    config_flush_lock = xSemaphoreCreateMutex();
+    const esp_timer_create_args_t timer_args = {
+        .callback = config_timer_cb,
+        .name = "config",
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&timer_args, &config_timer));
+    xTaskCreatePinnedToCore(config_task, "config", 3072, NULL, COMMIT_TASK_PRIORITY, &config_task_handle,
+                            TASK_CORE_NET);
+    esp_register_shutdown_handler(config_shutdown);
+
+    config_ram.cfg = config_defaults;
+    if (nvs_open("storage", NVS_READONLY, &nvsHandle) != ESP_OK) {
+        ESP_LOGI(TAG, "No stored settings, using defaults");
+        return;
+    }
+    nvs_get_u16(nvsHandle, "CFG_VER", &ver);
+    for (int i = 0; i < CFG_FIELDS; i++) {
+        const config_desc_t *d = &config_desc[i];
+        char *p = (char *)&config_ram.cfg + d->offset;
+        size_t len = d->size;
+        esp_err_t err;
+
+        if (d->type == CFG_STR)
+            err = nvs_get_str(nvsHandle, d->key, p, &len);
+        else
+            err = nvs_get_u8(nvsHandle, d->key, (uint8_t *)p);
+        if (err != ESP_OK) {
+            // A failed read may have left part of a value behind
+            memcpy(p, (const char *)&config_defaults + d->offset, d->size);
+            if (err != ESP_ERR_NVS_NOT_FOUND)
+                ESP_LOGI(TAG, "Error (%s) reading %s, using default", esp_err_to_name(err), d->key);
+        }
+    }
+    config_load_recs(nvsHandle);
+    config_load_profiles(nvsHandle);
+    nvs_close(nvsHandle);
+
+    // Version 0 is the same set of keys written before the version existed
+    if (ver > CONFIG_SCHEMA_VERSION)
+        ESP_LOGW(TAG, "Settings are from a newer schema (%u)", ver);
+    else if (ver < CONFIG_SCHEMA_VERSION) {
+        config_ram.ver_dirty = true;
+        config_schedule();
+    }
+}
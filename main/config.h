@@ -0,0 +1,69 @@
+/*
+ * Settings cache
+ *
+ * Every setting is loaded from NVS once at boot, falling back to the
+ * Kconfig default, and kept in RAM. Reads take a consistent copy without
+ * a lock. Changes update RAM at once and are written to NVS together,
+ * with a single commit, a short while after the last one.
+ *
+ * Timing profiles and a few records other modules keep across reboots
+ * are cached and written the same way.
+ */
+
+#ifndef CONFIG_H_
+#define CONFIG_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+#include "seq.h"
+
+/* Bump when a key changes meaning, and add the migration to config_init() */
+#define CONFIG_SCHEMA_VERSION   1
+
+typedef struct {
+    char wifi_ssid[33];
+    char wifi_pass[65];
+    uint8_t wifi_ps;        // index into the WiFi power save modes
+    uint8_t http_sockets;   // open connections the server accepts
+    uint8_t http_timeout;   // seconds a send or receive may stall
+    uint8_t http_rate;      // requests per second per client, 0 = no limit
+    uint8_t http_burst;     // requests a client may make at once
+} config_t;
+
+typedef enum {
+    CFG_WIFI_SSID,
+    CFG_WIFI_PASS,
+    CFG_WIFI_PS,
+    CFG_HTTP_SOCKETS,
+    CFG_HTTP_TIMEOUT,
+    CFG_HTTP_RATE,
+    CFG_HTTP_BURST,
+    CFG_FIELDS
+} config_field_t;
+
+/* Records owned by other modules, stored whole under their own key */
+typedef enum {
+    CFG_REC_ARMED,          // seq_cmd_t of the armed selection
+    CFG_REC_WIFI_CACHE,     // last good AP and lease
+    CFG_REC_UDP_SEQ,        // uint32_t bound on UDP sequence numbers
+    CFG_RECS
+} config_rec_t;
+
+#define CFG_REC_SIZE        64      // largest record
+#define CFG_PROFILES        8       // stored timing profiles
+
+void config_init(void);
+void config_get(config_t *cfg);
+esp_err_t config_set_str(config_field_t field, const char *value, bool *changed);
+esp_err_t config_set_u8(config_field_t field, uint8_t value, bool *changed);
+esp_err_t config_flush(void);
+esp_err_t config_get_rec(config_rec_t rec, void *data, size_t len);
+esp_err_t config_set_rec(config_rec_t rec, const void *data, size_t len);
+esp_err_t config_get_profile(const char *name, seq_profile_t *prof);
+esp_err_t config_set_profile(const seq_profile_t *prof);
+esp_err_t config_delete_profile(const char *name);
+int config_list_profiles(seq_profile_t *profs, int max);
+
+#endif /* CONFIG_H_ */
@@ -0,0 +1,331 @@
+/*
+ * Incremental form parser
+ *
+ * A byte at a time state machine, so a key, a value or even a %xx or
+ * \uXXXX escape may be split across any number of chunks.
+ */
+
+#include <string.h>
+#include "form.h"
+
+enum {
+    // x-www-form-urlencoded
+    U_KEY,
+    U_VALUE,
+    U_PCT,          // %xx, esc_state is U_KEY or U_VALUE
+    // JSON
+    J_START,        // before '{'
+    J_KEY_WAIT,     // before a key's '"', or '}' of an empty object
+    J_KEY,
+    J_COLON,
+    J_VALUE_WAIT,
+    J_STRING,
+    J_LITERAL,      // number, true or false stored as text, null as absent
+    J_COMMA,        // after a value
+    J_END,          // after '}'
+    J_ESC,          // after '\', esc_state is J_KEY or J_STRING
+    J_UHEX,         // \uXXXX
+};
+
+static int hex_val(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+static bool is_space(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+/* Store one decoded byte in the key or the current field */
+static void emit(form_parser_t *p, char c)
+{
+    if (!p->in_value) {
+        // A key too long for any field is marked by key_len == FORM_KEY_LEN
+        if (p->key_len < FORM_KEY_LEN - 1)
+            p->key[p->key_len++] = c;
+        else
+            p->key_len = FORM_KEY_LEN;
+        return;
+    }
+    if (p->field == NULL)
+        return;
+    if (p->field->len + 1 < p->field->size) {
+        p->field->value[p->field->len++] = c;
+        p->field->value[p->field->len] = '\0';
+    } else {
+        p->field->overflow = true;
+    }
+}
+
+/* Key complete, point the value at its field if it is one we want */
+static void start_value(form_parser_t *p)
+{
+    p->field = NULL;
+    p->in_value = true;
+    if (p->key_len >= FORM_KEY_LEN)
+        return;
+    p->key[p->key_len] = '\0';
+    for (int i = 0; i < p->count; i++) {
+        if (strcmp(p->fields[i].name, p->key) == 0) {
+            p->field = &p->fields[i];
+            p->field->len = 0;
+            p->field->value[0] = '\0';
+            p->field->present = true;
+            p->field->overflow = false;
+            return;
+        }
+    }
+}
+
+static void end_pair(form_parser_t *p)
+{
+    p->in_value = false;
+    p->key_len = 0;
+    p->field = NULL;
+}
+
+/* Note one byte of a bare literal, for end_literal() */
+static void lit_char(form_parser_t *p, char c)
+{
+    if (p->lit_len < 4 && c != "null"[p->lit_len])
+        p->lit_null = false;
+    if (p->lit_len < 5)
+        p->lit_len++;
+    emit(p, c);
+}
+
+/* A literal is over. null means the field was not given, anything
+ * else is only accepted for a number field */
+static esp_err_t end_literal(form_parser_t *p)
+{
+    form_field_t *f = p->field;
+
+    if (f != NULL) {
+        if (p->lit_null && p->lit_len == 4) {
+            f->len = 0;
+            f->value[0] = '\0';
+            f->present = false;
+            f->overflow = false;
+        } else if (!f->number) {
+            return ESP_ERR_INVALID_ARG;
+        }
+    }
+    end_pair(p);
+    return ESP_OK;
+}
+
+/* Code point from \uXXXX as UTF-8, surrogates are passed through as is */
+static void emit_utf8(form_parser_t *p, uint32_t cp)
+{
+    if (cp < 0x80) {
+        emit(p, cp);
+    } else if (cp < 0x800) {
+        emit(p, 0xc0 | (cp >> 6));
+        emit(p, 0x80 | (cp & 0x3f));
+    } else {
+        emit(p, 0xe0 | (cp >> 12));
+        emit(p, 0x80 | ((cp >> 6) & 0x3f));
+        emit(p, 0x80 | (cp & 0x3f));
+    }
+}
+
+static esp_err_t feed_url(form_parser_t *p, char c)
+{
+    int v;
+
+    switch (p->state) {
+    case U_PCT:
+        if ((v = hex_val(c)) < 0)
+            return ESP_ERR_INVALID_ARG;
+        p->hex = (p->hex << 4) | v;
+        if (++p->hex_digits == 2) {
+            p->state = p->esc_state;
+            emit(p, p->hex);
+        }
+        return ESP_OK;
+    case U_KEY:
+        if (c == '=') {
+            start_value(p);
+            p->state = U_VALUE;
+            return ESP_OK;
+        }
+        break;
+    case U_VALUE:
+        break;
+    default:
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    // Key or value text, a bare key without '=' is ignored
+    if (c == '&') {
+        end_pair(p);
+        p->state = U_KEY;
+    } else if (c == '%') {
+        p->esc_state = p->state;
+        p->state = U_PCT;
+        p->hex = 0;
+        p->hex_digits = 0;
+    } else {
+        emit(p, c == '+' ? ' ' : c);
+    }
+    return ESP_OK;
+}
+
+static esp_err_t feed_json(form_parser_t *p, char c)
+{
+    int v;
+
+    switch (p->state) {
+    case J_START:
+        if (c == '{')
+            p->state = J_KEY_WAIT;
+        else if (!is_space(c))
+            return ESP_ERR_INVALID_ARG;
+        break;
+    case J_KEY_WAIT:
+        if (c == '"')
+            p->state = J_KEY;
+        else if (c == '}')
+            p->state = J_END;
+        else if (!is_space(c))
+            return ESP_ERR_INVALID_ARG;
+        break;
+    case J_KEY:
+    case J_STRING:
+        if (c == '\\') {
+            p->esc_state = p->state;
+            p->state = J_ESC;
+        } else if (c == '"' && p->state == J_KEY) {
+            p->state = J_COLON;
+        } else if (c == '"') {
+            end_pair(p);
+            p->state = J_COMMA;
+        } else if ((unsigned char)c < 0x20) {
+            return ESP_ERR_INVALID_ARG;
+        } else {
+            emit(p, c);
+        }
+        break;
+    case J_ESC:
+        p->state = p->esc_state;
+        switch (c) {
+        case 'b': emit(p, '\b'); break;
+        case 'f': emit(p, '\f'); break;
+        case 'n': emit(p, '\n'); break;
+        case 'r': emit(p, '\r'); break;
+        case 't': emit(p, '\t'); break;
+        case '"': case '\\': case '/': emit(p, c); break;
+        case 'u':
+            p->state = J_UHEX;
+            p->hex = 0;
+            p->hex_digits = 0;
+            break;
+        default:
+            return ESP_ERR_INVALID_ARG;
+        }
+        break;
+    case J_UHEX:
+        if ((v = hex_val(c)) < 0)
+            return ESP_ERR_INVALID_ARG;
+        p->hex = (p->hex << 4) | v;
+        if (++p->hex_digits == 4) {
+            p->state = p->esc_state;
+            emit_utf8(p, p->hex);
+        }
+        break;
+    case J_COLON:
+        if (c == ':') {
+            start_value(p);
+            p->state = J_VALUE_WAIT;
+        } else if (!is_space(c)) {
+            return ESP_ERR_INVALID_ARG;
+        }
+        break;
+    case J_VALUE_WAIT:
+        if (c == '"') {
+            p->state = J_STRING;
+        } else if (c == '{' || c == '[' || c == ',' || c == '}') {
+            // Nested values are not supported
+            return ESP_ERR_INVALID_ARG;
+        } else if (!is_space(c)) {
+            p->state = J_LITERAL;
+            p->lit_len = 0;
+            p->lit_null = true;
+            lit_char(p, c);
+        }
+        break;
+    case J_LITERAL:
+        if (c == ',' || c == '}' || is_space(c)) {
+            if (end_literal(p) != ESP_OK)
+                return ESP_ERR_INVALID_ARG;
+            p->state = (c == ',') ? J_KEY_WAIT : (c == '}') ? J_END : J_COMMA;
+        } else if (c == '"' || c == '{' || c == '[') {
+            return ESP_ERR_INVALID_ARG;
+        } else {
+            lit_char(p, c);
+        }
+        break;
+    case J_COMMA:
+        if (c == ',')
+            p->state = J_KEY_WAIT;
+        else if (c == '}')
+            p->state = J_END;
+        else if (!is_space(c))
+            return ESP_ERR_INVALID_ARG;
+        break;
+    case J_END:
+        if (!is_space(c))
+            return ESP_ERR_INVALID_ARG;
+        break;
+    default:
+        return ESP_ERR_INVALID_STATE;
+    }
+    return ESP_OK;
+}
+
+/* Start parsing, fields are reset to absent and empty */
+void form_init(form_parser_t *p, form_field_t *fields, int count, bool json)
+{
+    memset(p, 0, sizeof(*p));
+    p->fields = fields;
+    p->count = count;
+    p->json = json;
+    p->state = json ? J_START : U_KEY;
+    for (int i = 0; i < count; i++) {
+        fields[i].len = 0;
+        fields[i].value[0] = '\0';
+        fields[i].present = false;
+        fields[i].overflow = false;
+    }
+}
+
+/* Parse the next chunk of the body */
+esp_err_t form_feed(form_parser_t *p, const char *data, size_t len)
+{
+    esp_err_t err;
+
+    for (size_t i = 0; i < len; i++) {
+        err = p->json ? feed_json(p, data[i]) : feed_url(p, data[i]);
+        if (err != ESP_OK)
+            return err;
+    }
+    return ESP_OK;
+}
+
+/* End of body, fails if it stopped part way through */
+esp_err_t form_finish(form_parser_t *p)
+{
+    if (p->json)
+        return (p->state == J_END) ? ESP_OK : ESP_ERR_INVALID_SIZE;
+    if (p->state == U_PCT)
+        return ESP_ERR_INVALID_SIZE;
+    end_pair(p);
+    return ESP_OK;
+}
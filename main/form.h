@@ -0,0 +1,50 @@
+/*
+ * Incremental form parser
+ *
+ * Parses an application/x-www-form-urlencoded body, or a flat JSON
+ * object of string (or, for number fields, bare literal) values, as it
+ * arrives in chunks of any size. A JSON null leaves the field absent. Values of the fields asked for are decoded straight into the
+ * caller's buffers, everything else is skipped without being stored.
+ */
+
+#ifndef FORM_H_
+#define FORM_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+
+#define FORM_KEY_LEN    16      // longer keys cannot match a field
+
+typedef struct {
+    const char *name;
+    char *value;            // decoded, always NUL terminated
+    size_t size;
+    size_t len;
+    bool number;            // a JSON value may be a bare literal, else only a string
+    bool present;           // key appeared, last occurrence wins
+    bool overflow;          // value did not fit and was truncated
+} form_field_t;
+
+typedef struct {
+    form_field_t *fields;
+    int count;
+    bool json;
+    uint8_t state;
+    uint8_t esc_state;      // state to return to after an escape
+    bool in_value;          // decoded bytes go to the field, else the key
+    char key[FORM_KEY_LEN];
+    uint8_t key_len;
+    form_field_t *field;    // where the current value goes, NULL to skip
+    uint32_t hex;           // escape being collected
+    uint8_t hex_digits;
+    uint8_t lit_len;        // bare literal length, up to 5
+    bool lit_null;          // literal so far matches "null"
+} form_parser_t;
+
+void form_init(form_parser_t *p, form_field_t *fields, int count, bool json);
+esp_err_t form_feed(form_parser_t *p, const char *data, size_t len);
+esp_err_t form_finish(form_parser_t *p);
+
+#endif /* FORM_H_ */
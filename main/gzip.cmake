@@ -0,0 +1,12 @@
+# Gzip one file next to itself, run as
+#     cmake -DIN=<file> -P gzip.cmake
+#
+# Used for the compressed OTA image, which /update inflates on the fly
+
+if (NOT IN)
+    message(FATAL_ERROR "gzip.cmake: set IN to the file to compress")
+endif()
+
+# A raw archive of one file is just the gzipped file
+file(ARCHIVE_CREATE OUTPUT ${IN}.gz PATHS ${IN}
+     FORMAT raw COMPRESSION GZip COMPRESSION_LEVEL 9)
@@ -11,26 +11,115 @@
 #include <esp_event.h>
 #include <esp_log.h>
 #include <esp_system.h>
+#include <stdlib.h>
 #include <nvs_flash.h>
 #include <sys/param.h>
 #include "nvs_flash.h"
 #include "esp_netif.h"
 
+#include <stdatomic.h>
 #include <esp_http_server.h>
+#include <esp_timer.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include <mbedtls/sha256.h>
+#include "lwip/sockets.h"
+#include "admit.h"
+#include "config.h"
+#include "form.h"
+#include "metrics.h"
+#include "pool.h"
+#include "seq.h"
+#include "stage.h"
+#include "tasks.h"
+#include "wifi.h"
+#include "www-data/assets.h"
 
 static const char *TAG = "httpd";
 
+/* Longest wait for the OTA writer to hand back a buffer */
+#define OTA_BUF_WAIT    pdMS_TO_TICKS(5000)
+
 esp_err_t ota_init(void);
-esp_err_t ota_write(char *, int);
+char *ota_buf_get(TickType_t);
+void ota_buf_put(char *);
+esp_err_t ota_buf_write(char *, int);
+esp_err_t ota_buf_drain(void);
 esp_err_t ota_finish(esp_err_t);
+void ota_stats(uint32_t *, uint32_t *);
+esp_err_t ota_chunk_start(uint32_t, uint32_t);
+bool ota_chunk_done(uint32_t);
+uint32_t ota_chunk_offset(uint32_t *);
+bool wol_parse_mac(const char *, uint8_t *);
+esp_err_t wol_send(const uint8_t *, uint32_t, uint16_t);
+esp_err_t logring_send(httpd_req_t *, unsigned);
+
+/* Embedded web asset, see assets.cmake */
+typedef struct {
+    const char *type;
+    const char *cache;
+    const char *etag;
+    const char *etag_gz;
+    const unsigned char *start;
+    const unsigned char *end;
+    const unsigned char *gz_start;
+    const unsigned char *gz_end;
+} asset_t;
+
+#define ASSET(name, id, mime, cache_ctl) {                              \
+    .type = mime, .cache = cache_ctl,                                   \
+    .etag = ASSET_##id##_ETAG, .etag_gz = ASSET_##id##_ETAG_GZ,         \
+    .start = _binary_##name##_min_start, .end = _binary_##name##_min_end, \
+    .gz_start = _binary_##name##_gz_start, .gz_end = _binary_##name##_gz_end }
+
+extern const unsigned char _binary_index_html_min_start[], _binary_index_html_min_end[];
+extern const unsigned char _binary_index_html_gz_start[], _binary_index_html_gz_end[];
+extern const unsigned char _binary_config_html_min_start[], _binary_config_html_min_end[];
+extern const unsigned char _binary_config_html_gz_start[], _binary_config_html_gz_end[];
+extern const unsigned char _binary_favicon_ico_min_start[], _binary_favicon_ico_min_end[];
+extern const unsigned char _binary_favicon_ico_gz_start[], _binary_favicon_ico_gz_end[];
+
+static const asset_t index_html = ASSET(index_html, INDEX_HTML, "text/html", "no-cache");
+static const asset_t config_html = ASSET(config_html, CONFIG_HTML, "text/html", "no-cache");
+static const asset_t favicon_ico = ASSET(favicon_ico, FAVICON_ICO, "image/x-icon", "max-age=604800");
+
+/* Send an embedded asset, gzipped when the client accepts it and
+ * as 304 Not Modified when the client already has this version */
+static esp_err_t asset_send(httpd_req_t *req, const asset_t *asset)
+{
+    char hdr[64];
+    const char *etag;
+    bool gzip;
+
+    // A truncated header still holds the start of the list
+    hdr[0] = '\0';
+    httpd_req_get_hdr_value_str(req, "Accept-Encoding", hdr, sizeof(hdr));
+    gzip = (strstr(hdr, "gzip") != NULL);
+    etag = gzip ? asset->etag_gz : asset->etag;
+
+    httpd_resp_set_hdr(req, "ETag", etag);
+    httpd_resp_set_hdr(req, "Cache-Control", asset->cache);
+    httpd_resp_set_hdr(req, "Vary", "Accept-Encoding");
+
+    // If-None-Match may hold a list of tags, any match will do
+    if (httpd_req_get_hdr_value_str(req, "If-None-Match", hdr, sizeof(hdr)) == ESP_OK &&
+        strstr(hdr, etag) != NULL) {
+        httpd_resp_set_status(req, "304 Not Modified");
+        return httpd_resp_send(req, NULL, 0);
+    }
+
+    httpd_resp_set_type(req, asset->type);
+    if (gzip) {
+        httpd_resp_set_hdr(req, "Content-Encoding", "gzip");
+        return httpd_resp_send(req, (const char *)asset->gz_start, asset->gz_end - asset->gz_start);
+    }
+    return httpd_resp_send(req, (const char *)asset->start, asset->end - asset->start);
+}
 
 /* Handler to respond with home page */
 static esp_err_t index_html_get_handler(httpd_req_t *req)
 {
-    extern const unsigned char index_html_start[] asm("_binary_index_html_start");
-    extern const unsigned char index_html_end[]   asm("_binary_index_html_end");
-    const size_t index_html_size = (index_html_end - index_html_start);
-    httpd_resp_send(req, (const char *)index_html_start, index_html_size);
+    asset_send(req, &index_html);
     return ESP_OK;
 }
 
@@ -47,21 +136,14 @@ static esp_err_t root_get_handler(httpd_req_t *req)
  * Browsers expect to GET website icon at URI /favicon.ico. */
 static esp_err_t favicon_get_handler(httpd_req_t *req)
 {
-    extern const unsigned char favicon_ico_start[] asm("_binary_favicon_ico_start");
-    extern const unsigned char favicon_ico_end[]   asm("_binary_favicon_ico_end");
-    const size_t favicon_ico_size = (favicon_ico_end - favicon_ico_start);
-    httpd_resp_set_type(req, "image/x-icon");
-    httpd_resp_send(req, (const char *)favicon_ico_start, favicon_ico_size);
+    asset_send(req, &favicon_ico);
     return ESP_OK;
 }
 
 /* Handler to respond with configuration page */
 static esp_err_t config_html_get_handler(httpd_req_t *req)
 {
-    extern const unsigned char config_html_start[] asm("_binary_config_html_start");
-    extern const unsigned char config_html_end[]   asm("_binary_config_html_end");
-    const size_t config_html_size = (config_html_end - config_html_start);
-    httpd_resp_send(req, (const char *)config_html_start, config_html_size);
+    asset_send(req, &config_html);
     return ESP_OK;
 }
 
@@ -74,176 +156,692 @@ static esp_err_t config_get_handler(httpd_req_t *req)
     return ESP_OK;
 }
 
-/* Handler to respond to wildcard URI and direct the reponse */
-static esp_err_t get_handler(httpd_req_t *req)
+/* Handler to list timing profiles */
+static esp_err_t profile_get_handler(httpd_req_t *req)
 {
-    /* Return one of a limited number of supported paths */
-    if (strcmp(req->uri, "/") == 0) {
-        return root_get_handler(req);
-    } else if (strcmp(req->uri, "/index.html") == 0) {
-        return index_html_get_handler(req);
-    } else if (strcmp(req->uri, "/favicon.ico") == 0) {
-        return favicon_get_handler(req);
-    } else if (strcmp(req->uri, "/config.html") == 0) {
-        return config_html_get_handler(req);
-    } else if (strcmp(req->uri, "/config") == 0) {
-        return config_get_handler(req);
+    seq_profile_t profs[8];
+    char line[80];
+    int count;
+
+    // Default first, built-in or overridden, then the stored ones
+    profile_load(NULL, &profs[0]);
+    count = profile_list(&profs[1], 7);
+
+    httpd_resp_set_type(req, "text/plain");
+    httpd_resp_sendstr_chunk(req, "# name lead count select press_us gap_us\n");
+    for (int i = 0; i <= count; i++) {
+        // An override of the default is already listed, wherever NVS returns it
+        if (i > 0 && strcmp(profs[i].name, profs[0].name) == 0)
+            continue;
+        snprintf(line, sizeof(line), "%.*s 0x%02x %u 0x%02x %"PRIu32" %"PRIu32"\n",
+                 SEQ_PROFILE_NAME_LEN - 1, profs[i].name, profs[i].lead_key, profs[i].lead_count,
+                 profs[i].select_key, profs[i].press_us, profs[i].gap_us);
+        httpd_resp_sendstr_chunk(req, line);
     }
+    return httpd_resp_sendstr_chunk(req, NULL);
+}
 
-    /* Respond with 404 Not Found */
-    httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "File does not exist");
-    return ESP_FAIL;
+/* Handler to report the state of a /ctrl command */
+static esp_err_t ctrl_status_get_handler(httpd_req_t *req)
+{
+    char query[32];
+    char value[12];
+    char line[48];
+    uint32_t id = 0;
+
+    if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK &&
+        httpd_query_key_value(query, "id", value, sizeof(value)) == ESP_OK)
+        id = strtoul(value, NULL, 10);
+
+    httpd_resp_set_type(req, "text/plain");
+    snprintf(line, sizeof(line), "id=%"PRIu32" %s\n", id, seq_state_name(seq_status(id)));
+    httpd_resp_send(req, line, HTTPD_RESP_USE_STRLEN);
+    return ESP_OK;
 }
 
-/* URI handler structure for GET */
-static httpd_uri_t uri_get = {
-    .uri      = "/*",
-    .method   = HTTP_GET,
-    .handler  = get_handler,
-    .user_ctx = NULL
-};
+/* Handler for latency probes, answers at once and records arrival jitter
+ * Probes sent at a steady rate should arrive at a steady rate, the change
+ * in gap from one to the next shows the delay power save adds */
+static esp_err_t probe_get_handler(httpd_req_t *req)
+{
+    static int64_t last, last_gap;
+    static int last_ps;
+    int64_t now = esp_timer_get_time();
+    int64_t gap = now - last;
+    int ps = wifi_get_ps();
+    char line[48];
 
-/* Flush posted data */
+    // Start over after a mode change or a pause between probe runs
+    if (ps != last_ps || gap > 10000000) {
+        last_gap = 0;
+    } else {
+        if (last_gap > 0)
+            metrics_hist_observe(&metric_probe_jitter[ps], llabs(gap - last_gap));
+        last_gap = gap;
+    }
+    last = now;
+    last_ps = ps;
+
+    httpd_resp_set_type(req, "text/plain");
+    httpd_resp_set_hdr(req, "Cache-Control", "no-store");
+    snprintf(line, sizeof(line), "ps=%s t=%"PRId64"\n", wifi_ps_name(ps), now);
+    httpd_resp_send(req, line, HTTPD_RESP_USE_STRLEN);
+    return ESP_OK;
+}
+
+/* Flush posted data, ESP_ERR_NO_MEM if there was no buffer to read it into */
 static esp_err_t flush_post_data(httpd_req_t *req)
 {
-    char buf[100];
+    char *buf;
     int ret, remaining = req->content_len;
 
+    if (remaining == 0)
+        return ESP_OK;
+    if ((buf = pool_get(POOL_ID_SMALL, 0)) == NULL)
+        return ESP_ERR_NO_MEM;
+
     // Read any posted data
     while (remaining > 0) {
         /* Read the data for the request */
         if ((ret = httpd_req_recv(req, buf,
-                        MIN(remaining, sizeof(buf)))) <= 0) {
+                        MIN(remaining, POOL_SMALL))) <= 0) {
             if (ret == HTTPD_SOCK_ERR_TIMEOUT) {
                 /* Retry receiving if timeout occurred */
                 continue;
             }
+            pool_put(buf);
             return ESP_FAIL;
         }
         remaining -= ret;
 
         /* Log data received */
-        ESP_LOGI(TAG, "=========== RECEIVED DATA ==========");
-        ESP_LOGI(TAG, "%.*s", ret, buf);
-        ESP_LOGI(TAG, "====================================");
+        ESP_LOGD(TAG, "=========== RECEIVED DATA ==========");
+        ESP_LOGD(TAG, "%.*s", ret, buf);
+        ESP_LOGD(TAG, "====================================");
     }
+    pool_put(buf);
     return ESP_OK;
 }
 
+/* Answer a request whose body could not be flushed */
+static esp_err_t flush_failed(httpd_req_t *req, esp_err_t err)
+{
+    // Out of buffers is a busy server, anything else is a lost connection
+    return (err == ESP_ERR_NO_MEM) ? pool_busy(req) : ESP_FAIL;
+}
+
+/* Fetch a numeric query parameter, leaves *val alone if absent */
+static bool query_u32(const char *query, const char *key, uint32_t *val)
+{
+    char buf[12];
+    char *end;
+
+    if (httpd_query_key_value(query, key, buf, sizeof(buf)) != ESP_OK)
+        return false;
+    unsigned long v = strtoul(buf, &end, 0);
+    if (end == buf || *end != '\0')
+        return false;
+    *val = v;
+    return true;
+}
+
+/* Fetch a numeric query parameter that must lie within min..max.
+ * False if it is present but bad, *val is left alone if absent */
+static bool query_range(const char *query, const char *key, uint32_t min, uint32_t max, uint32_t *val)
+{
+    char buf[12];
+    uint32_t v;
+
+    if (httpd_query_key_value(query, key, buf, sizeof(buf)) == ESP_ERR_NOT_FOUND)
+        return true;
+    if (!query_u32(query, key, &v) || v < min || v > max)
+        return false;
+    *val = v;
+    return true;
+}
+
+/* Act on a /ctrl query, shared by the POST and WebSocket paths.
+ * Returns the response text, *id is set for accepted commands */
+static const char *ctrl_command(const char *query, uint32_t *id)
+{
+    char value[SEQ_PROFILE_NAME_LEN];
+    seq_cmd_t cmd = { .type = SEQ_CMD_SELECT };
+
+    // key=b1..b4 selects the boot entry, optional profile=name and arm=0/1
+    *id = 0;
+    if (httpd_query_key_value(query, "key", value, sizeof(value)) == ESP_OK &&
+        value[0] == 'b' && value[1] >= '1' && value[1] <= '4' && value[2] == '\0') {
+        cmd.btn = value[1] - '0';
+    }
+    if (httpd_query_key_value(query, "profile", value, sizeof(value)) != ESP_OK)
+        value[0] = '\0';
+
+    // arm=1 holds the selection until the host enumerates, arm=0 cancels
+    uint32_t arm = 0;
+    bool has_arm = query_u32(query, "arm", &arm);
+
+    // Hand off to the key sequencer task
+    if ( has_arm && !arm ) {
+        return (seq_disarm() == ESP_OK) ? "Disarmed" : "Disarm failed";
+    } else if ( cmd.btn == 0 ) {
+        return "Bad Selection";
+    } else if ( profile_load(value, &cmd.profile) != ESP_OK ) {
+        return "Bad Profile";
+    } else if ( arm ) {
+        return (*id = seq_arm(&cmd)) ? "Armed" : "Arm failed";
+    } else if ( (*id = seq_submit(&cmd)) ) {
+        return "Okay";
+    }
+    return "Busy";
+}
+
 /* Handler for ctrl POST action */
-uint32_t button_pressed = 0;
 static esp_err_t ctrl_post_handler(httpd_req_t *req)
 {
+    char query[64];
+    char line[32];
+    uint32_t id;
+    const char *resp;
+    esp_err_t err;
+
+    // Clean up any garbage
+    if ((err = flush_post_data(req)) != ESP_OK)
+        return flush_failed(req, err);
+
+    if (httpd_req_get_url_query_str(req, query, sizeof(query)) != ESP_OK)
+        query[0] = '\0';
+    resp = ctrl_command(query, &id);
+
+    // Send response, accepted commands carry their id for /ctrl/status
+    if ( id )
+        snprintf(line, sizeof(line), "%s id=%"PRIu32"\n", resp, id);
+    else
+        snprintf(line, sizeof(line), "%s\n", resp);
+    httpd_resp_send(req, line, HTTPD_RESP_USE_STRLEN);
+    return ESP_OK;
+}
+
+/* Stage times of the last /boot, esp_timer microseconds */
+static struct {
+    uint32_t id;
+    int64_t request;
+    int64_t armed;
+    int64_t wol;
+} boot_last;
+
+/* Handler for boot POST action
+ *     /boot?mac=aa:bb:cc:dd:ee:ff&key=bN[&profile=name][&to=ip][&port=9]
+ * Arms the selection, then wakes the host, so the keys go out the moment
+ * its firmware enumerates the keyboard */
+static esp_err_t boot_post_handler(httpd_req_t *req)
+{
+    char query[128];
+    char value[18];
+    uint8_t mac[6];
+    uint32_t port = 9;
+    uint32_t to = htonl(INADDR_BROADCAST);
+    seq_cmd_t cmd = { .type = SEQ_CMD_SELECT };
+    char resp[40];
+    int64_t request = esp_timer_get_time();
+    esp_err_t err;
+
+    if ((err = flush_post_data(req)) != ESP_OK)
+        return flush_failed(req, err);
+    if (httpd_req_get_url_query_str(req, query, sizeof(query)) != ESP_OK)
+        query[0] = '\0';
+
+    if (httpd_query_key_value(query, "mac", value, sizeof(value)) != ESP_OK ||
+        !wol_parse_mac(value, mac)) {
+        httpd_resp_send(req, "Bad MAC\n", HTTPD_RESP_USE_STRLEN);
+        return ESP_OK;
+    }
+    if (httpd_query_key_value(query, "key", value, sizeof(value)) == ESP_OK &&
+        value[0] == 'b' && value[1] >= '1' && value[1] <= '4' && value[2] == '\0') {
+        cmd.btn = value[1] - '0';
+    }
+    if (cmd.btn == 0) {
+        httpd_resp_send(req, "Bad Selection\n", HTTPD_RESP_USE_STRLEN);
+        return ESP_OK;
+    }
+    // Optional unicast/subnet target and port, e.g. for a capture stand-in
+    if (httpd_query_key_value(query, "to", value, sizeof(value)) == ESP_OK &&
+        inet_aton(value, (struct in_addr *)&to) == 0) {
+        httpd_resp_send(req, "Bad Address\n", HTTPD_RESP_USE_STRLEN);
+        return ESP_OK;
+    }
+    if (query_u32(query, "port", &port) && (port == 0 || port > 65535)) {
+        httpd_resp_send(req, "Bad Port\n", HTTPD_RESP_USE_STRLEN);
+        return ESP_OK;
+    }
+    if (httpd_query_key_value(query, "profile", value, sizeof(value)) != ESP_OK)
+        value[0] = '\0';
+    if (profile_load(value, &cmd.profile) != ESP_OK) {
+        httpd_resp_send(req, "Bad Profile\n", HTTPD_RESP_USE_STRLEN);
+        return ESP_OK;
+    }
+
+    // Arm first so an enumeration straight after the wake is not missed
+    boot_last.id = seq_arm(&cmd);
+    boot_last.request = request;
+    boot_last.armed = esp_timer_get_time();
+    boot_last.wol = 0;
+    if (boot_last.id == 0) {
+        httpd_resp_send(req, "Arm failed\n", HTTPD_RESP_USE_STRLEN);
+        return ESP_OK;
+    }
+    // Waking may cut the host's USB power to us, so the selection has to be on flash first
+    config_flush();
+    if (wol_send(mac, to, port) != ESP_OK) {
+        // Left armed it would fire whenever the host next happened to enumerate
+        seq_disarm();
+        httpd_resp_send(req, "Wake failed\n", HTTPD_RESP_USE_STRLEN);
+        return ESP_OK;
+    }
+    boot_last.wol = esp_timer_get_time();
+
+    snprintf(resp, sizeof(resp), "Okay id=%"PRIu32"\n", boot_last.id);
+    httpd_resp_send(req, resp, HTTPD_RESP_USE_STRLEN);
+    return ESP_OK;
+}
+
+/* Handler to report the stages of the last /boot, microseconds from the request */
+static esp_err_t boot_get_handler(httpd_req_t *req)
+{
+    seq_times_t times;
+    char line[160];
+    int len;
+
+    if (boot_last.id == 0) {
+        httpd_resp_send(req, "No boot\n", HTTPD_RESP_USE_STRLEN);
+        return ESP_OK;
+    }
+    if (!seq_times(boot_last.id, &times))
+        memset(&times, 0, sizeof(times));
+
+    // Stages not reached yet are left out
+    len = snprintf(line, sizeof(line), "id=%"PRIu32" %s\narmed %"PRId64"\n",
+                   boot_last.id, seq_state_name(seq_status(boot_last.id)),
+                   boot_last.armed - boot_last.request);
+    if (boot_last.wol)
+        len += snprintf(line + len, sizeof(line) - len, "wol %"PRId64"\n", boot_last.wol - boot_last.request);
+    if (times.start)
+        len += snprintf(line + len, sizeof(line) - len, "usb %"PRId64"\n", times.start - boot_last.request);
+    if (times.first_key)
+        len += snprintf(line + len, sizeof(line) - len, "first_key %"PRId64"\n", times.first_key - boot_last.request);
+    if (times.done)
+        len += snprintf(line + len, sizeof(line) - len, "done %"PRId64"\n", times.done - boot_last.request);
+
+    httpd_resp_set_type(req, "text/plain");
+    httpd_resp_send(req, line, HTTPD_RESP_USE_STRLEN);
+    return ESP_OK;
+}
+
+/* Handler to create, change, delete or calibrate a timing profile
+ *     /profile?name=uefi&press=5000&gap=20000&lead=0x2c&count=5&select=0x51
+ *     /profile?name=uefi&delete=1
+ *     /profile?name=uefi&calibrate=1
+ */
+static esp_err_t profile_post_handler(httpd_req_t *req)
+{
+    char query[160];
+    char name[SEQ_PROFILE_NAME_LEN];
+    seq_cmd_t cmd = { .type = SEQ_CMD_CALIBRATE };
+    seq_profile_t *prof = &cmd.profile;
+    uint32_t val;
     char *resp;
+    esp_err_t err;
 
     // Clean up any garbage
-    if (flush_post_data(req) != ESP_OK)
+    if ((err = flush_post_data(req)) != ESP_OK)
+        return flush_failed(req, err);
+
+    if (httpd_req_get_url_query_str(req, query, sizeof(query)) != ESP_OK ||
+        httpd_query_key_value(query, "name", name, sizeof(name)) != ESP_OK ||
+        name[0] == '\0') {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Missing profile name");
         return ESP_FAIL;
+    }
 
-    // Trigger the USB task
-    if ( button_pressed == 0 ) {
-        if (strcmp(req->uri, "/ctrl?key=b1") == 0) {
-            button_pressed = 1;
-            resp = "Okay\n";
-        } else if (strcmp(req->uri, "/ctrl?key=b2") == 0) {
-            button_pressed = 2;
-            resp = "Okay\n";
-        } else if (strcmp(req->uri, "/ctrl?key=b3") == 0) {
-            button_pressed = 3;
-            resp = "Okay\n";
-        } else if (strcmp(req->uri, "/ctrl?key=b4") == 0) {
-            button_pressed = 4;
-            resp = "Okay\n";
-        } else {
-            resp = "Bad Selection\n";
+    // Start from the stored profile, or the default for a new one
+    if (profile_load(name, prof) != ESP_OK) {
+        profile_default(prof);
+        strlcpy(prof->name, name, sizeof(prof->name));
+    }
+
+    if (query_u32(query, "delete", &val) && val) {
+        resp = (profile_delete(name) == ESP_OK) ? "Deleted\n" : "Not found\n";
+    } else if (query_u32(query, "calibrate", &val) && val) {
+        uint32_t id = seq_submit(&cmd);
+        resp = "Busy\n";
+        if (id) {
+            snprintf(query, sizeof(query), "Calibrating id=%"PRIu32"\n", id);
+            resp = query;
         }
     } else {
-        resp = "Busy\n";
+        uint32_t press = prof->press_us, gap = prof->gap_us;
+        uint32_t lead = prof->lead_key, count = prof->lead_count, select = prof->select_key;
+
+        // Check every value before storing any, the key fields are single bytes
+        if (!query_range(query, "press", 1, UINT32_MAX, &press) ||
+            !query_range(query, "gap", 1, UINT32_MAX, &gap) ||
+            !query_range(query, "lead", 0, UINT8_MAX, &lead) ||
+            !query_range(query, "count", 0, UINT8_MAX, &count) ||
+            !query_range(query, "select", 0, UINT8_MAX, &select)) {
+            httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Bad profile value");
+            return ESP_OK;
+        }
+        prof->press_us = press;
+        prof->gap_us = gap;
+        prof->lead_key = lead;
+        prof->lead_count = count;
+        prof->select_key = select;
+        resp = (profile_save(prof) == ESP_OK) ? "Saved\n" : "Save failed\n";
     }
 
-    // Send response
     httpd_resp_send(req, resp, HTTPD_RESP_USE_STRLEN);
     return ESP_OK;
 }
 
-/* Handler for config POST action */
+/* Store a numeric form value if it is present and within range */
+static void config_form_u8(const char *value, config_field_t field, unsigned min, unsigned max,
+                           bool *changed)
+{
+    char *end;
+    esp_err_t err;
+
+    if (value[0] == '\0')
+        return;
+    unsigned long v = strtoul(value, &end, 10);
+    if (*end != '\0' || v < min || v > max) {
+        ESP_LOGI(TAG, "Bad value %s for setting %d", value, field);
+        return;
+    }
+    if ((err = config_set_u8(field, v, changed)) != ESP_OK)
+        ESP_LOGI(TAG, "Error (%s) setting %d", esp_err_to_name(err), field);
+}
+
+/* Handler for config POST action, form encoded or a JSON object
+ *     wifi_ssid=...&wifi_pass=...&wifi_ps=none|min|max
+ * Empty or missing values leave the setting alone */
 static esp_err_t config_post_handler(httpd_req_t *req)
 {
-    char buf[120]; // max=10+64 + 10+32 + 1
-    char *token;
+    char *buf;
+    char ssid[33], pass[65], ps[8];
+    char sockets[4], timeout[4], rate[4], burst[4];
+    form_field_t fields[] = {
+        { .name = "wifi_ssid",    .value = ssid,    .size = sizeof(ssid) },
+        { .name = "wifi_pass",    .value = pass,    .size = sizeof(pass) },
+        { .name = "wifi_ps",      .value = ps,      .size = sizeof(ps) },
+        { .name = "http_sockets", .value = sockets, .size = sizeof(sockets), .number = true },
+        { .name = "http_timeout", .value = timeout, .size = sizeof(timeout), .number = true },
+        { .name = "http_rate",    .value = rate,    .size = sizeof(rate),    .number = true },
+        { .name = "http_burst",   .value = burst,   .size = sizeof(burst),   .number = true },
+    };
+    form_parser_t form;
+    bool changed = false, http_changed = false;
     int ret, remaining = req->content_len;
+    esp_err_t err = ESP_OK;
 
-    /* Open NVS */
-    nvs_handle_t nvsHandle;
-    esp_err_t err = nvs_open("storage", NVS_READWRITE, &nvsHandle);
-    if (err != ESP_OK) {
-        ESP_LOGI(TAG, "Error (%s) opening NVS handle!", esp_err_to_name(err));
-        flush_post_data(req);
-        return ESP_FAIL;
-    }
+    if ((buf = pool_get(POOL_ID_SMALL, 0)) == NULL)
+        return pool_busy(req);
 
-    /* Read SSID/Password */
+    // Values may be split anywhere across chunks, the parser keeps its place
     buf[0] = '\0';
+    httpd_req_get_hdr_value_str(req, "Content-Type", buf, POOL_SMALL);
+    form_init(&form, fields, sizeof(fields) / sizeof(fields[0]),
+              strncmp(buf, "application/json", 16) == 0);
     while (remaining > 0) {
         /* Read the data for the request */
-        if ((ret = httpd_req_recv(req, buf,
-                        MIN(remaining, sizeof(buf)-1))) <= 0) {
+        if ((ret = httpd_req_recv(req, buf, MIN(remaining, POOL_SMALL))) <= 0) {
             if (ret == HTTPD_SOCK_ERR_TIMEOUT) {
                 /* Retry receiving if timeout occurred */
                 continue;
             }
+            pool_put(buf);
             return ESP_FAIL;
         }
-        buf[ret] = '\0';
         remaining -= ret;
+        if (err == ESP_OK)
+            err = form_feed(&form, buf, ret);
+    }
+    pool_put(buf);
+    if (err == ESP_OK)
+        err = form_finish(&form);
+    if (err != ESP_OK) {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Malformed form");
+        return ESP_OK;
+    }
+    for (int i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+        if (fields[i].overflow) {
+            ESP_LOGI(TAG, "%s too long", fields[i].name);
+            httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Value too long");
+            return ESP_OK;
+        }
+    }
 
-        /* Parse received data */
-        token = strtok(buf, "&");
-        while( token != NULL ) {
-            if ( strncmp( token, "wifi_ssid=", 10 ) == 0 ) {
-                token += 10;	// Skip key
-                if (( strlen(token) > 0 ) && ( strlen(token) <= 32 )) {
-                    err = nvs_set_str(nvsHandle, "WIFI_SSID", token);
-                    if ( err != ESP_OK ) {
-                        ESP_LOGI(TAG, "Error (%s) writing WiFi SSID to NVS", esp_err_to_name(err));
-                    }
-                }
+    if (ps[0] != '\0' && wifi_set_ps(wifi_ps_parse(ps)) != ESP_OK)
+        ESP_LOGI(TAG, "Bad WiFi power save mode %s", ps);
+
+    // Unchanged values are not written, changed ones share one deferred commit
+    if (ssid[0] != '\0' && (err = config_set_str(CFG_WIFI_SSID, ssid, &changed)) != ESP_OK)
+        ESP_LOGI(TAG, "Error (%s) setting WiFi SSID", esp_err_to_name(err));
+    if (pass[0] != '\0' && (err = config_set_str(CFG_WIFI_PASS, pass, &changed)) != ESP_OK)
+        ESP_LOGI(TAG, "Error (%s) setting WiFi password", esp_err_to_name(err));
+
+    // The rate limit applies at once, sockets and timeout when the server next starts
+    config_form_u8(sockets, CFG_HTTP_SOCKETS, 2, CONFIG_LWIP_MAX_SOCKETS - ADMIT_SOCKETS_USED, &http_changed);
+    config_form_u8(timeout, CFG_HTTP_TIMEOUT, 1, 60, &http_changed);
+    config_form_u8(rate, CFG_HTTP_RATE, 0, 255, &http_changed);
+    config_form_u8(burst, CFG_HTTP_BURST, 1, 255, &http_changed);
+
+    // Send response
+    httpd_resp_send(req, changed ? "SSID/Password change will take effect on next reboot"
+                       : http_changed ? "HTTP settings saved, connection limits take effect on next reboot"
+                       : "SSID/Password unchanged", HTTPD_RESP_USE_STRLEN);
+    return ESP_OK;
+}
+
+/* Handler for startup stage times */
+static esp_err_t startup_get_handler(httpd_req_t *req)
+{
+    return stage_send(req);
+}
+
+/* Handler to list tasks with their core, stack and CPU use */
+static esp_err_t tasks_get_handler(httpd_req_t *req)
+{
+    return tasks_send(req);
+}
+
+/* Handler to stream the newest log lines, /log?n=50 */
+static esp_err_t log_get_handler(httpd_req_t *req)
+{
+    char query[16];
+    uint32_t count = UINT32_MAX;
+
+    if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK)
+        query_u32(query, "n", &count);
+    httpd_resp_set_type(req, "text/plain");
+    logring_send(req, count);
+    return httpd_resp_sendstr_chunk(req, NULL);
+}
+
+/* Handler to change a log level at run time, /log?tag=wifi&level=debug
+ * tag=* sets every tag that has no level of its own */
+static esp_err_t log_post_handler(httpd_req_t *req)
+{
+    static const char *levels[] = { "none", "error", "warn", "info", "debug", "verbose" };
+    char query[64];
+    char tag[24];
+    char level[8];
+    esp_err_t err;
+
+    // Clean up any garbage
+    if ((err = flush_post_data(req)) != ESP_OK)
+        return flush_failed(req, err);
+
+    if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK &&
+        httpd_query_key_value(query, "tag", tag, sizeof(tag)) == ESP_OK &&
+        httpd_query_key_value(query, "level", level, sizeof(level)) == ESP_OK) {
+        for (int i = 0; i < sizeof(levels) / sizeof(levels[0]); i++) {
+            if (strcmp(level, levels[i]) == 0) {
+                esp_log_level_set(tag, (esp_log_level_t)i);
+                httpd_resp_send(req, "Okay\n", HTTPD_RESP_USE_STRLEN);
+                return ESP_OK;
             }
-            else if ( strncmp( token, "wifi_pass=", 10 ) == 0 ) {
-                token += 10;	// Skip key
-                if (( strlen(token) > 0 ) && ( strlen(token) <= 64 )) {
-                    err = nvs_set_str(nvsHandle, "WIFI_PASS", token);
-                    if ( err != ESP_OK ) {
-                        ESP_LOGI(TAG, "Error (%s) writing WiFi SSID to NVS", esp_err_to_name(err));
-                    }
-                }
+        }
+    }
+    httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Need tag and level=none|error|warn|info|debug|verbose");
+    return ESP_OK;
+}
+
+/* Handler to report where an interrupted chunked update can resume */
+static esp_err_t update_get_handler(httpd_req_t *req)
+{
+    char line[48];
+    uint32_t offset, total;
+
+    offset = ota_chunk_offset(&total);
+    httpd_resp_set_type(req, "text/plain");
+    snprintf(line, sizeof(line), "offset=%"PRIu32" total=%"PRIu32"\n", offset, total);
+    httpd_resp_send(req, line, HTTPD_RESP_USE_STRLEN);
+    return ESP_OK;
+}
+
+/* One chunk of a resumable update
+ *     POST /update?offset=N&total=T&sha256=<hex>
+ * The whole chunk is held in the OTA buffers and checked before any of
+ * it reaches flash, so a bad or dropped chunk only costs itself */
+static esp_err_t update_chunk(httpd_req_t *req, const char *query, uint32_t offset)
+{
+    char *bufs[CONFIG_WEBSTER_OTA_BUF_COUNT];
+    int lens[CONFIG_WEBSTER_OTA_BUF_COUNT];
+    int ret, nbuf = 0, remaining = req->content_len;
+    char want[65], got[65];
+    uint8_t digest[32];
+    uint32_t total = 0, bytes, bps;
+    mbedtls_sha256_context sha;
+    char resp[80];
+    esp_err_t err;
+
+    query_u32(query, "total", &total);
+    if (httpd_query_key_value(query, "sha256", want, sizeof(want)) != ESP_OK ||
+        strlen(want) != 64 || remaining == 0 ||
+        remaining > CONFIG_WEBSTER_OTA_BUF_COUNT * CONFIG_WEBSTER_OTA_BUF_SIZE) {
+        flush_post_data(req);
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Bad chunk");
+        return ESP_OK;
+    }
+
+    // Busy rather than touch the session if no buffer comes back in time
+    if ((bufs[0] = ota_buf_get(OTA_BUF_WAIT)) == NULL)
+        return pool_busy(req);
+
+    err = ota_chunk_start(offset, total);
+    if (err != ESP_OK)
+        ota_buf_put(bufs[0]);
+    if (err == ESP_ERR_INVALID_STATE) {
+        // Not where the device is, tell the client where to resume
+        flush_post_data(req);
+        offset = ota_chunk_offset(&total);
+        snprintf(resp, sizeof(resp), "offset=%"PRIu32" total=%"PRIu32"\n", offset, total);
+        httpd_resp_set_status(req, "409 Conflict");
+        httpd_resp_send(req, resp, HTTPD_RESP_USE_STRLEN);
+        return ESP_OK;
+    } else if (err != ESP_OK) {
+        flush_post_data(req);
+        httpd_resp_send(req, "Update failed", HTTPD_RESP_USE_STRLEN);
+        return err;
+    }
+
+    mbedtls_sha256_init(&sha);
+    mbedtls_sha256_starts(&sha, 0);
+    while (remaining > 0) {
+        if (nbuf > 0 && (bufs[nbuf] = ota_buf_get(OTA_BUF_WAIT)) == NULL) {
+            // The session waits for this chunk again
+            for (int i = 0; i < nbuf; i++)
+                ota_buf_put(bufs[i]);
+            mbedtls_sha256_free(&sha);
+            return pool_busy(req);
+        }
+        lens[nbuf] = 0;
+        while (lens[nbuf] < CONFIG_WEBSTER_OTA_BUF_SIZE && remaining > 0) {
+            ret = httpd_req_recv(req, bufs[nbuf] + lens[nbuf],
+                                 MIN(remaining, CONFIG_WEBSTER_OTA_BUF_SIZE - lens[nbuf]));
+            if (ret == HTTPD_SOCK_ERR_TIMEOUT)
+                continue;
+            if (ret <= 0) {
+                // Connection gone, the session waits for this chunk again
+                for (int i = 0; i <= nbuf; i++)
+                    ota_buf_put(bufs[i]);
+                mbedtls_sha256_free(&sha);
+                return ESP_FAIL;
             }
-            token = strtok(NULL, "&");
+            lens[nbuf] += ret;
+            remaining -= ret;
         }
+        mbedtls_sha256_update(&sha, (const unsigned char *)bufs[nbuf], lens[nbuf]);
+        nbuf++;
     }
+    mbedtls_sha256_finish(&sha, digest);
+    mbedtls_sha256_free(&sha);
 
-    /* Close NVS */
-    err = nvs_commit(nvsHandle);
-    if ( err != ESP_OK ) {
-        ESP_LOGI(TAG, "Error (%s) commiting changes to NVS", esp_err_to_name(err));
+    for (int i = 0; i < sizeof(digest); i++)
+        sprintf(got + 2 * i, "%02x", digest[i]);
+    if (strcasecmp(got, want) != 0) {
+        for (int i = 0; i < nbuf; i++)
+            ota_buf_put(bufs[i]);
+        snprintf(resp, sizeof(resp), "Checksum mismatch, offset=%"PRIu32"\n", offset);
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, resp);
+        return ESP_OK;
     }
-    nvs_close(nvsHandle);
 
-    // Send response
-    httpd_resp_send(req, "SSID/Password change will take effect on next reboot", HTTPD_RESP_USE_STRLEN);
+    for (int i = 0; i < nbuf; i++)
+        err = ota_buf_write(bufs[i], lens[i]);
+    if (err == ESP_OK && !ota_chunk_done(req->content_len)) {
+        snprintf(resp, sizeof(resp), "offset=%"PRIu32"\n", offset + (uint32_t)req->content_len);
+        httpd_resp_send(req, resp, HTTPD_RESP_USE_STRLEN);
+        return ESP_OK;
+    }
+
+    // Last chunk, or flash failed and the session is over
+    esp_err_t drained = ota_buf_drain();
+    err = ota_finish( err != ESP_OK ? err : drained );
+    if ( err != ESP_OK ) {
+        httpd_resp_send(req, "Update failed", HTTPD_RESP_USE_STRLEN);
+        return err;
+    }
+    ota_stats(&bytes, &bps);
+    snprintf(resp, sizeof(resp), "Update complete, %"PRIu32" bytes", bytes);
+    httpd_resp_send(req, resp, HTTPD_RESP_USE_STRLEN);
     return ESP_OK;
 }
 
-/* Handler for update POST action */
-char bigbuf[4096];
+/* Handler for update POST action
+ * Socket reads and flash writes overlap, ota.c's writer task programs
+ * one buffer while the next is being received into another */
 static esp_err_t update_post_handler(httpd_req_t *req)
 {
     int ret, remaining = req->content_len;
+    uint32_t bytes, bps, offset;
+    char resp[80];
+    char query[160];
     esp_err_t err;
 
+    // With an offset this is one chunk of a resumable upload
+    if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK &&
+        query_u32(query, "offset", &offset))
+        return update_chunk(req, query, offset);
+
+    // Busy rather than start over if no buffer comes back in time
+    char *buf = ota_buf_get(OTA_BUF_WAIT);
+    if (buf == NULL)
+        return pool_busy(req);
+
     /* Start OTA process */
     err = ota_init();
     if ( err != ESP_OK ) {
+        ota_buf_put(buf);
         flush_post_data(req);
         httpd_resp_send(req, "Update failed", HTTPD_RESP_USE_STRLEN);
         return err;
@@ -251,58 +849,310 @@ static esp_err_t update_post_handler(httpd_req_t *req)
 
     // Read any posted data
     while (remaining > 0) {
-        /* Read the data for the request */
-        if ((ret = httpd_req_recv(req, bigbuf,
-                        MIN(remaining, sizeof(bigbuf)))) <= 0) {
-            if (ret == HTTPD_SOCK_ERR_TIMEOUT) {
-                /* Retry receiving if timeout occurred */
-                continue;
-            }
+        /* Fill a whole buffer so flash sees few, large writes */
+        if (buf == NULL && (buf = ota_buf_get(OTA_BUF_WAIT)) == NULL) {
+            ota_buf_drain();
+            flush_post_data(req);
             httpd_resp_send(req, "Update failed", HTTPD_RESP_USE_STRLEN);
-            return ota_finish( ESP_FAIL );
+            return ota_finish( ESP_ERR_TIMEOUT );
+        }
+        int len = 0;
+        while (len < CONFIG_WEBSTER_OTA_BUF_SIZE && remaining > 0) {
+            /* Read the data for the request */
+            if ((ret = httpd_req_recv(req, buf + len,
+                            MIN(remaining, CONFIG_WEBSTER_OTA_BUF_SIZE - len))) <= 0) {
+                if (ret == HTTPD_SOCK_ERR_TIMEOUT) {
+                    /* Retry receiving if timeout occurred */
+                    continue;
+                }
+                ota_buf_put(buf);
+                ota_buf_drain();
+                httpd_resp_send(req, "Update failed", HTTPD_RESP_USE_STRLEN);
+                return ota_finish( ESP_FAIL );
+            }
+            len += ret;
+            remaining -= ret;
         }
-        remaining -= ret;
 
-        err = ota_write( bigbuf, ret );
+        err = ota_buf_write( buf, len );
+        buf = NULL;
         if ( err != ESP_OK ) {
+            ota_buf_drain();
             flush_post_data(req);
             httpd_resp_send(req, "Update failed", HTTPD_RESP_USE_STRLEN);
-            return err;
+            return ota_finish( err );
         }
     }
 
-    httpd_resp_send(req, "Update complete", HTTPD_RESP_USE_STRLEN);
-    return ota_finish( ESP_OK );
+    ota_buf_put(buf);       // still held if the body was empty
+    err = ota_finish( ota_buf_drain() );
+    if ( err != ESP_OK ) {
+        httpd_resp_send(req, "Update failed", HTTPD_RESP_USE_STRLEN);
+        return err;
+    }
+    ota_stats(&bytes, &bps);
+    snprintf(resp, sizeof(resp), "Update complete, %"PRIu32" bytes at %"PRIu32" bytes/s",
+             bytes, bps);
+    httpd_resp_send(req, resp, HTTPD_RESP_USE_STRLEN);
+    return ESP_OK;
+}
+
+/* Route table entry, see routes.txt */
+typedef struct {
+    httpd_method_t method;
+    const char *path;
+    esp_err_t (*handler)(httpd_req_t *req);
+} route_t;
+
+static esp_err_t metrics_get_handler(httpd_req_t *req);
+
+#include "routes_gen.h"
+
+/* Seeded FNV-1a over method letter and path, must match routes.cmake */
+static uint32_t route_hash(char method, const char *path, size_t len)
+{
+    uint32_t h = ROUTE_SEED ^ 2166136261u;
+
+    h = (h ^ (uint8_t)method) * 16777619u;
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ (uint8_t)path[i]) * 16777619u;
+    return h;
 }
 
-/* Handler to respond to wildcard URI and direct the reponse */
-static esp_err_t post_handler(httpd_req_t *req)
+/* Per-route request latency, only written by the httpd task.
+ * The extra slot counts requests that matched no route. */
+static metrics_hist_t route_latency[ROUTE_MASK + 2];
+
+/* Handler for Prometheus scrapes */
+static esp_err_t metrics_get_handler(httpd_req_t *req)
 {
-    /* Return one of a limited number of supported paths */
-    ESP_LOGI(TAG, "POST: %s", req->uri);
-    if (strncmp(req->uri, "/ctrl?", 6) == 0) {
-        return ctrl_post_handler(req);
+    char labels[64];
+
+    httpd_resp_set_type(req, "text/plain; version=0.0.4");
+    httpd_resp_sendstr_chunk(req,
+        "# HELP webster_http_request_seconds HTTP handler latency by route\n"
+        "# TYPE webster_http_request_seconds histogram\n");
+    for (int i = 0; i <= ROUTE_MASK + 1; i++) {
+        const route_t *route = &route_table[i];
+        if (i <= ROUTE_MASK && route->path == NULL)
+            continue;
+        if (i <= ROUTE_MASK) {
+            snprintf(labels, sizeof(labels), "method=\"%s\",route=\"%s\",",
+                     (route->method == HTTP_GET) ? "GET" : "POST", route->path);
+        } else {
+            strcpy(labels, "route=\"other\",");
+        }
+        metrics_send_hist(req, "webster_http_request_seconds", labels, &route_latency[i]);
     }
-    else if (strcmp(req->uri, "/config") == 0) {
-        return config_post_handler(req);
+    metrics_send(req);
+    return httpd_resp_sendstr_chunk(req, NULL);
+}
+
+/* Handler to respond to wildcard URI and direct the reponse */
+static esp_err_t route_handler(httpd_req_t *req)
+{
+    int64_t start = esp_timer_get_time();
+    esp_err_t err;
+
+    // Path ends at the query string, handlers fetch that themselves
+    size_t len = strcspn(req->uri, "?");
+    char method = (req->method == HTTP_GET) ? 'G' : 'P';
+    uint32_t slot = route_hash(method, req->uri, len) >> ROUTE_SHIFT;
+    const route_t *route = &route_table[slot];
+
+    stage_mark(STAGE_FIRST_REQUEST);
+    if (req->method == HTTP_POST)
+        ESP_LOGI(TAG, "POST: %s", req->uri);
+    if (route->path && route->method == req->method &&
+        strncmp(route->path, req->uri, len) == 0 && route->path[len] == '\0') {
+        if (admit_request(req, route->handler == ctrl_post_handler, &err))
+            err = route->handler(req);
+        admit_done(req, err);
+        metrics_hist_observe(&route_latency[slot], esp_timer_get_time() - start);
+        return err;
     }
-    else if (strcmp(req->uri, "/update") == 0) {
-        return update_post_handler(req);
+    if (!admit_request(req, false, &err)) {
+        admit_done(req, err);
+        return err;
     }
 
     // Clean up any garbage
-    if (flush_post_data(req) != ESP_OK)
-        return ESP_FAIL;
+    if (req->method == HTTP_POST && (err = flush_post_data(req)) != ESP_OK) {
+        err = flush_failed(req, err);
+        admit_done(req, err);
+        return err;
+    }
 
     /* Respond with 404 Not Found */
     httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "File does not exist");
+    admit_done(req, ESP_FAIL);
+    metrics_hist_observe(&route_latency[ROUTE_MASK + 1], esp_timer_get_time() - start);
     return ESP_FAIL;
 }
 
+/* Live sequencer progress over WebSocket. Events arrive from the
+ * sequencer and submitting tasks, which only queue them and only while
+ * a client is connected. A low priority task on the network core hands
+ * them to the httpd task, which owns the sockets, so no socket call is
+ * ever made between key reports. */
+#define WS_MAX_CLIENTS  4
+#define WS_QUEUE_LEN    16
+#define WS_TASK_PRIORITY    1
+
+static httpd_handle_t ws_server = NULL;
+static int ws_fds[WS_MAX_CLIENTS];
+static atomic_bool ws_active = false;   // some entry in ws_fds is in use
+static QueueHandle_t ws_events = NULL;
+static TaskHandle_t ws_task_handle = NULL;
+static atomic_bool ws_pending = false;
+
+/* Note whether any client is left, after ws_fds changed in the httpd task */
+static void ws_recount(void)
+{
+    bool active = false;
+
+    for (int i = 0; i < WS_MAX_CLIENTS; i++)
+        active |= ws_fds[i] >= 0;
+    atomic_store(&ws_active, active);
+}
+
+/* Send queued events to every open WebSocket, runs in the httpd task */
+static void ws_flush(void *arg)
+{
+    seq_event_t event;
+    char msg[80];
+    httpd_ws_frame_t frame = { .type = HTTPD_WS_TYPE_TEXT, .final = true };
+
+    atomic_store(&ws_pending, false);
+    while (xQueueReceive(ws_events, &event, 0) == pdTRUE) {
+        frame.len = snprintf(msg, sizeof(msg),
+                             "{\"id\":%"PRIu32",\"state\":\"%s\",\"key\":%u,\"total\":%u}",
+                             event.id, seq_state_name(event.state), event.key, event.total);
+        frame.payload = (uint8_t *)msg;
+        for (int i = 0; i < WS_MAX_CLIENTS; i++) {
+            if (ws_fds[i] < 0)
+                continue;
+            if (httpd_ws_get_fd_info(ws_server, ws_fds[i]) != HTTPD_WS_CLIENT_WEBSOCKET ||
+                httpd_ws_send_frame_async(ws_server, ws_fds[i], &frame) != ESP_OK)
+                ws_fds[i] = -1;
+        }
+    }
+    ws_recount();
+}
+
+/* Sequencer progress callback, must not block */
+static void ws_progress(const seq_event_t *event)
+{
+    if (!atomic_load(&ws_active) || xQueueSend(ws_events, event, 0) != pdTRUE)
+        return;
+    xTaskNotifyGive(ws_task_handle);
+}
+
+/* Ask the httpd task to send what has been queued */
+static void ws_task(void *arg)
+{
+    while (1) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        httpd_handle_t server = ws_server;
+        // One flush drains everything queued before it runs
+        if (server && !atomic_exchange(&ws_pending, true) &&
+            httpd_queue_work(server, ws_flush, NULL) != ESP_OK)
+            atomic_store(&ws_pending, false);
+    }
+}
+
+/* Handshake, remember the client for progress events */
+static esp_err_t ws_open(httpd_req_t *req)
+{
+    int fd = httpd_req_to_sockfd(req);
+    int slot = -1;
+
+    if (!admit_upgrade(req))
+        return ESP_FAIL;
+    for (int i = 0; i < WS_MAX_CLIENTS; i++) {
+        // Drop closed clients, and a stale entry for a reused fd
+        if (ws_fds[i] == fd ||
+            (ws_fds[i] >= 0 && httpd_ws_get_fd_info(req->handle, ws_fds[i]) != HTTPD_WS_CLIENT_WEBSOCKET))
+            ws_fds[i] = -1;
+        if (ws_fds[i] < 0 && slot < 0)
+            slot = i;
+    }
+    ws_recount();
+    if (slot < 0) {
+        ESP_LOGI(TAG, "Too many WebSocket clients");
+        return ESP_FAIL;
+    }
+    ws_fds[slot] = fd;
+    ws_recount();
+    return ESP_OK;
+}
+
+/* A text frame carries a /ctrl query such as "key=b2" */
+static esp_err_t ws_recv(httpd_req_t *req)
+{
+    char query[64];
+    char line[32];
+    uint32_t id;
+    httpd_ws_frame_t frame = { .type = HTTPD_WS_TYPE_TEXT };
+
+    // Find the length, then read the payload
+    if (httpd_ws_recv_frame(req, &frame, 0) != ESP_OK)
+        return ESP_FAIL;
+    if (frame.type != HTTPD_WS_TYPE_TEXT || frame.len >= sizeof(query)) {
+        ESP_LOGI(TAG, "Ignoring WebSocket frame type %d len %d", frame.type, (int)frame.len);
+        // Payload still has to be consumed to keep the stream in sync
+        if (frame.len >= sizeof(query))
+            return ESP_FAIL;
+        frame.payload = (uint8_t *)query;
+        return httpd_ws_recv_frame(req, &frame, frame.len);
+    }
+    frame.payload = (uint8_t *)query;
+    if (httpd_ws_recv_frame(req, &frame, frame.len) != ESP_OK)
+        return ESP_FAIL;
+    query[frame.len] = '\0';
+
+    const char *resp = ctrl_command(query, &id);
+    if ( id )
+        snprintf(line, sizeof(line), "%s id=%"PRIu32, resp, id);
+    else
+        snprintf(line, sizeof(line), "%s", resp);
+    frame.type = HTTPD_WS_TYPE_TEXT;
+    frame.final = true;
+    frame.payload = (uint8_t *)line;
+    frame.len = strlen(line);
+    return httpd_ws_send_frame(req, &frame);
+}
+
+/* Handler for /ws. Frames are commands like POST /ctrl and are not
+ * limited, the handshake is admitted like any other request */
+static esp_err_t ws_handler(httpd_req_t *req)
+{
+    esp_err_t err = (req->method == HTTP_GET) ? ws_open(req) : ws_recv(req);
+
+    admit_done(req, err);
+    return err;
+}
+
+static const httpd_uri_t uri_ws = {
+    .uri          = "/ws",
+    .method       = HTTP_GET,
+    .handler      = ws_handler,
+    .user_ctx     = NULL,
+    .is_websocket = true
+};
+
+/* URI handler structures, all requests go through the route table */
+static const httpd_uri_t uri_get = {
+    .uri       = "/*",
+    .method    = HTTP_GET,
+    .handler   = route_handler,
+    .user_ctx  = NULL
+};
+
 static const httpd_uri_t uri_post = {
     .uri       = "/*",
     .method    = HTTP_POST,
-    .handler   = post_handler,
+    .handler   = route_handler,
     .user_ctx  = NULL
 };
 
@@ -314,12 +1164,21 @@ static httpd_handle_t start_webserver(void)
 
     // Start the httpd server
     config.uri_match_fn = httpd_uri_match_wildcard;
+    config.core_id = TASK_CORE_NET;
+    config.task_priority = CONFIG_WEBSTER_HTTPD_PRIORITY;
+    admit_config(&config);
     ESP_LOGI(TAG, "Starting server on port: '%d'", config.server_port);
     if (httpd_start(&server, &config) == ESP_OK) {
         // Set URI handlers
         ESP_LOGI(TAG, "Registering URI handlers");
+        for (int i = 0; i < WS_MAX_CLIENTS; i++)
+            ws_fds[i] = -1;
+        ws_recount();
+        // Ahead of the wildcards, which would otherwise match /ws
+        httpd_register_uri_handler(server, &uri_ws);
         httpd_register_uri_handler(server, &uri_get);
         httpd_register_uri_handler(server, &uri_post);
+        ws_server = server;
         return server;
     }
 
@@ -327,44 +1186,25 @@ static httpd_handle_t start_webserver(void)
     return NULL;
 }
 
-static void stop_webserver(httpd_handle_t server)
-{
-    // Stop the httpd server
-    httpd_stop(server);
-}
-
-static void disconnect_handler(void* arg, esp_event_base_t event_base,
-                               int32_t event_id, void* event_data)
-{
-    httpd_handle_t* server = (httpd_handle_t*) arg;
-    if (*server) {
-        ESP_LOGI(TAG, "Stopping webserver");
-        stop_webserver(*server);
-        *server = NULL;
-    }
-}
+static httpd_handle_t httpd_server = NULL;
 
+/* Only registered if the first start failed, retried once there is an address */
 static void connect_handler(void* arg, esp_event_base_t event_base,
                             int32_t event_id, void* event_data)
 {
-    httpd_handle_t* server = (httpd_handle_t*) arg;
-    if (*server == NULL) {
-        ESP_LOGI(TAG, "Starting webserver");
-        *server = start_webserver();
-    }
+    if (httpd_server == NULL && (httpd_server = start_webserver()) != NULL)
+        esp_event_handler_unregister(IP_EVENT, IP_EVENT_STA_GOT_IP, &connect_handler);
 }
 
-
+/* The server listens on any address, so it starts once, before WiFi has
+ * one, and keeps running across disconnects */
 void httpd_init(void)
 {
-    static httpd_handle_t server = NULL;
-
-    /* Register event handlers to stop the server when Wi-Fi
-     * and re-start it upon connection.
-     */
-    ESP_ERROR_CHECK(esp_event_handler_register(IP_EVENT, IP_EVENT_STA_GOT_IP, &connect_handler, &server));
-    ESP_ERROR_CHECK(esp_event_handler_register(WIFI_EVENT, WIFI_EVENT_STA_DISCONNECTED, &disconnect_handler, &server));
+    ws_events = xQueueCreate(WS_QUEUE_LEN, sizeof(seq_event_t));
+    xTaskCreatePinnedToCore(ws_task, "ws", 2048, NULL, WS_TASK_PRIORITY, &ws_task_handle, TASK_CORE_NET);
+    seq_set_progress(ws_progress);
 
-    /* Start the server for the first time */
-    server = start_webserver();
+    httpd_server = start_webserver();
+    if (httpd_server == NULL)
+        ESP_ERROR_CHECK(esp_event_handler_register(IP_EVENT, IP_EVENT_STA_GOT_IP, &connect_handler, NULL));
 }
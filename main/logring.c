@@ -0,0 +1,312 @@
+/*
+ * In-RAM log ring
+ *
+ * Takes over the ESP_LOGx output. Instead of formatting and writing to
+ * the UART in the calling task, each line is stored as its format
+ * pointer (a string literal in flash) plus a copy of its arguments, and
+ * only formatted when someone reads GET /log. Strings are copied, since
+ * a %s argument may live on the caller's stack. A line whose format is
+ * not in flash, or whose arguments do not fit, is formatted at once
+ * into the entry instead.
+ *
+ * Writers never wait. Each takes the next slot with an atomic add and
+ * claims it by making its sequence count odd. If a slow writer still
+ * holds that slot a whole lap later, the newer line is dropped.
+ */
+
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/param.h>
+#include <esp_log.h>
+#include <esp_memory_utils.h>
+#include <esp_http_server.h>
+#include "metrics.h"
+
+#define LOG_ENTRIES     CONFIG_WEBSTER_LOG_ENTRIES
+#define LOG_DATA        88      // argument words then copied strings, or text
+#define LOG_LINE        160     // longest formatted line sent by /log
+
+_Static_assert(LOG_ENTRIES > 0 && (LOG_ENTRIES & (LOG_ENTRIES - 1)) == 0, "log entries must be a power of 2");
+_Static_assert(LOG_DATA % 4 == 0, "log data is a whole number of words");
+
+typedef struct {
+    atomic_uint seq;        // (ticket + 1) * 2 when complete, odd while written
+    const char *fmt;        // NULL when data holds formatted text
+    uint8_t words;          // argument words used
+    bool truncated;         // ran out of room, the rest of the line is lost
+    uint32_t data[LOG_DATA / 4];    // word aligned, the words are read as such
+} log_entry_t;
+
+static log_entry_t log_ring[LOG_ENTRIES];
+static atomic_uint log_head = 0;
+static vprintf_like_t log_uart = NULL;
+
+/* One conversion specification, enough to replay it with snprintf */
+typedef struct {
+    char spec[16];          // "%-08.3lld"
+    char conv;
+    bool star_width;
+    bool star_prec;
+    int prec;               // -1 if none
+    bool wide;              // 64-bit integer
+} log_spec_t;
+
+/* Parse the specification at *fmt (just after '%'), advancing past it */
+static bool log_parse_spec(const char **fmt, log_spec_t *s)
+{
+    const char *p = *fmt;
+    int n = 1;
+
+    memset(s, 0, sizeof(*s));
+    s->prec = -1;
+    s->spec[0] = '%';
+    while (*p && strchr("-+ #0", *p))
+        p++;
+    if (*p == '*') {
+        s->star_width = true;
+        p++;
+    }
+    while (*p >= '0' && *p <= '9')
+        p++;
+    if (*p == '.') {
+        p++;
+        s->prec = 0;
+        if (*p == '*') {
+            s->star_prec = true;
+            p++;
+        }
+        while (*p >= '0' && *p <= '9')
+            s->prec = s->prec * 10 + (*p++ - '0');
+    }
+    if (*p == 'l' && p[1] == 'l') {
+        s->wide = true;
+        p += 2;
+    } else if (*p == 'j' || *p == 'L') {
+        s->wide = true;
+        p++;
+    } else {
+        while (*p && strchr("hlzt", *p))
+            p++;
+    }
+    if (*p == '\0' || p - *fmt + 3 > sizeof(s->spec))
+        return false;
+    s->conv = *p++;
+    memcpy(s->spec + n, *fmt, p - *fmt);
+    s->spec[n + (p - *fmt)] = '\0';
+    *fmt = p;
+    return true;
+}
+
+/* Copy the arguments fmt will need, false if they do not fit */
+static bool log_capture(log_entry_t *e, const char *fmt, va_list ap)
+{
+    uint32_t *words = e->data;
+    uint8_t *bytes = (uint8_t *)e->data;    // strings are at byte offsets
+    int nwords = 0, strs = LOG_DATA;     // strings are packed down from the end
+    log_spec_t s;
+
+    while ((fmt = strchr(fmt, '%')) != NULL) {
+        fmt++;
+        if (*fmt == '%') {
+            fmt++;
+            continue;
+        }
+        if (!log_parse_spec(&fmt, &s))
+            return false;
+        if ((nwords + 4) * 4 > strs)
+            return false;
+        if (s.star_width)
+            words[nwords++] = va_arg(ap, int);
+        if (s.star_prec)
+            s.prec = words[nwords++] = va_arg(ap, int);
+
+        switch (s.conv) {
+        case 's': {
+            const char *str = va_arg(ap, const char *);
+            size_t len = str ? strnlen(str, s.prec >= 0 ? s.prec : LOG_DATA) : 0;
+            if (str == NULL) {
+                str = "(null)";
+                len = 6;
+            }
+            if (nwords * 4 + len + 1 + 4 > strs)
+                return false;
+            strs -= len + 1;
+            memcpy(bytes + strs, str, len);
+            bytes[strs + len] = '\0';
+            words[nwords++] = strs;
+            break;
+        }
+        case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A': {
+            double d = va_arg(ap, double);
+            memcpy(&words[nwords], &d, sizeof(d));
+            nwords += 2;
+            break;
+        }
+        case 'n':
+            (void)va_arg(ap, int *);
+            break;
+        default:
+            if (s.wide) {
+                long long v = va_arg(ap, long long);
+                memcpy(&words[nwords], &v, sizeof(v));
+                nwords += 2;
+            } else {
+                words[nwords++] = va_arg(ap, unsigned);
+            }
+            break;
+        }
+    }
+    e->words = nwords;
+    return true;
+}
+
+/* Format a captured entry, the reverse of log_capture() */
+static int log_render(const log_entry_t *e, char *out, size_t size)
+{
+    const uint32_t *words = e->data;
+    const char *fmt = e->fmt;
+    size_t len = 0;
+    int w = 0;
+    log_spec_t s;
+
+    if (fmt == NULL)
+        return snprintf(out, size, "%.*s%s", LOG_DATA, (const char *)e->data, e->truncated ? "...\n" : "");
+
+    while (*fmt && len < size - 1) {
+        const char *pct = strchr(fmt, '%');
+        size_t lit = pct ? pct - fmt : strlen(fmt);
+
+        lit = MIN(lit, size - 1 - len);
+        memcpy(out + len, fmt, lit);
+        len += lit;
+        if (pct == NULL || len >= size - 1)
+            break;
+        fmt = pct + 1;
+        if (*fmt == '%') {
+            out[len++] = '%';
+            fmt++;
+            continue;
+        }
+        if (!log_parse_spec(&fmt, &s))
+            break;
+
+        // Replay one conversion, the * arguments come first
+        int a[2], na = 0;
+        if (s.star_width)
+            a[na++] = words[w++];
+        if (s.star_prec)
+            a[na++] = words[w++];
+        char *dst = out + len;
+        size_t room = size - len;
+        int n;
+        if (s.conv == 's') {
+            const char *str = (const char *)e->data + words[w++];
+            n = na == 2 ? snprintf(dst, room, s.spec, a[0], a[1], str) :
+                na == 1 ? snprintf(dst, room, s.spec, a[0], str) : snprintf(dst, room, s.spec, str);
+        } else if (strchr("fFeEgGaA", s.conv)) {
+            double d;
+            memcpy(&d, &words[w], sizeof(d));
+            w += 2;
+            n = na == 2 ? snprintf(dst, room, s.spec, a[0], a[1], d) :
+                na == 1 ? snprintf(dst, room, s.spec, a[0], d) : snprintf(dst, room, s.spec, d);
+        } else if (s.conv == 'n') {
+            n = 0;
+        } else if (s.wide) {
+            long long v;
+            memcpy(&v, &words[w], sizeof(v));
+            w += 2;
+            n = na == 2 ? snprintf(dst, room, s.spec, a[0], a[1], v) :
+                na == 1 ? snprintf(dst, room, s.spec, a[0], v) : snprintf(dst, room, s.spec, v);
+        } else {
+            unsigned v = words[w++];
+            n = na == 2 ? snprintf(dst, room, s.spec, a[0], a[1], v) :
+                na == 1 ? snprintf(dst, room, s.spec, a[0], v) : snprintf(dst, room, s.spec, v);
+        }
+        if (n < 0)
+            break;
+        len += MIN((size_t)n, room - 1);
+    }
+    // A line cut short still ends the line
+    if (len == size - 1)
+        out[len - 1] = '\n';
+    out[len] = '\0';
+    return len;
+}
+
+/* esp_log output hook, runs in whichever task logged */
+static int logring_vprintf(const char *fmt, va_list ap)
+{
+    unsigned ticket = atomic_fetch_add(&log_head, 1);
+    log_entry_t *e = &log_ring[ticket & (LOG_ENTRIES - 1)];
+    unsigned seq = atomic_load_explicit(&e->seq, memory_order_relaxed);
+    va_list copy;
+
+    // Odd means another writer is still in this slot, a lap behind
+    if ((seq & 1) || !atomic_compare_exchange_strong(&e->seq, &seq, seq | 1)) {
+        atomic_fetch_add(&metric_log_dropped, 1);
+        return 0;
+    }
+    atomic_thread_fence(memory_order_release);
+
+    va_copy(copy, ap);
+    e->truncated = false;
+    e->fmt = fmt;
+    if (!esp_ptr_in_drom(fmt) || !log_capture(e, fmt, copy)) {
+        va_end(copy);
+        va_copy(copy, ap);
+        e->fmt = NULL;
+        e->truncated = vsnprintf((char *)e->data, LOG_DATA, fmt, copy) >= LOG_DATA;
+    }
+    va_end(copy);
+    atomic_store_explicit(&e->seq, (ticket + 1) * 2, memory_order_release);
+
+    if (log_uart)
+        return log_uart(fmt, ap);
+    return 0;
+}
+
+/* Send up to count of the newest lines, oldest first */
+esp_err_t logring_send(httpd_req_t *req, unsigned count)
+{
+    log_entry_t copy;
+    char line[LOG_LINE];
+    unsigned head = atomic_load(&log_head);
+    unsigned ticket = (head > count) ? head - count : 0;
+    esp_err_t err;
+
+    if (head - ticket > LOG_ENTRIES)
+        ticket = head - LOG_ENTRIES;
+    for (; ticket != head; ticket++) {
+        const log_entry_t *e = &log_ring[ticket & (LOG_ENTRIES - 1)];
+
+        // Skip a slot that is being written or has been reused since
+        unsigned seq = atomic_load_explicit(&e->seq, memory_order_acquire);
+        if (seq != (ticket + 1) * 2)
+            continue;
+        memcpy(&copy, e, sizeof(copy));
+        atomic_thread_fence(memory_order_acquire);
+        if (seq != atomic_load_explicit(&e->seq, memory_order_relaxed))
+            continue;
+
+        log_render(&copy, line, sizeof(line));
+        if ((err = httpd_resp_sendstr_chunk(req, line)) != ESP_OK)
+            return err;
+    }
+    return ESP_OK;
+}
+
+/* Route log output to the ring, and on to the UART if configured */
+void logring_init(void)
+{
+    vprintf_like_t prev = esp_log_set_vprintf(logring_vprintf);
+
+#if CONFIG_WEBSTER_LOG_UART
+    log_uart = prev;
+#else
+    ESP_LOGI("log", "Logging to RAM only, read it with GET /log");
+    (void)prev;
+#endif
+}
@@ -12,96 +12,80 @@
 #include <string.h>
 #include "esp_event.h"
 #include <esp_log.h>
-#include "tinyusb.h"
-#include "usb_descriptors.h"
+#include "stage.h"
 
 static const char *TAG = "webster";
 
 /* Forware declaration */
+void logring_init(void);
+void pool_init(void);
 void nvs_init(void);
+void config_init(void);
 void usb_init(void);
-bool wifi_isup(void);
+void seq_init(void);
 void wifi_init(void);
 void httpd_init(void);
+void ota_preerase(void);
+void udp_init(void);
 
-extern uint32_t button_pressed;
+/* Bring up USB beside the rest of app_main, the PHY and driver setup
+ * need not hold up the web server */
+static void usb_start_task(void *arg)
+{
+    usb_init();
+    stage_mark(STAGE_USB_INIT);
+    vTaskDelete(NULL);
+}
 
-/* Main application */
+/* Main application
+ *
+ * WiFi association is the slowest stage, so it is started as soon as
+ * its settings are loaded and everything else comes up while the radio
+ * scans and associates. Stage times are in the log once WiFi has an
+ * address, and at GET /startup.
+ */
 void app_main(void)
 {
-    uint8_t sequence;
-    uint8_t key_active;
+    stage_mark(STAGE_APP_MAIN);
+
+    // Log to RAM from here on, the UART is slow and nobody is listening
+    logring_init();
+
+    // Request and OTA buffers, before anything can ask for one
+    pool_init();
 
     // Turn on event loop
     ESP_ERROR_CHECK(esp_event_loop_create_default());
 
     // Initialize NVS subsystem
     nvs_init();
+    stage_mark(STAGE_NVS);
 
-    // Connect USB
-    usb_init();
+    // Load settings once, everything after reads them from RAM
+    config_init();
+    stage_mark(STAGE_CONFIG);
 
-    // Initialize the WiFi
+    // Start the WiFi, it connects and reconnects on its own
     wifi_init();
+    stage_mark(STAGE_WIFI_INIT);
+
+    // Start key sequencer, web server hands it button presses.
+    // Must be up before USB so an armed selection sees the mount.
+    seq_init();
+    stage_mark(STAGE_SEQ);
 
-    // Start web server
+    // Connect USB, in parallel with the web server setup
+    xTaskCreate(usb_start_task, "usb_start", 4096, NULL, uxTaskPriorityGet(NULL), NULL);
+
+    // Start web server, it listens before WiFi has an address
     httpd_init();
+    stage_mark(STAGE_HTTPD);
+
+    // Datagram control, the same commands as /ctrl without TCP or HTTP
+    udp_init();
+    stage_mark(STAGE_UDP);
 
-    // Main task - loop forever
-    while (1) {
-        // Watch for connection loss and try reconnect
-        vTaskDelay(pdMS_TO_TICKS(1000));
-        if (!wifi_isup()) {     // WiFi failed, re-init
-            ESP_LOGI(TAG, "WiFi down, attempting restart");
-            wifi_init();
-        }
-
-        // Web server sets button_pressed based on POST command
-        // Record button_pressed so it can't change during sequence
-        uint32_t btn = button_pressed;
-        if ( btn ) {
-            // Send key sequence
-            //     30 spaces (halts grub autoboot)
-            //     n down arrows corresponding to button number
-            //     ENTER to start boot
-            sequence = 33;
-            key_active = 0;
-            for(int i=0;(i < 6000) && (sequence != 0);i++) {
-                if ( tud_suspended() ) {
-                    // Wake up host if we are in suspend mode
-                    // and REMOTE_WAKEUP feature is enabled by host
-                    tud_remote_wakeup();
-                }
-
-                // Send next keypress in sequence
-                if ( tud_hid_ready() ) {
-                    if ( key_active == 0 ) {
-                        uint8_t keycode[6] = { 0 };
-                        if ( sequence == 1 ) {
-                            keycode[0] = HID_KEY_ENTER;
-                        } else if ( sequence <= btn ) {
-                            keycode[0] = HID_KEY_ARROW_DOWN;
-                        } else {
-                            keycode[0] = HID_KEY_SPACE;
-                        }
-                        tud_hid_keyboard_report(REPORT_ID_KEYBOARD, 0, keycode);
-                        key_active = 1;
-                        vTaskDelay(pdMS_TO_TICKS(10));
-                    } else {
-                        tud_hid_keyboard_report(REPORT_ID_KEYBOARD, 0, NULL);
-                        sequence = sequence - 1;
-                        key_active = 0;
-                        vTaskDelay(pdMS_TO_TICKS(500));
-                    }
-                } else {
-                    vTaskDelay(pdMS_TO_TICKS(10));
-                }
-            }
-            if (sequence != 0)
-                printf("Timeout before sequence ended\n");
-
-            // Clear command and discard any that occurred during execution
-            button_pressed = 0;
-        }
-    }
+    // Blank the next OTA partition once things are quiet
+    ota_preerase();
+    stage_mark(STAGE_INIT_DONE);
 }
@@ -0,0 +1,204 @@
+/*
+ * Run-time metrics in Prometheus text exposition format
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <esp_system.h>
+#include <esp_wifi.h>
+#include "admit.h"
+#include "metrics.h"
+#include "pool.h"
+#include "wifi.h"
+
+/* Bucket upper bounds in microseconds, the last one is +Inf */
+static const uint32_t bounds_us[METRICS_BUCKETS - 1] = {
+    100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000,
+    100000, 250000, 500000, 1000000, 2500000, 5000000, 10000000, 30000000,
+};
+static const char *bounds_le[METRICS_BUCKETS] = {
+    "0.0001", "0.00025", "0.0005", "0.001", "0.0025", "0.005", "0.01", "0.025", "0.05",
+    "0.1", "0.25", "0.5", "1", "2.5", "5", "10", "30", "+Inf",
+};
+
+metrics_hist_t metric_seq_first_key;
+metrics_hist_t metric_seq_done;
+metrics_hist_t metric_ota_write;
+atomic_uint metric_ota_bytes;
+atomic_uint metric_ota_last_bps;
+atomic_uint metric_wifi_reconnects;
+atomic_uint metric_log_dropped;
+metrics_hist_t metric_probe_jitter[WIFI_PS_MODES];
+atomic_uint metric_http_rate_limited;
+atomic_uint metric_http_reserved;
+atomic_uint metric_http_purged;
+
+/* Record one observation, only ever called by the metric's own writer */
+void metrics_hist_observe(metrics_hist_t *h, int64_t us)
+{
+    int i;
+
+    if (us < 0)
+        us = 0;
+    for (i = 0; i < METRICS_BUCKETS - 1; i++) {
+        if (us <= bounds_us[i])
+            break;
+    }
+
+    unsigned seq = atomic_load_explicit(&h->seq, memory_order_relaxed);
+    atomic_store_explicit(&h->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    h->count++;
+    h->sum_us += us;
+    h->bucket[i]++;
+    atomic_store_explicit(&h->seq, seq + 2, memory_order_release);
+}
+
+/* Take a consistent copy, retrying if the writer was mid-update */
+static void metrics_hist_read(const metrics_hist_t *h, metrics_hist_t *copy)
+{
+    unsigned seq;
+
+    do {
+        seq = atomic_load_explicit(&h->seq, memory_order_acquire);
+        copy->count = h->count;
+        copy->sum_us = h->sum_us;
+        memcpy(copy->bucket, h->bucket, sizeof(copy->bucket));
+        atomic_thread_fence(memory_order_acquire);
+    } while ((seq & 1) || seq != atomic_load_explicit(&h->seq, memory_order_relaxed));
+}
+
+/* Send one histogram, labels is "" or e.g. "route=\"/ctrl\"," */
+esp_err_t metrics_send_hist(httpd_req_t *req, const char *name, const char *labels,
+                            const metrics_hist_t *h)
+{
+    metrics_hist_t copy;
+    char line[128];
+    uint32_t cumulative = 0;
+    esp_err_t err;
+
+    metrics_hist_read(h, &copy);
+    for (int i = 0; i < METRICS_BUCKETS; i++) {
+        cumulative += copy.bucket[i];
+        snprintf(line, sizeof(line), "%s_bucket{%sle=\"%s\"} %"PRIu32"\n",
+                 name, labels, bounds_le[i], cumulative);
+        if ((err = httpd_resp_sendstr_chunk(req, line)) != ESP_OK)
+            return err;
+    }
+
+    // Prometheus wants no trailing comma inside the braces
+    size_t len = strlen(labels);
+    snprintf(line, sizeof(line), "%s_sum{%.*s} %"PRIu64".%06"PRIu64"\n%s_count{%.*s} %"PRIu32"\n",
+             name, len ? (int)len - 1 : 0, labels, copy.sum_us / 1000000, copy.sum_us % 1000000,
+             name, len ? (int)len - 1 : 0, labels, copy.count);
+    return httpd_resp_sendstr_chunk(req, line);
+}
+
+/* Send everything except the per-route metrics, which httpd owns */
+esp_err_t metrics_send(httpd_req_t *req)
+{
+    char buf[512];
+    wifi_ap_record_t ap;
+    int rssi = 0;
+
+    httpd_resp_sendstr_chunk(req,
+        "# HELP webster_seq_first_key_seconds Command submitted to first HID report delivered\n"
+        "# TYPE webster_seq_first_key_seconds histogram\n");
+    metrics_send_hist(req, "webster_seq_first_key_seconds", "", &metric_seq_first_key);
+    httpd_resp_sendstr_chunk(req,
+        "# HELP webster_seq_done_seconds Command submitted to key sequence complete\n"
+        "# TYPE webster_seq_done_seconds histogram\n");
+    metrics_send_hist(req, "webster_seq_done_seconds", "", &metric_seq_done);
+    httpd_resp_sendstr_chunk(req,
+        "# HELP webster_ota_write_seconds Time spent in one flash write during OTA\n"
+        "# TYPE webster_ota_write_seconds histogram\n");
+    metrics_send_hist(req, "webster_ota_write_seconds", "", &metric_ota_write);
+    httpd_resp_sendstr_chunk(req,
+        "# HELP webster_probe_jitter_seconds Change in gap between successive /probe arrivals\n"
+        "# TYPE webster_probe_jitter_seconds histogram\n");
+    for (int i = 0; i < WIFI_PS_MODES; i++) {
+        snprintf(buf, sizeof(buf), "ps=\"%s\",", wifi_ps_name(i));
+        metrics_send_hist(req, "webster_probe_jitter_seconds", buf, &metric_probe_jitter[i]);
+    }
+
+    if (esp_wifi_sta_get_ap_info(&ap) == ESP_OK)
+        rssi = ap.rssi;
+
+    snprintf(buf, sizeof(buf),
+        "# HELP webster_ota_bytes_total Firmware bytes written by OTA\n"
+        "# TYPE webster_ota_bytes_total counter\n"
+        "webster_ota_bytes_total %u\n"
+        "# HELP webster_ota_last_bytes_per_second Throughput of the last OTA upload\n"
+        "# TYPE webster_ota_last_bytes_per_second gauge\n"
+        "webster_ota_last_bytes_per_second %u\n"
+        "# HELP webster_wifi_reconnects_total WiFi reconnect attempts\n"
+        "# TYPE webster_wifi_reconnects_total counter\n"
+        "webster_wifi_reconnects_total %u\n",
+        atomic_load(&metric_ota_bytes), atomic_load(&metric_ota_last_bps),
+        atomic_load(&metric_wifi_reconnects));
+    httpd_resp_sendstr_chunk(req, buf);
+
+    snprintf(buf, sizeof(buf),
+        "# HELP webster_wifi_rssi_dbm Signal strength of the current AP\n"
+        "# TYPE webster_wifi_rssi_dbm gauge\n"
+        "webster_wifi_rssi_dbm %d\n"
+        "# HELP webster_wifi_power_save Current power save mode\n"
+        "# TYPE webster_wifi_power_save gauge\n"
+        "webster_wifi_power_save{ps=\"%s\"} 1\n"
+        "# HELP webster_log_dropped_total Log lines lost to a full log ring\n"
+        "# TYPE webster_log_dropped_total counter\n"
+        "webster_log_dropped_total %u\n",
+        rssi, wifi_ps_name(wifi_get_ps()),
+        atomic_load(&metric_log_dropped));
+    httpd_resp_sendstr_chunk(req, buf);
+
+    snprintf(buf, sizeof(buf),
+        "# HELP webster_http_rejected_total Requests turned away by admission control\n"
+        "# TYPE webster_http_rejected_total counter\n"
+        "webster_http_rejected_total{reason=\"rate\"} %u\n"
+        "webster_http_rejected_total{reason=\"reserved\"} %u\n",
+        atomic_load(&metric_http_rate_limited), atomic_load(&metric_http_reserved));
+    httpd_resp_sendstr_chunk(req, buf);
+
+    snprintf(buf, sizeof(buf),
+        "# HELP webster_http_purged_total Idle connections closed to accept a new one\n"
+        "# TYPE webster_http_purged_total counter\n"
+        "webster_http_purged_total %u\n"
+        "# HELP webster_http_open_connections Connections open now\n"
+        "# TYPE webster_http_open_connections gauge\n"
+        "webster_http_open_connections %u\n",
+        atomic_load(&metric_http_purged), admit_open());
+    httpd_resp_sendstr_chunk(req, buf);
+
+    // Buffer pools, one family at a time as Prometheus expects
+    static const struct { const char *name, *help, *type; } pool_metrics[] = {
+        { "webster_pool_blocks", "Blocks in the buffer pool", "gauge" },
+        { "webster_pool_in_use_blocks", "Blocks currently taken", "gauge" },
+        { "webster_pool_high_water_blocks", "Most blocks taken at once since boot", "gauge" },
+        { "webster_pool_exhausted_total", "Requests that found the pool empty", "counter" },
+    };
+    for (int m = 0; m < sizeof(pool_metrics) / sizeof(pool_metrics[0]); m++) {
+        snprintf(buf, sizeof(buf), "# HELP %s %s\n# TYPE %s %s\n", pool_metrics[m].name,
+                 pool_metrics[m].help, pool_metrics[m].name, pool_metrics[m].type);
+        httpd_resp_sendstr_chunk(req, buf);
+        for (int i = 0; i < pool_count(); i++) {
+            pool_stats_t st;
+            pool_stats(i, &st);
+            unsigned val = (m == 0) ? st.count : (m == 1) ? st.in_use : (m == 2) ? st.high_water : st.exhausted;
+            snprintf(buf, sizeof(buf), "%s{pool=\"%s\",size=\"%u\"} %u\n",
+                     pool_metrics[m].name, st.name, (unsigned)st.size, val);
+            httpd_resp_sendstr_chunk(req, buf);
+        }
+    }
+
+    snprintf(buf, sizeof(buf),
+        "# HELP webster_heap_free_bytes Free heap\n"
+        "# TYPE webster_heap_free_bytes gauge\n"
+        "webster_heap_free_bytes %"PRIu32"\n"
+        "# HELP webster_heap_min_free_bytes Lowest free heap since boot\n"
+        "# TYPE webster_heap_min_free_bytes gauge\n"
+        "webster_heap_min_free_bytes %"PRIu32"\n",
+        esp_get_free_heap_size(), esp_get_minimum_free_heap_size());
+    return httpd_resp_sendstr_chunk(req, buf);
+}
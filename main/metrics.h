@@ -0,0 +1,53 @@
+/*
+ * Run-time metrics
+ *
+ * Every metric has a single writer task, so updates are plain stores
+ * ordered by a per-histogram sequence count and never take a lock.
+ * Counters with more than one writer use atomic adds.
+ */
+
+#ifndef METRICS_H_
+#define METRICS_H_
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <esp_http_server.h>
+
+#define METRICS_BUCKETS     18
+
+typedef struct {
+    atomic_uint seq;        // odd while the writer is updating
+    uint32_t count;
+    uint64_t sum_us;
+    uint32_t bucket[METRICS_BUCKETS];   // per bucket, not cumulative
+} metrics_hist_t;
+
+/* Sequencer task */
+extern metrics_hist_t metric_seq_first_key;    // submit to first report delivered
+extern metrics_hist_t metric_seq_done;         // submit to sequence complete
+
+/* OTA, written by whichever task calls ota_write() */
+extern metrics_hist_t metric_ota_write;        // one esp_ota_write call
+extern atomic_uint metric_ota_bytes;
+extern atomic_uint metric_ota_last_bps;
+
+/* WiFi event handler */
+extern atomic_uint metric_wifi_reconnects;
+
+/* Any task that logs */
+extern atomic_uint metric_log_dropped;
+
+/* httpd task, /probe arrival jitter per WiFi power save mode */
+extern metrics_hist_t metric_probe_jitter[];
+
+/* httpd task, admission control */
+extern atomic_uint metric_http_rate_limited;   // answered 429
+extern atomic_uint metric_http_reserved;       // turned away from the /ctrl slot
+extern atomic_uint metric_http_purged;         // idle connections closed for a new one
+
+void metrics_hist_observe(metrics_hist_t *h, int64_t us);
+esp_err_t metrics_send_hist(httpd_req_t *req, const char *name, const char *labels,
+                            const metrics_hist_t *h);
+esp_err_t metrics_send(httpd_req_t *req);
+
+#endif /* METRICS_H_ */
@@ -7,11 +7,24 @@
    CONDITIONS OF ANY KIND, either express or implied.
 */
 
+#include <stdlib.h>
+#include <string.h>
 #include <esp_log.h>
 #include <esp_system.h>
 #include <sys/param.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
 #include "esp_partition.h"
 #include "esp_ota_ops.h"
+#include "spi_flash_mmap.h"
+#include "esp_timer.h"
+#include "esp_rom_crc.h"
+#include "rom/miniz.h"
+#include "metrics.h"
+#include "pool.h"
+#include "tasks.h"
 
 /* Should put these in .h file(s) */
 static const char *TAG = "ota";
@@ -19,31 +32,465 @@ static const char *TAG = "ota";
 /* Local storage */
 static const esp_partition_t *update_partition = NULL;
 static esp_ota_handle_t update_handle = 0;
+static int64_t update_start;
+static uint32_t update_bytes;
+static uint32_t update_bps;
+static uint32_t update_rx;      // bytes received, compressed or not
+static uint32_t update_erased;  // partition bytes known blank, from the start
+static bool update_open;        // between esp_ota_begin and esp_ota_end
+
+/* Chunked upload session, kept across connections until finished */
+static bool chunk_open;
+static uint32_t chunk_offset;   // upload bytes accepted so far
+static uint32_t chunk_total;
+
+/* Background erase of the update partition while nothing is uploading */
+#define ERASE_BLOCK     (16 * SPI_FLASH_SEC_SIZE)
+
+static SemaphoreHandle_t erase_lock = NULL;
+static bool erase_stop;
+static uint32_t erase_done;     // bytes blank from the start of the partition
+
+/* Images starting with the gzip magic are inflated on the way to flash
+ * using the ROM copy of miniz. The 32 KB window and the decompressor
+ * state come from their own single-block pools */
+typedef enum {
+    OTA_FMT_UNKNOWN,    // nothing received yet
+    OTA_FMT_RAW,
+    OTA_FMT_GZ_HEADER,
+    OTA_FMT_GZ_DATA,
+    OTA_FMT_GZ_TRAILER,
+    OTA_FMT_GZ_DONE,
+} ota_fmt_t;
+
+#define GZ_FHCRC        0x02
+#define GZ_FEXTRA       0x04
+#define GZ_FNAME        0x08
+#define GZ_FCOMMENT     0x10
+#define GZ_FRESERVED    0xe0
+
+static struct {
+    ota_fmt_t fmt;
+    tinfl_decompressor *inf;
+    uint8_t *dict;          // TINFL_LZ_DICT_SIZE output window
+    size_t dict_ofs;
+    uint32_t crc;
+    uint32_t size;
+    uint8_t flags;          // header fields still to skip
+    uint32_t pos;           // header or trailer bytes seen
+    uint32_t skip;
+    uint8_t trailer[8];     // CRC32 and ISIZE, little endian
+    uint8_t tail[8];        // last bytes tinfl consumed
+} gz;
+
+/* Writer pipeline - the httpd task fills pool buffers from the socket
+ * while the writer task programs flash from the previous ones */
+typedef struct {
+    char *buf;
+    int len;            // < 0 asks the writer to signal it has drained
+} ota_chunk_t;
+
+static QueueHandle_t ota_full_q = NULL;     // buffers waiting for flash
+static SemaphoreHandle_t ota_drained = NULL;
+static volatile esp_err_t ota_pipe_err;     // first write error, sticky until ota_init
+
+esp_err_t ota_write(char *buf, int len);
+static esp_err_t ota_put(const uint8_t *p, int len);
+static void gz_free(void);
+
+/* Writer task - programs flash from filled buffers */
+static void ota_writer_task(void *arg)
+{
+    ota_chunk_t chunk;
+
+    while (1) {
+        xQueueReceive(ota_full_q, &chunk, portMAX_DELAY);
+        if (chunk.len < 0) {
+            xSemaphoreGive(ota_drained);
+            continue;
+        }
+        // After an error keep recycling buffers but stop writing
+        if (ota_pipe_err == ESP_OK) {
+            esp_err_t err = ota_put((const uint8_t *)chunk.buf, chunk.len);
+            if (err != ESP_OK) {
+                ESP_LOGE(TAG, "esp_ota_write failed (%s)", esp_err_to_name(err));
+                ota_pipe_err = err;
+            }
+        }
+        pool_put(chunk.buf);
+    }
+}
+
+/* Create the writer queue and task on first use */
+static void ota_pipe_init(void)
+{
+    if (ota_full_q)
+        return;
+    ota_full_q = xQueueCreate(CONFIG_WEBSTER_OTA_BUF_COUNT + 1, sizeof(ota_chunk_t));
+    ota_drained = xSemaphoreCreateBinary();
+    assert(ota_full_q && ota_drained);
+    xTaskCreatePinnedToCore(ota_writer_task, "ota_writer", 4096, NULL, tskIDLE_PRIORITY + 4, NULL, TASK_CORE_NET);
+}
+
+/* Get an empty buffer of CONFIG_WEBSTER_OTA_BUF_SIZE bytes, waits up
+ * to wait ticks for the writer if all of them are queued for flash */
+char *ota_buf_get(TickType_t wait)
+{
+    return pool_get(POOL_ID_OTA, wait);
+}
+
+/* Hand a buffer back without writing it */
+void ota_buf_put(char *buf)
+{
+    pool_put(buf);
+}
+
+/* Queue a filled buffer for flash, returns the writer's first error
+ * so the caller can stop receiving early */
+esp_err_t ota_buf_write(char *buf, int len)
+{
+    ota_chunk_t chunk = { .buf = buf, .len = len };
+
+    xQueueSend(ota_full_q, &chunk, portMAX_DELAY);
+    return ota_pipe_err;
+}
+
+/* Wait for every queued buffer to reach flash */
+esp_err_t ota_buf_drain(void)
+{
+    ota_chunk_t chunk = { .buf = NULL, .len = -1 };
+
+    xQueueSend(ota_full_q, &chunk, portMAX_DELAY);
+    xSemaphoreTake(ota_drained, portMAX_DELAY);
+    return ota_pipe_err;
+}
+
+#if CONFIG_WEBSTER_OTA_PREERASE
+static TaskHandle_t erase_task = NULL;
+
+/* True if the block at ofs is already blank, saves erasing it again */
+static bool ota_blank(const esp_partition_t *part, uint32_t ofs, char *buf)
+{
+    for (uint32_t i = 0; i < ERASE_BLOCK && ofs + i < part->size; i += SPI_FLASH_SEC_SIZE) {
+        if (esp_partition_read(part, ofs + i, buf, SPI_FLASH_SEC_SIZE) != ESP_OK)
+            return false;
+        for (int j = 0; j < SPI_FLASH_SEC_SIZE; j += 4) {
+            if (*(uint32_t *)(buf + j) != 0xffffffff)
+                return false;
+        }
+    }
+    return true;
+}
+
+/* Eraser task - waits to be kicked, then some idle time, then blanks the
+ * update partition a block at a time so uploads never wait on erases */
+static void ota_erase_task(void *arg)
+{
+    static char buf[SPI_FLASH_SEC_SIZE];
+    const esp_partition_t *part;
+
+    while (1) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        vTaskDelay(pdMS_TO_TICKS(CONFIG_WEBSTER_OTA_PREERASE_DELAY * 1000));
+        part = esp_ota_get_next_update_partition(NULL);
+        if (part == NULL)
+            continue;
+
+        int64_t start = esp_timer_get_time();
+        for (uint32_t ofs = 0; ; ofs += ERASE_BLOCK) {
+            xSemaphoreTake(erase_lock, portMAX_DELAY);
+            if (erase_stop || ofs >= part->size) {
+                xSemaphoreGive(erase_lock);
+                break;
+            }
+            if (!ota_blank(part, ofs, buf) &&
+                esp_partition_erase_range(part, ofs, MIN(ERASE_BLOCK, part->size - ofs)) != ESP_OK) {
+                xSemaphoreGive(erase_lock);
+                break;
+            }
+            erase_done = MIN(ofs + ERASE_BLOCK, part->size);
+            xSemaphoreGive(erase_lock);
+            vTaskDelay(1);      // let everything else run between blocks
+        }
+        ESP_LOGI(TAG, "Pre-erased %"PRIu32" bytes in %"PRId64" ms", erase_done,
+                 (esp_timer_get_time() - start) / 1000);
+    }
+}
+#endif
+
+/* Start erasing the update partition in the background */
+void ota_preerase(void)
+{
+#if CONFIG_WEBSTER_OTA_PREERASE
+    if (erase_task == NULL) {
+        erase_lock = xSemaphoreCreateMutex();
+        assert(erase_lock);
+        xTaskCreatePinnedToCore(ota_erase_task, "ota_erase", 2048, NULL, tskIDLE_PRIORITY + 1, &erase_task,
+                                TASK_CORE_NET);
+    }
+    xSemaphoreTake(erase_lock, portMAX_DELAY);
+    erase_stop = false;
+    erase_done = 0;
+    xSemaphoreGive(erase_lock);
+    xTaskNotifyGive(erase_task);
+#endif
+}
+
+/* Stop the background erase, returns how much of the partition is blank.
+ * The upload about to start writes there, so nothing is counted as blank
+ * again until ota_preerase() starts a new pass */
+static uint32_t ota_erase_stop(void)
+{
+    uint32_t done;
+
+    if (erase_lock == NULL)
+        return 0;
+    xSemaphoreTake(erase_lock, portMAX_DELAY);
+    erase_stop = true;
+    done = erase_done;
+    erase_done = 0;
+    xSemaphoreGive(erase_lock);
+    return done;
+}
 
 /* Setup for OTA operation */
 esp_err_t ota_init(void)
 {
     esp_err_t err;
 
+    // A new upload replaces an unfinished chunked one
+    if (update_open) {
+        ESP_LOGI(TAG, "Abandoning unfinished update");
+        ota_buf_drain();
+        esp_ota_abort(update_handle);
+        update_open = false;
+        gz_free();
+    }
+    chunk_open = false;
+
     update_partition = esp_ota_get_next_update_partition(NULL);
     if ( update_partition == NULL ) {
         ESP_LOGI(TAG, "Error: update_partition is NULL");
         return ESP_FAIL;
     }
+    ota_pipe_init();
+    ota_pipe_err = ESP_OK;
+    update_start = esp_timer_get_time();
+    update_bytes = 0;
+    update_bps = 0;
+    update_rx = 0;
+    gz.fmt = OTA_FMT_UNKNOWN;
     ESP_LOGI(TAG, "Writing to partition subtype %d at offset 0x%"PRIx32,
              update_partition->subtype, update_partition->address);
-    err = esp_ota_begin(update_partition, OTA_WITH_SEQUENTIAL_WRITES, &update_handle);
+
+    /* Given a size, esp_ota_begin erases just that much up front rather
+     * than each sector as writes reach it. Ask for one sector and let
+     * ota_write erase ahead of itself past what the eraser finished */
+    update_erased = MAX(ota_erase_stop(), SPI_FLASH_SEC_SIZE);
+    err = esp_ota_begin(update_partition, SPI_FLASH_SEC_SIZE, &update_handle);
     if (err != ESP_OK) {
         ESP_LOGE(TAG, "esp_ota_begin failed (%s)", esp_err_to_name(err));
         return err;
     }
+    update_open = true;
     return ESP_OK;
 }
 
 /* Write a chunk of data */
 esp_err_t ota_write(char *buf, int len)
 {
-    return esp_ota_write( update_handle, (const void *)buf, len);
+    int64_t start = esp_timer_get_time();
+    esp_err_t err = ESP_OK;
+
+    // Writes are sequential, erase whatever this one reaches that is not blank yet
+    if (update_bytes + len > update_erased) {
+        uint32_t end = (update_bytes + len + SPI_FLASH_SEC_SIZE - 1) & ~(SPI_FLASH_SEC_SIZE - 1);
+        end = MIN(end, update_partition->size);
+        err = esp_partition_erase_range(update_partition, update_erased, end - update_erased);
+        if (err != ESP_OK)
+            return err;
+        update_erased = end;
+    }
+    err = esp_ota_write( update_handle, (const void *)buf, len);
+    metrics_hist_observe(&metric_ota_write, esp_timer_get_time() - start);
+    if (err == ESP_OK) {
+        update_bytes += len;
+        atomic_fetch_add(&metric_ota_bytes, len);
+    }
+    return err;
+}
+
+/* Consume gzip header bytes (RFC 1952), returns the count used or -1 */
+static int gz_header(const uint8_t *p, int len)
+{
+    int i = 0;
+
+    while (i < len && gz.fmt == OTA_FMT_GZ_HEADER) {
+        uint8_t c = p[i++];
+
+        if (gz.pos < 10) {
+            if (gz.pos == 2 && c != 8)
+                return -1;              // deflate is the only method
+            if (gz.pos == 3) {
+                if (c & GZ_FRESERVED)
+                    return -1;
+                gz.flags = c;
+            }
+            gz.pos++;
+        } else if (gz.flags & GZ_FEXTRA) {
+            if (gz.pos < 12)
+                gz.skip |= c << (8 * (gz.pos++ - 10));
+            else
+                gz.skip--;
+            if (gz.pos == 12 && gz.skip == 0)
+                gz.flags &= ~GZ_FEXTRA;
+        } else if (gz.flags & GZ_FNAME) {
+            if (c == 0)
+                gz.flags &= ~GZ_FNAME;
+        } else if (gz.flags & GZ_FCOMMENT) {
+            if (c == 0)
+                gz.flags &= ~GZ_FCOMMENT;
+        } else if (gz.flags & GZ_FHCRC) {
+            if (++gz.skip == 2)
+                gz.flags &= ~GZ_FHCRC;
+        }
+
+        if (gz.pos >= 10 && gz.flags == 0) {
+            tinfl_init(gz.inf);
+            gz.fmt = OTA_FMT_GZ_DATA;
+        }
+    }
+    return i;
+}
+
+/* Check the gzip trailer against what was inflated */
+static esp_err_t gz_trailer(void)
+{
+    uint32_t crc = gz.trailer[0] | gz.trailer[1] << 8 | gz.trailer[2] << 16 | (uint32_t)gz.trailer[3] << 24;
+    uint32_t size = gz.trailer[4] | gz.trailer[5] << 8 | gz.trailer[6] << 16 | (uint32_t)gz.trailer[7] << 24;
+
+    if (crc != gz.crc || size != gz.size) {
+        ESP_LOGE(TAG, "Compressed image check failed, crc %08"PRIx32"/%08"PRIx32" size %"PRIu32"/%"PRIu32,
+                 gz.crc, crc, gz.size, size);
+        return ESP_ERR_INVALID_CRC;
+    }
+    gz.fmt = OTA_FMT_GZ_DONE;
+    return ESP_OK;
+}
+
+/* Inflate as much of p as possible into the window, writing what comes out */
+static int gz_inflate(const uint8_t *p, int len, esp_err_t *err)
+{
+    size_t in_sz = len;
+    size_t out_sz = TINFL_LZ_DICT_SIZE - gz.dict_ofs;
+    tinfl_status status;
+
+    status = tinfl_decompress(gz.inf, p, &in_sz, gz.dict, gz.dict + gz.dict_ofs, &out_sz,
+                              TINFL_FLAG_HAS_MORE_INPUT);
+    if (in_sz >= sizeof(gz.tail)) {
+        memcpy(gz.tail, p + in_sz - sizeof(gz.tail), sizeof(gz.tail));
+    } else {
+        memmove(gz.tail, gz.tail + in_sz, sizeof(gz.tail) - in_sz);
+        memcpy(gz.tail + sizeof(gz.tail) - in_sz, p, in_sz);
+    }
+    if (out_sz > 0) {
+        *err = ota_write((char *)gz.dict + gz.dict_ofs, out_sz);
+        if (*err != ESP_OK)
+            return -1;
+        gz.crc = esp_rom_crc32_le(gz.crc, gz.dict + gz.dict_ofs, out_sz);
+        gz.size += out_sz;
+        gz.dict_ofs = (gz.dict_ofs + out_sz) & (TINFL_LZ_DICT_SIZE - 1);
+    }
+    if (status < TINFL_STATUS_DONE) {
+        ESP_LOGE(TAG, "Corrupt compressed image (%d)", status);
+        *err = ESP_ERR_INVALID_RESPONSE;
+        return -1;
+    }
+    if (status == TINFL_STATUS_DONE) {
+        // The ROM's tinfl keeps the bytes it read ahead in its bit buffer,
+        // possibly from an earlier call, so the trailer may already have
+        // started. Partial bytes there are the end of the deflate stream.
+        gz.pos = gz.inf->m_num_bits >> 3;
+        if (gz.pos > sizeof(gz.tail)) {
+            ESP_LOGE(TAG, "Corrupt compressed image (%"PRIu32" bits read ahead)", gz.inf->m_num_bits);
+            *err = ESP_ERR_INVALID_RESPONSE;
+            return -1;
+        }
+        memcpy(gz.trailer, gz.tail + sizeof(gz.tail) - gz.pos, gz.pos);
+        gz.fmt = OTA_FMT_GZ_TRAILER;
+        if (gz.pos == sizeof(gz.trailer) && (*err = gz_trailer()) != ESP_OK)
+            return -1;
+    }
+    return in_sz;
+}
+
+/* Free the decompressor, if one was needed */
+static void gz_free(void)
+{
+    pool_put(gz.inf);
+    pool_put(gz.dict);
+    gz.inf = NULL;
+    gz.dict = NULL;
+}
+
+/* Take a chunk of the upload, raw or gzip, called from the writer task */
+static esp_err_t ota_put(const uint8_t *p, int len)
+{
+    esp_err_t err = ESP_OK;
+    int n;
+
+    update_rx += len;
+    if (gz.fmt == OTA_FMT_UNKNOWN) {
+        // An app image starts with 0xe9, so the gzip magic cannot be mistaken for one
+        if (len >= 2 && p[0] == 0x1f && p[1] == 0x8b) {
+            gz.inf = pool_get(POOL_ID_INFLATE, 0);
+            gz.dict = pool_get(POOL_ID_WINDOW, 0);
+            if (gz.inf == NULL || gz.dict == NULL) {
+                gz_free();
+                return ESP_ERR_NO_MEM;
+            }
+            gz.fmt = OTA_FMT_GZ_HEADER;
+            gz.dict_ofs = 0;
+            gz.crc = 0;
+            gz.size = 0;
+            gz.flags = 0;
+            gz.pos = 0;
+            gz.skip = 0;
+            ESP_LOGI(TAG, "Compressed image");
+        } else {
+            gz.fmt = OTA_FMT_RAW;
+        }
+    }
+    if (gz.fmt == OTA_FMT_RAW)
+        return ota_write((char *)p, len);
+
+    while (len > 0) {
+        switch (gz.fmt) {
+        case OTA_FMT_GZ_HEADER:
+            if ((n = gz_header(p, len)) < 0) {
+                ESP_LOGE(TAG, "Unsupported gzip header");
+                return ESP_ERR_NOT_SUPPORTED;
+            }
+            break;
+        case OTA_FMT_GZ_DATA:
+            if ((n = gz_inflate(p, len, &err)) < 0)
+                return err;
+            break;
+        case OTA_FMT_GZ_TRAILER:
+            n = MIN(len, (int)(sizeof(gz.trailer) - gz.pos));
+            memcpy(gz.trailer + gz.pos, p, n);
+            gz.pos += n;
+            if (gz.pos == sizeof(gz.trailer) && (err = gz_trailer()) != ESP_OK)
+                return err;
+            break;
+        default:
+            ESP_LOGE(TAG, "Data after end of compressed image");
+            return ESP_ERR_INVALID_SIZE;
+        }
+        p += n;
+        len -= n;
+    }
+    return ESP_OK;
 }
 
 /* Finalize the OTA operation */
@@ -51,13 +498,34 @@ esp_err_t ota_finish(esp_err_t old_err)
 {
     esp_err_t err;
 
+    if (gz.fmt >= OTA_FMT_GZ_HEADER) {
+        if (old_err == ESP_OK && gz.fmt != OTA_FMT_GZ_DONE) {
+            ESP_LOGE(TAG, "Compressed image truncated");
+            old_err = ESP_ERR_INVALID_SIZE;
+        }
+        if (update_bytes > 0)
+            ESP_LOGI(TAG, "Received %"PRIu32" compressed bytes, %"PRIu32"%% of the image",
+                     update_rx, (uint32_t)((uint64_t)update_rx * 100 / update_bytes));
+        gz_free();
+    }
+
+    int64_t elapsed = esp_timer_get_time() - update_start;
+    if (elapsed > 0) {
+        update_bps = (uint64_t)update_bytes * 1000000 / elapsed;
+        atomic_store(&metric_ota_last_bps, update_bps);
+        ESP_LOGI(TAG, "Wrote %"PRIu32" bytes at %"PRIu32" bytes/s", update_bytes, update_bps);
+    }
+
     ESP_LOGI(TAG, "Update writing complete");
+    update_open = false;
+    chunk_open = false;
     err = esp_ota_end(update_handle);
     if (err != ESP_OK) {
         if (err == ESP_ERR_OTA_VALIDATE_FAILED) {
             ESP_LOGE(TAG, "Image validation failed, image is corrupted");
         }
         ESP_LOGE(TAG, "esp_ota_end failed (%s)!", esp_err_to_name(err));
+        ota_preerase();
         return err;
     }
 
@@ -65,6 +533,7 @@ esp_err_t ota_finish(esp_err_t old_err)
         err = esp_ota_set_boot_partition(update_partition);
         if (err != ESP_OK) {
             ESP_LOGE(TAG, "esp_ota_set_boot_partition failed (%s)!", esp_err_to_name(err));
+            ota_preerase();
             return err;
         }
         //ESP_LOGI(TAG, "Prepare to restart system!");
@@ -72,6 +541,52 @@ esp_err_t ota_finish(esp_err_t old_err)
     }
     ESP_LOGI(TAG, "Update finished");
 
+    // A failed image leaves the partition dirty, a good one must be kept
+    if ( old_err != ESP_OK )
+        ota_preerase();
+
     // If an error was passed in, return it
     return old_err;
 }
+
+/* Size and throughput of the last update */
+void ota_stats(uint32_t *bytes, uint32_t *bps)
+{
+    *bytes = update_bytes;
+    *bps = update_bps;
+}
+
+/* Check where a chunk of a resumable upload goes, offset 0 starts over.
+ * Anything else must continue exactly where the last accepted chunk ended */
+esp_err_t ota_chunk_start(uint32_t offset, uint32_t total)
+{
+    esp_err_t err;
+
+    if (offset == 0) {
+        if (total == 0)
+            return ESP_ERR_INVALID_ARG;
+        if ((err = ota_init()) != ESP_OK)
+            return err;
+        chunk_open = true;
+        chunk_offset = 0;
+        chunk_total = total;
+        return ESP_OK;
+    }
+    if (!chunk_open || offset != chunk_offset || (total && total != chunk_total))
+        return ESP_ERR_INVALID_STATE;
+    return ESP_OK;
+}
+
+/* Account for an accepted chunk, returns true once the upload is whole */
+bool ota_chunk_done(uint32_t len)
+{
+    chunk_offset += len;
+    return chunk_offset >= chunk_total;
+}
+
+/* Where a resumed upload should continue, 0 if there is nothing to resume */
+uint32_t ota_chunk_offset(uint32_t *total)
+{
+    *total = chunk_open ? chunk_total : 0;
+    return chunk_open ? chunk_offset : 0;
+}
@@ -0,0 +1,119 @@
+/*
+ * Fixed-block buffer pools
+ *
+ * Each pool is a static array of blocks with a queue of the free ones,
+ * so a block can be taken in one task and given back in another, as
+ * the OTA writer does. Callers name the pool they take from, whatever
+ * the block sizes, and a pool never spills into another, which would
+ * starve the OTA path of its buffers.
+ */
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <esp_log.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "rom/miniz.h"
+#include "pool.h"
+
+static const char *TAG = "pool";
+
+typedef struct {
+    const char *name;
+    size_t size;
+    unsigned count;
+    uint8_t *blocks;
+    QueueHandle_t free_q;
+    atomic_uint in_use;
+    atomic_uint high_water;
+    atomic_uint exhausted;
+} pool_t;
+
+/* Word aligned, OTA buffers go straight to flash */
+static uint8_t pool_small[CONFIG_WEBSTER_POOL_SMALL_COUNT][POOL_SMALL] __attribute__((aligned(4)));
+static uint8_t pool_ota[CONFIG_WEBSTER_OTA_BUF_COUNT][CONFIG_WEBSTER_OTA_BUF_SIZE] __attribute__((aligned(4)));
+static tinfl_decompressor pool_inflate[1];
+static uint8_t pool_window[1][TINFL_LZ_DICT_SIZE] __attribute__((aligned(4)));
+
+static pool_t pools[POOL_IDS] = {
+    [POOL_ID_SMALL]   = { "small", sizeof(pool_small[0]), CONFIG_WEBSTER_POOL_SMALL_COUNT, pool_small[0] },
+    [POOL_ID_OTA]     = { "ota", sizeof(pool_ota[0]), CONFIG_WEBSTER_OTA_BUF_COUNT, pool_ota[0] },
+    [POOL_ID_INFLATE] = { "inflate", sizeof(pool_inflate[0]), 1, (uint8_t *)pool_inflate },
+    [POOL_ID_WINDOW]  = { "window", sizeof(pool_window[0]), 1, pool_window[0] },
+};
+
+void pool_init(void)
+{
+    for (int i = 0; i < POOL_IDS; i++) {
+        pool_t *pool = &pools[i];
+
+        pool->free_q = xQueueCreate(pool->count, sizeof(uint8_t *));
+        assert(pool->free_q);
+        for (unsigned j = 0; j < pool->count; j++) {
+            uint8_t *block = pool->blocks + j * pool->size;
+            xQueueSend(pool->free_q, &block, 0);
+        }
+    }
+}
+
+/* Take a block from pool id, waiting up to wait ticks for one to be
+ * given back. NULL if none came */
+void *pool_get(pool_id_t id, TickType_t wait)
+{
+    pool_t *pool = &pools[id];
+    uint8_t *block;
+
+    if (xQueueReceive(pool->free_q, &block, wait) != pdTRUE) {
+        atomic_fetch_add(&pool->exhausted, 1);
+        return NULL;
+    }
+
+    unsigned used = atomic_fetch_add(&pool->in_use, 1) + 1;
+    unsigned high = atomic_load(&pool->high_water);
+    while (used > high && !atomic_compare_exchange_weak(&pool->high_water, &high, used))
+        ;
+    return block;
+}
+
+/* Give a block back to the pool it came from */
+void pool_put(void *block)
+{
+    if (block == NULL)
+        return;
+    for (int i = 0; i < POOL_IDS; i++) {
+        pool_t *pool = &pools[i];
+
+        if ((uint8_t *)block >= pool->blocks && (uint8_t *)block < pool->blocks + pool->count * pool->size) {
+            atomic_fetch_sub(&pool->in_use, 1);
+            xQueueSend(pool->free_q, &block, portMAX_DELAY);
+            return;
+        }
+    }
+    ESP_LOGE(TAG, "%p is not a pool block", block);
+}
+
+/* Answer a request that could not get a buffer */
+esp_err_t pool_busy(httpd_req_t *req)
+{
+    httpd_resp_set_status(req, "503 Service Unavailable");
+    httpd_resp_set_hdr(req, "Retry-After", "1");
+    httpd_resp_send(req, "Busy, try again\n", HTTPD_RESP_USE_STRLEN);
+    return ESP_OK;
+}
+
+int pool_count(void)
+{
+    return POOL_IDS;
+}
+
+void pool_stats(int i, pool_stats_t *stats)
+{
+    const pool_t *pool = &pools[i];
+
+    stats->name = pool->name;
+    stats->size = pool->size;
+    stats->count = pool->count;
+    stats->in_use = atomic_load(&pool->in_use);
+    stats->high_water = atomic_load(&pool->high_water);
+    stats->exhausted = atomic_load(&pool->exhausted);
+}
@@ -0,0 +1,45 @@
+/*
+ * Fixed-block buffer pools
+ *
+ * Request handlers and the OTA path take their buffers from a few
+ * static pools of equal sized blocks rather than the heap, so uploads
+ * and requests leave nothing behind to fragment it however long the
+ * device runs. A handler that finds its pool empty answers 503.
+ */
+
+#ifndef POOL_H_
+#define POOL_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <esp_http_server.h>
+#include "freertos/FreeRTOS.h"
+
+#define POOL_SMALL      CONFIG_WEBSTER_POOL_SMALL_SIZE  // request bodies, headers, scratch
+
+/* Each pool belongs to one user, so one cannot drain another's */
+typedef enum {
+    POOL_ID_SMALL,              // POOL_SMALL bytes, request handlers
+    POOL_ID_OTA,                // CONFIG_WEBSTER_OTA_BUF_SIZE, the OTA ring
+    POOL_ID_INFLATE,            // tinfl_decompressor
+    POOL_ID_WINDOW,             // TINFL_LZ_DICT_SIZE inflate window
+    POOL_IDS
+} pool_id_t;
+
+typedef struct {
+    const char *name;
+    size_t size;                // bytes per block
+    unsigned count;             // blocks in the pool
+    unsigned in_use;
+    unsigned high_water;        // most in use at once since boot
+    unsigned exhausted;         // requests that found it empty
+} pool_stats_t;
+
+void pool_init(void);
+void *pool_get(pool_id_t id, TickType_t wait);
+void pool_put(void *block);
+esp_err_t pool_busy(httpd_req_t *req);
+int pool_count(void);
+void pool_stats(int pool, pool_stats_t *stats);
+
+#endif /* POOL_H_ */
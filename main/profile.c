@@ -0,0 +1,71 @@
+/*
+ * Keystroke timing profiles
+ *
+ * Profiles are kept in the settings cache, which stores them as blobs
+ * in the NVS "storage" namespace under the key "P_<name>", so loading
+ * one for a command never touches flash. The default profile is built
+ * from Kconfig and can be overridden by saving a profile with the same
+ * name.
+ */
+
+#include <string.h>
+#include <esp_log.h>
+#include "tinyusb.h"
+#include "config.h"
+#include "seq.h"
+
+static const char *TAG = "profile";
+
+/* Fill in the built-in profile
+ *     30 spaces (halts grub autoboot)
+ *     down arrows to select the menu entry
+ */
+void profile_default(seq_profile_t *prof)
+{
+    memset(prof, 0, sizeof(*prof));
+    strlcpy(prof->name, CONFIG_WEBSTER_DEFAULT_PROFILE, sizeof(prof->name));
+    prof->lead_key = HID_KEY_SPACE;
+    prof->lead_count = 30;
+    prof->select_key = HID_KEY_ARROW_DOWN;
+    prof->press_us = CONFIG_WEBSTER_KEY_PRESS_US;
+    prof->gap_us = CONFIG_WEBSTER_KEY_GAP_US;
+}
+
+/* Read a profile, falls back to the default for the default name */
+esp_err_t profile_load(const char *name, seq_profile_t *prof)
+{
+    esp_err_t err;
+
+    if (name == NULL || name[0] == '\0')
+        name = CONFIG_WEBSTER_DEFAULT_PROFILE;
+    if ((err = config_get_profile(name, prof)) != ESP_ERR_NOT_FOUND)
+        return err;
+
+    if (strcmp(name, CONFIG_WEBSTER_DEFAULT_PROFILE) == 0) {
+        profile_default(prof);
+        return ESP_OK;
+    }
+    return err;
+}
+
+/* Write a profile */
+esp_err_t profile_save(const seq_profile_t *prof)
+{
+    esp_err_t err = config_set_profile(prof);
+
+    if (err != ESP_OK)
+        ESP_LOGI(TAG, "Error (%s) writing profile %s", esp_err_to_name(err), prof->name);
+    return err;
+}
+
+/* Remove a profile */
+esp_err_t profile_delete(const char *name)
+{
+    return config_delete_profile(name);
+}
+
+/* Collect up to max stored profiles, returns the number found */
+int profile_list(seq_profile_t *profs, int max)
+{
+    return config_list_profiles(profs, max);
+}
@@ -0,0 +1,92 @@
+# Generate the HTTP route table
+#
+# Reads routes.txt and writes routes_gen.h, a table indexed by the top
+# bits of a seeded FNV-1a hash of the method letter and path. A seed is searched for at
+# configure time so that no two routes share a slot, making a lookup one
+# hash and one string compare however many routes there are. The hash
+# must match route_hash() in httpd.c.
+
+set(ROUTE_SRC ${CMAKE_CURRENT_LIST_DIR}/routes.txt)
+set(ROUTE_OUT ${CMAKE_CURRENT_LIST_DIR}/routes_gen.h)
+set_property(DIRECTORY APPEND PROPERTY CMAKE_CONFIGURE_DEPENDS ${ROUTE_SRC})
+
+# Hash a key given as a list of byte values
+function(route_fnv seed bytes out)
+    math(EXPR h "(${seed} ^ 2166136261) & 0xffffffff")
+    foreach(b ${bytes})
+        math(EXPR h "((${h} ^ ${b}) * 16777619) & 0xffffffff")
+    endforeach()
+    set(${out} ${h} PARENT_SCOPE)
+endfunction()
+
+# Parse routes, key is first letter of the method followed by the path
+file(STRINGS ${ROUTE_SRC} lines REGEX "^[A-Z]")
+set(count 0)
+foreach(line ${lines})
+    string(REGEX MATCH "^([A-Z]+)[ \t]+([^ \t]+)[ \t]+([A-Za-z_0-9]+)" ok "${line}")
+    if (NOT ok)
+        message(FATAL_ERROR "routes.txt: bad line '${line}'")
+    endif()
+    set(method_${count} ${CMAKE_MATCH_1})
+    set(path_${count} ${CMAKE_MATCH_2})
+    set(handler_${count} ${CMAKE_MATCH_3})
+    string(SUBSTRING ${CMAKE_MATCH_1} 0 1 m)
+    string(HEX "${m}${CMAKE_MATCH_2}" hex)
+    string(REGEX MATCHALL ".." pairs "${hex}")
+    set(bytes_${count} "")
+    foreach(p ${pairs})
+        math(EXPR b "0x${p}")
+        list(APPEND bytes_${count} ${b})
+    endforeach()
+    math(EXPR count "${count} + 1")
+endforeach()
+math(EXPR last "${count} - 1")
+
+# Table is the next power of two at least twice the route count
+math(EXPR want "${count} * 2")
+set(bits 1)
+math(EXPR size "1 << ${bits}")
+while (size LESS want)
+    math(EXPR bits "${bits} + 1")
+    math(EXPR size "1 << ${bits}")
+endwhile()
+math(EXPR mask "${size} - 1")
+math(EXPR shift "32 - ${bits}")
+
+# Search for a seed with no collisions
+set(found FALSE)
+foreach(seed RANGE 0 4095)
+    set(used "")
+    set(found TRUE)
+    foreach(i RANGE ${last})
+        route_fnv(${seed} "${bytes_${i}}" h)
+        math(EXPR slot "${h} >> ${shift}")
+        list(FIND used ${slot} dup)
+        if (NOT dup EQUAL -1)
+            set(found FALSE)
+            break()
+        endif()
+        list(APPEND used ${slot})
+        set(slot_${i} ${slot})
+    endforeach()
+    if (found)
+        set(route_seed ${seed})
+        break()
+    endif()
+endforeach()
+if (NOT found)
+    message(FATAL_ERROR "routes.cmake: no perfect hash seed found")
+endif()
+
+set(out "/* Generated by routes.cmake from routes.txt, do not edit */\n")
+string(APPEND out "#define ROUTE_SEED ${route_seed}u\n")
+string(APPEND out "#define ROUTE_SHIFT ${shift}\n")
+string(APPEND out "#define ROUTE_MASK ${mask}u\n")
+string(APPEND out "static const route_t route_table[${size}] = {\n")
+foreach(i RANGE ${last})
+    string(APPEND out "    [${slot_${i}}] = { HTTP_${method_${i}}, \"${path_${i}}\", ${handler_${i}} },\n")
+endforeach()
+string(APPEND out "};\n")
+
+# Only touch the header when the table changes
+file(CONFIGURE OUTPUT ${ROUTE_OUT} CONTENT "${out}" @ONLY)
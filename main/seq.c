@@ -0,0 +1,643 @@
+/*
+ * Key sequencer
+ *
+ * Runs the USB keyboard sequence in its own task so a POST to /ctrl
+ * is acted on as soon as it arrives instead of at the next pass
+ * through the main loop.
+ *
+ * Each report is paced by the USB stack rather than by polling: the
+ * next step is taken when TinyUSB signals the report reached the host
+ * (tud_hid_report_complete_cb), and key hold/gap intervals are timed
+ * with an esp_timer one-shot at microsecond resolution.
+ *
+ * Which keys are sent and how fast comes from a timing profile, see
+ * profile.c. A calibration command finds the fastest gap a target
+ * keeps up with by watching the host echo Num Lock on the keyboard LEDs.
+ *
+ * A selection can also be armed instead of sent: it is held in NVS and
+ * fired the moment the host enumerates or resumes the keyboard.
+ *
+ * Commands reach the task through a lock-free ring (or a coalescing
+ * mailbox, depending on Kconfig). Each gets an id whose state can be
+ * looked up afterwards with seq_status().
+ */
+
+#include <string.h>
+#include <stdatomic.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <sys/param.h>
+#include "tinyusb.h"
+#include "usb_descriptors.h"
+#include "seq.h"
+#include "config.h"
+#include "metrics.h"
+#include "tasks.h"
+
+static const char *TAG = "seq";
+
+/* Task notification bits */
+#define SEQ_EVT_COMPLETE    BIT0    // HID report delivered to host
+#define SEQ_EVT_TIMER       BIT1    // hold/gap interval expired
+#define SEQ_EVT_USB         BIT2    // mount/resume, HID may now be ready
+#define SEQ_EVT_LED         BIT3    // host wrote keyboard LED state
+#define SEQ_EVT_CMD         BIT4    // command queued
+
+/* Give up if the whole sequence takes longer than this */
+#define SEQ_TIMEOUT_US      (60 * 1000 * 1000LL)
+
+/* Calibration - Num Lock toggles per step and shortest gap tried */
+#define SEQ_CAL_TOGGLES     4
+#define SEQ_CAL_MIN_GAP_US  1000
+
+static TaskHandle_t seq_task_handle = NULL;
+static esp_timer_handle_t seq_timer = NULL;
+
+/* Command ring, single producer single consumer (sequencer). Producers
+ * (httpd and UDP tasks) take turns through seq_submit_lock, the consumer
+ * side stays lock free. Head and tail run free and are masked on access. */
+#ifdef CONFIG_WEBSTER_SEQ_QUEUE_LEN
+#define SEQ_RING_LEN        CONFIG_WEBSTER_SEQ_QUEUE_LEN
+#else
+#define SEQ_RING_LEN        1
+#endif
+_Static_assert((SEQ_RING_LEN & (SEQ_RING_LEN - 1)) == 0, "queue length must be a power of 2");
+static seq_cmd_t seq_ring[SEQ_RING_LEN];
+static atomic_uint seq_head = 0;
+static atomic_uint seq_tail = 0;
+
+/* Coalescing mailbox, triple buffered so the producer can replace a
+ * pending command without waiting for the consumer */
+#define SEQ_MBOX_NEW        4
+static seq_cmd_t seq_mbox[3];
+static atomic_uint seq_mbox_mid = 1;
+static unsigned seq_mbox_back = 0;      // producer only
+static unsigned seq_mbox_front = 2;     // consumer only
+
+/* Id of the command being run, 0 when idle */
+static atomic_uint seq_running = 0;
+static atomic_uint seq_next_id = 1;
+static SemaphoreHandle_t seq_submit_lock = NULL;
+
+/* Recent command states, packed as id << 4 | state so each
+ * entry is read and written in one access */
+#define SEQ_STATUS_LEN      32
+static atomic_uint seq_status_tab[SEQ_STATUS_LEN];
+
+/* Selection waiting for the host to enumerate, kept in NVS as "ARMED" */
+static seq_cmd_t seq_armed_cmd;
+static atomic_bool seq_armed = false;
+static atomic_bool seq_armed_fire = false;
+/* Fired selection that a re-arm replaced before the sequencer took it,
+ * both under seq_submit_lock */
+static seq_cmd_t seq_fired_cmd;
+static bool seq_fired_saved = false;
+
+/* Last keyboard LED state written by the host */
+static volatile uint8_t seq_leds = 0;
+
+/* Timing achieved by the last sequence, all in microseconds */
+static struct {
+    int keys;           // keys fully sent
+    int64_t total;      // first press queued to last release delivered
+    int64_t ack_min;    // report queued to report delivered
+    int64_t ack_max;
+    int64_t key_min;    // press queued to next press queued
+    int64_t key_max;
+    int64_t first_key;  // esp_timer time the first report was delivered
+} seq_stats;
+
+/* Stage times of the command being or last run, written only by the
+ * sequencer task and read with a retry if it changed mid-copy */
+static atomic_uint seq_times_seq = 0;
+static seq_times_t seq_times_last;
+
+/* Progress listener, set once at startup */
+static seq_progress_fn seq_progress = NULL;
+
+static void seq_event(uint32_t id, seq_state_t state, int key, int total)
+{
+    seq_event_t event = { .id = id, .state = state, .key = key, .total = total };
+
+    if (seq_progress)
+        seq_progress(&event);
+}
+
+/* Called from TinyUSB task when a report has been sent to the host */
+void seq_report_complete(void)
+{
+    if (seq_task_handle)
+        xTaskNotify(seq_task_handle, SEQ_EVT_COMPLETE, eSetBits);
+}
+
+/* Fire the armed selection, if any. Runs in the TinyUSB task so it
+ * only flags the sequencer, which clears NVS and runs the command. */
+static void seq_trigger(const char *why)
+{
+    if ( !atomic_exchange(&seq_armed, false) )
+        return;
+    ESP_LOGI(TAG, "Armed selection fired by %s", why);
+    atomic_store(&seq_armed_fire, true);
+    xTaskNotify(seq_task_handle, SEQ_EVT_CMD, eSetBits);
+}
+
+/* Called from TinyUSB task on mount/resume */
+void seq_usb_event(void)
+{
+    if (seq_task_handle)
+        xTaskNotify(seq_task_handle, SEQ_EVT_USB, eSetBits);
+    seq_trigger("enumeration");
+}
+
+/* Called from TinyUSB task when the host sets the keyboard LEDs */
+void seq_led_report(uint8_t leds)
+{
+    seq_leds = leds;
+    if (seq_task_handle)
+        xTaskNotify(seq_task_handle, SEQ_EVT_LED, eSetBits);
+    seq_trigger("keyboard LEDs");
+}
+
+static void seq_timer_cb(void *arg)
+{
+    xTaskNotify(seq_task_handle, SEQ_EVT_TIMER, eSetBits);
+}
+
+/* Block until one of the bits in mask is signalled or the deadline passes */
+static bool seq_wait(uint32_t mask, int64_t deadline, TickType_t poll)
+{
+    uint32_t bits;
+
+    while (1) {
+        int64_t left = deadline - esp_timer_get_time();
+        if (left <= 0)
+            return false;
+        TickType_t ticks = pdMS_TO_TICKS(left / 1000) + 1;
+        if (ticks > poll)
+            ticks = poll;
+        if (xTaskNotifyWait(0, mask, &bits, ticks) == pdTRUE && (bits & mask))
+            return true;
+        if (poll != portMAX_DELAY)
+            return false;
+    }
+}
+
+/* Queue a report and wait for the host to collect it,
+ * returns the time it took or -1 on timeout */
+static int64_t seq_send(const uint8_t *keycode, int64_t deadline)
+{
+    // Wait for the endpoint, polling in case the host is suspended
+    while ( !tud_hid_ready() ) {
+        if (esp_timer_get_time() >= deadline)
+            return -1;
+        if ( tud_suspended() ) {
+            // Wake up host if we are in suspend mode
+            // and REMOTE_WAKEUP feature is enabled by host
+            tud_remote_wakeup();
+        }
+        seq_wait(SEQ_EVT_COMPLETE | SEQ_EVT_USB, deadline, pdMS_TO_TICKS(10));
+    }
+
+    // Drop stale completions so the next one is ours
+    xTaskNotifyWait(0, SEQ_EVT_COMPLETE, NULL, 0);
+    int64_t start = esp_timer_get_time();
+    if ( !tud_hid_keyboard_report(REPORT_ID_KEYBOARD, 0, keycode) )
+        return -1;
+    if ( !seq_wait(SEQ_EVT_COMPLETE, deadline, portMAX_DELAY) )
+        return -1;
+    return esp_timer_get_time() - start;
+}
+
+/* Sleep for an interval timed by the one-shot timer */
+static bool seq_delay(uint64_t us, int64_t deadline)
+{
+    xTaskNotifyWait(0, SEQ_EVT_TIMER, NULL, 0);
+    if (esp_timer_start_once(seq_timer, us) != ESP_OK)
+        return false;
+    if ( !seq_wait(SEQ_EVT_TIMER, deadline, portMAX_DELAY) ) {
+        esp_timer_stop(seq_timer);
+        return false;
+    }
+    return true;
+}
+
+static void seq_stats_reset(void)
+{
+    memset(&seq_stats, 0, sizeof(seq_stats));
+    seq_stats.ack_min = INT64_MAX;
+    seq_stats.key_min = INT64_MAX;
+}
+
+static void seq_ack_stat(int64_t us)
+{
+    if (us < seq_stats.ack_min)
+        seq_stats.ack_min = us;
+    if (us > seq_stats.ack_max)
+        seq_stats.ack_max = us;
+}
+
+/* Press and release one key, recording timing. *pressed, if given, is
+ * set to when the host collected the press report.
+ * Returns false on timeout */
+static bool seq_key(uint8_t key, uint32_t press_us, int64_t deadline, int64_t *pressed)
+{
+    uint8_t keycode[6] = { key };
+    int64_t us;
+
+    if ((us = seq_send(keycode, deadline)) < 0)
+        return false;
+    if (pressed)
+        *pressed = esp_timer_get_time();
+    seq_ack_stat(us);
+    if ( !seq_delay(press_us, deadline) )
+        return false;
+    if ((us = seq_send(NULL, deadline)) < 0)
+        return false;
+    seq_ack_stat(us);
+    return true;
+}
+
+/* Send key sequence
+ *     lead keys (halts autoboot)
+ *     n-1 select keys for button n (first menu entry is the default)
+ *     ENTER to start boot
+ */
+static bool seq_run(uint32_t btn, const seq_profile_t *prof, int64_t submitted)
+{
+    int total = prof->lead_count + btn;
+    int64_t start = esp_timer_get_time();
+    int64_t deadline = start + SEQ_TIMEOUT_US;
+    int64_t first_press = 0;
+    int64_t last_press = 0;
+
+    seq_stats_reset();
+    for (int sequence = total; sequence > 0; sequence--) {
+        uint8_t key;
+        if ( sequence == 1 ) {
+            key = HID_KEY_ENTER;
+        } else if ( sequence <= btn ) {
+            key = prof->select_key;
+        } else {
+            key = prof->lead_key;
+        }
+
+        int64_t press = esp_timer_get_time();
+        int64_t delivered;
+        if ( !seq_key(key, prof->press_us, deadline, &delivered) )
+            break;
+        if (first_press == 0) {
+            // When the press reached the host, not after the hold and release
+            first_press = press;
+            seq_stats.first_key = delivered;
+            metrics_hist_observe(&metric_seq_first_key, seq_stats.first_key - submitted);
+        }
+        if (last_press) {
+            int64_t period = press - last_press;
+            if (period < seq_stats.key_min)
+                seq_stats.key_min = period;
+            if (period > seq_stats.key_max)
+                seq_stats.key_max = period;
+        }
+        last_press = press;
+        seq_stats.keys++;
+        seq_event(atomic_load(&seq_running), SEQ_STATE_RUNNING, seq_stats.keys, total);
+
+        // Gap before next key
+        if ( sequence > 1 && !seq_delay(prof->gap_us, deadline) )
+            break;
+    }
+    seq_stats.total = esp_timer_get_time() - start;
+
+    if (seq_stats.keys != total)
+        ESP_LOGW(TAG, "Timeout before sequence ended");
+    if (seq_stats.keys > 0) {
+        ESP_LOGI(TAG, "%d keys in %"PRId64" us, ack %"PRId64"-%"PRId64" us",
+                 seq_stats.keys, seq_stats.total,
+                 seq_stats.ack_min, seq_stats.ack_max);
+    }
+    if (seq_stats.keys > 1) {
+        ESP_LOGI(TAG, "key period %"PRId64"-%"PRId64" us, avg %"PRId64" us",
+                 seq_stats.key_min, seq_stats.key_max,
+                 (last_press - first_press) / (seq_stats.keys - 1));
+    }
+    if (seq_stats.keys == total)
+        metrics_hist_observe(&metric_seq_done, esp_timer_get_time() - submitted);
+    return seq_stats.keys == total;
+}
+
+/* Toggle Num Lock and check the host echoes the LED change before
+ * the gap expires. Returns false if the host missed it. */
+static bool seq_cal_toggle(const seq_profile_t *prof, uint32_t gap_us, int64_t deadline)
+{
+    uint8_t before = seq_leds;
+    uint32_t bits = 0;
+
+    xTaskNotifyWait(0, SEQ_EVT_LED, NULL, 0);
+    if ( !seq_key(HID_KEY_NUM_LOCK, prof->press_us, deadline, NULL) )
+        return false;
+
+    // Gap timer runs while we watch for the LED report
+    xTaskNotifyWait(0, SEQ_EVT_TIMER, NULL, 0);
+    if (esp_timer_start_once(seq_timer, gap_us) != ESP_OK)
+        return false;
+    while ( !(bits & SEQ_EVT_TIMER) ) {
+        uint32_t val;
+        if (esp_timer_get_time() >= deadline) {
+            esp_timer_stop(seq_timer);
+            return false;
+        }
+        if (xTaskNotifyWait(0, SEQ_EVT_LED | SEQ_EVT_TIMER, &val, pdMS_TO_TICKS(100)) == pdTRUE)
+            bits |= val;
+    }
+    return (bits & SEQ_EVT_LED) &&
+           ((seq_leds ^ before) & KEYBOARD_LED_NUMLOCK);
+}
+
+/* Shorten the gap until the host stops keeping up with Num Lock
+ * toggles, then save the fastest accepted gap plus a margin */
+static bool seq_calibrate(seq_profile_t *prof)
+{
+    int64_t deadline = esp_timer_get_time() + SEQ_TIMEOUT_US;
+    uint8_t initial = seq_leds;
+    uint32_t gap = prof->gap_us;
+    uint32_t good = 0;
+    bool ok = true;
+
+    seq_stats_reset();
+    ESP_LOGI(TAG, "Calibrating %s from %"PRIu32" us", prof->name, gap);
+    while (ok && gap >= SEQ_CAL_MIN_GAP_US) {
+        for (int i = 0; ok && i < SEQ_CAL_TOGGLES; i++)
+            ok = seq_cal_toggle(prof, gap, deadline);
+        if (ok) {
+            good = gap;
+            gap = gap * 3 / 4;
+        }
+    }
+
+    // Put Num Lock back the way the host had it
+    seq_delay(prof->gap_us, deadline + SEQ_TIMEOUT_US);
+    if ((seq_leds ^ initial) & KEYBOARD_LED_NUMLOCK)
+        seq_key(HID_KEY_NUM_LOCK, prof->press_us, deadline + SEQ_TIMEOUT_US, NULL);
+
+    if (good == 0) {
+        ESP_LOGW(TAG, "No LED feedback at %"PRIu32" us, %s unchanged", prof->gap_us, prof->name);
+        return false;
+    }
+    ESP_LOGI(TAG, "Fastest accepted gap %"PRIu32" us", good);
+    prof->gap_us = good + good / 4;
+    return profile_save(prof) == ESP_OK;
+}
+
+static esp_err_t seq_arm_store(const seq_cmd_t *cmd);
+
+static void seq_set_state(uint32_t id, seq_state_t state)
+{
+    atomic_store(&seq_status_tab[id % SEQ_STATUS_LEN], (id << 4) | state);
+    seq_event(id, state, 0, 0);
+}
+
+void seq_set_progress(seq_progress_fn fn)
+{
+    seq_progress = fn;
+}
+
+/* Look up what happened to a command */
+seq_state_t seq_status(uint32_t id)
+{
+    unsigned v = atomic_load(&seq_status_tab[id % SEQ_STATUS_LEN]);
+    if (id == 0 || (v >> 4) != (id & 0x0fffffff))
+        return SEQ_STATE_UNKNOWN;
+    return v & 0x0f;
+}
+
+const char *seq_state_name(seq_state_t state)
+{
+    static const char *names[] = {
+        "unknown", "queued", "running", "done", "timeout", "coalesced", "armed",
+    };
+    return (state < sizeof(names) / sizeof(names[0])) ? names[state] : "unknown";
+}
+
+/* Publish stage times, sequencer task only */
+static void seq_times_set(uint32_t id, int64_t start, int64_t first_key, int64_t done)
+{
+    unsigned seq = atomic_load_explicit(&seq_times_seq, memory_order_relaxed);
+    atomic_store_explicit(&seq_times_seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    seq_times_last.id = id;
+    seq_times_last.start = start;
+    seq_times_last.first_key = first_key;
+    seq_times_last.done = done;
+    atomic_store_explicit(&seq_times_seq, seq + 2, memory_order_release);
+}
+
+/* Stage times for a command, false unless it is the one running or last run */
+bool seq_times(uint32_t id, seq_times_t *times)
+{
+    unsigned seq;
+
+    do {
+        seq = atomic_load_explicit(&seq_times_seq, memory_order_acquire);
+        *times = seq_times_last;
+        atomic_thread_fence(memory_order_acquire);
+    } while ((seq & 1) || seq != atomic_load_explicit(&seq_times_seq, memory_order_relaxed));
+    return id != 0 && times->id == id;
+}
+
+/* Take the next command, consumer side. The running id is set before
+ * the slot is released so the producer never sees us idle and empty. */
+static bool seq_pop(seq_cmd_t *cmd)
+{
+    if (atomic_exchange(&seq_armed_fire, false)) {
+        // seq_arm() may be rewriting the armed command
+        xSemaphoreTake(seq_submit_lock, portMAX_DELAY);
+        *cmd = seq_fired_saved ? seq_fired_cmd : seq_armed_cmd;
+        seq_fired_saved = false;
+        xSemaphoreGive(seq_submit_lock);
+        cmd->submitted = esp_timer_get_time();
+        atomic_store(&seq_running, cmd->id);
+        return true;
+    }
+
+    if (atomic_load_explicit(&seq_mbox_mid, memory_order_acquire) & SEQ_MBOX_NEW) {
+        seq_mbox_front = atomic_exchange_explicit(&seq_mbox_mid, seq_mbox_front,
+                                                  memory_order_acq_rel) & 3;
+        *cmd = seq_mbox[seq_mbox_front];
+        atomic_store(&seq_running, cmd->id);
+        return true;
+    }
+
+    unsigned tail = atomic_load_explicit(&seq_tail, memory_order_relaxed);
+    if (tail == atomic_load_explicit(&seq_head, memory_order_acquire))
+        return false;
+    *cmd = seq_ring[tail & (SEQ_RING_LEN - 1)];
+    atomic_store(&seq_running, cmd->id);
+    atomic_store_explicit(&seq_tail, tail + 1, memory_order_release);
+    return true;
+}
+
+/* Sequencer task - sleeps until a command is queued */
+static void seq_task(void *arg)
+{
+    seq_cmd_t cmd;
+    bool ok;
+
+    while (1) {
+        if ( !seq_pop(&cmd) ) {
+            xTaskNotifyWait(0, SEQ_EVT_CMD, NULL, portMAX_DELAY);
+            continue;
+        }
+
+        seq_set_state(cmd.id, SEQ_STATE_RUNNING);
+        seq_times_set(cmd.id, cmd.submitted, 0, 0);
+        if (cmd.type == SEQ_CMD_CALIBRATE) {
+            ok = seq_calibrate(&cmd.profile);
+        } else if (cmd.type == SEQ_CMD_ARMED) {
+            // Host just enumerated, so the menu needs no long run of lead keys
+            cmd.profile.lead_count = MIN(cmd.profile.lead_count, CONFIG_WEBSTER_ARMED_LEAD_COUNT);
+            ESP_LOGI(TAG, "Armed start: button %"PRIu32" profile %s", cmd.btn, cmd.profile.name);
+            ok = seq_run(cmd.btn, &cmd.profile, cmd.submitted);
+            ESP_LOGI(TAG, "Sequence done");
+            // Forget the stored copy once it has run, unless a newer selection has
+            // been armed since. Only the cache changes here, its task writes flash.
+            xSemaphoreTake(seq_submit_lock, portMAX_DELAY);
+            if (seq_armed_cmd.id == cmd.id)
+                seq_arm_store(NULL);
+            xSemaphoreGive(seq_submit_lock);
+        } else {
+            ESP_LOGI(TAG, "Sequence start: button %"PRIu32" profile %s", cmd.btn, cmd.profile.name);
+            ok = seq_run(cmd.btn, &cmd.profile, cmd.submitted);
+            ESP_LOGI(TAG, "Sequence done");
+        }
+        seq_times_set(cmd.id, cmd.submitted, seq_stats.first_key, esp_timer_get_time());
+        seq_set_state(cmd.id, ok ? SEQ_STATE_DONE : SEQ_STATE_TIMEOUT);
+        atomic_store(&seq_running, 0);
+    }
+}
+
+static uint32_t seq_new_id(void)
+{
+    return atomic_fetch_add(&seq_next_id, 1) & 0x0fffffff;
+}
+
+/* Hand a command to the sequencer, producer side. Returns the id
+ * assigned to it, or 0 if it was refused under the queue policy. */
+uint32_t seq_submit(seq_cmd_t *cmd)
+{
+    if (seq_task_handle == NULL)
+        return 0;
+    xSemaphoreTake(seq_submit_lock, portMAX_DELAY);
+    cmd->submitted = esp_timer_get_time();
+
+#if CONFIG_WEBSTER_SEQ_POLICY_COALESCE
+    cmd->id = seq_new_id();
+    // Replace whatever is pending, the running command is unaffected
+    seq_set_state(cmd->id, SEQ_STATE_QUEUED);
+    seq_mbox[seq_mbox_back] = *cmd;
+    unsigned old = atomic_exchange_explicit(&seq_mbox_mid, seq_mbox_back | SEQ_MBOX_NEW,
+                                            memory_order_acq_rel);
+    seq_mbox_back = old & 3;
+    if (old & SEQ_MBOX_NEW)
+        seq_set_state(seq_mbox[seq_mbox_back].id, SEQ_STATE_COALESCED);
+#else
+    unsigned head = atomic_load_explicit(&seq_head, memory_order_relaxed);
+    unsigned tail = atomic_load_explicit(&seq_tail, memory_order_acquire);
+#if CONFIG_WEBSTER_SEQ_POLICY_REJECT
+    // Only accept when nothing is queued or running
+    if (head != tail || atomic_load(&seq_running) != 0) {
+        xSemaphoreGive(seq_submit_lock);
+        return 0;
+    }
+#else
+    if (head - tail >= SEQ_RING_LEN) {
+        xSemaphoreGive(seq_submit_lock);
+        return 0;
+    }
+#endif
+    // Only an accepted command gets an id
+    cmd->id = seq_new_id();
+    seq_set_state(cmd->id, SEQ_STATE_QUEUED);
+    seq_ring[head & (SEQ_RING_LEN - 1)] = *cmd;
+    atomic_store_explicit(&seq_head, head + 1, memory_order_release);
+#endif
+    xSemaphoreGive(seq_submit_lock);
+
+    xTaskNotify(seq_task_handle, SEQ_EVT_CMD, eSetBits);
+    return cmd->id;
+}
+
+/* Save or clear (cmd == NULL) the armed selection, the settings cache
+ * writes it to NVS after a short delay */
+_Static_assert(sizeof(seq_cmd_t) <= CFG_REC_SIZE, "armed selection must fit a settings record");
+
+static esp_err_t seq_arm_store(const seq_cmd_t *cmd)
+{
+    return config_set_rec(CFG_REC_ARMED, cmd, sizeof(*cmd));
+}
+
+/* Arm a selection to fire when the host next mounts/resumes the
+ * keyboard or writes its LEDs. Survives a reboot of the ESP once the
+ * settings cache has committed it, config_flush() forces that. */
+uint32_t seq_arm(seq_cmd_t *cmd)
+{
+    uint32_t id = 0;
+
+    xSemaphoreTake(seq_submit_lock, portMAX_DELAY);
+    if (atomic_exchange(&seq_armed, false))
+        seq_set_state(seq_armed_cmd.id, SEQ_STATE_COALESCED);
+    // Fired but not yet taken by the sequencer, keep it for seq_pop()
+    if (atomic_load(&seq_armed_fire) && !seq_fired_saved) {
+        seq_fired_cmd = seq_armed_cmd;
+        seq_fired_saved = true;
+    }
+    seq_armed_cmd = *cmd;
+    seq_armed_cmd.id = seq_new_id();
+    seq_armed_cmd.type = SEQ_CMD_ARMED;
+    if (seq_arm_store(&seq_armed_cmd) == ESP_OK) {
+        seq_set_state(seq_armed_cmd.id, SEQ_STATE_ARMED);
+        atomic_store(&seq_armed, true);
+        id = cmd->id = seq_armed_cmd.id;
+    }
+    xSemaphoreGive(seq_submit_lock);
+    return id;
+}
+
+/* Cancel an armed selection */
+esp_err_t seq_disarm(void)
+{
+    esp_err_t err;
+
+    xSemaphoreTake(seq_submit_lock, portMAX_DELAY);
+    if (atomic_exchange(&seq_armed, false))
+        seq_set_state(seq_armed_cmd.id, SEQ_STATE_UNKNOWN);
+    err = seq_arm_store(NULL);
+    xSemaphoreGive(seq_submit_lock);
+    return err;
+}
+
+/* Start the sequencer task */
+void seq_init(void)
+{
+    const esp_timer_create_args_t timer_args = {
+        .callback = seq_timer_cb,
+        .name = "seq",
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&timer_args, &seq_timer));
+    seq_submit_lock = xSemaphoreCreateMutex();
+    assert(seq_submit_lock);
+
+    // Pick up a selection armed before we rebooted
+    if (config_get_rec(CFG_REC_ARMED, &seq_armed_cmd, sizeof(seq_armed_cmd)) == ESP_OK) {
+        // Ids restart at boot, so give it a fresh one
+        seq_armed_cmd.id = seq_new_id();
+        seq_set_state(seq_armed_cmd.id, SEQ_STATE_ARMED);
+        ESP_LOGI(TAG, "Armed: button %"PRIu32" profile %s", seq_armed_cmd.btn, seq_armed_cmd.profile.name);
+        atomic_store(&seq_armed, true);
+    }
+
+    xTaskCreatePinnedToCore(seq_task, "seq", 4096, NULL, CONFIG_WEBSTER_SEQ_PRIORITY, &seq_task_handle,
+                            TASK_CORE_KEYS);
+}
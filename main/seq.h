@@ -0,0 +1,88 @@
+/*
+ * Key sequencer interface
+ */
+
+#ifndef SEQ_H_
+#define SEQ_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "esp_err.h"
+
+/* Profile names are stored in NVS as "P_<name>", keys max 15 chars */
+#define SEQ_PROFILE_NAME_LEN    13
+
+/* Timing and key choice for one kind of boot menu */
+typedef struct {
+    char name[SEQ_PROFILE_NAME_LEN];
+    uint8_t lead_key;       // HID key sent to halt autoboot
+    uint8_t lead_count;     // number of lead keys
+    uint8_t select_key;     // HID key sent once per button number
+    uint32_t press_us;      // key hold time
+    uint32_t gap_us;        // time between keys
+} seq_profile_t;
+
+typedef enum {
+    SEQ_CMD_SELECT,         // send boot selection
+    SEQ_CMD_CALIBRATE,      // find fastest gap using keyboard LED feedback
+    SEQ_CMD_ARMED,          // armed selection fired by USB enumeration
+} seq_cmd_type_t;
+
+typedef struct {
+    seq_cmd_type_t type;
+    uint32_t id;            // assigned by seq_submit/seq_arm
+    int64_t submitted;      // esp_timer time it was handed over
+    uint32_t btn;
+    seq_profile_t profile;
+} seq_cmd_t;
+
+typedef enum {
+    SEQ_STATE_UNKNOWN,      // never issued, or aged out of the status table
+    SEQ_STATE_QUEUED,
+    SEQ_STATE_RUNNING,
+    SEQ_STATE_DONE,
+    SEQ_STATE_TIMEOUT,
+    SEQ_STATE_COALESCED,    // replaced by a later command before it ran
+    SEQ_STATE_ARMED,        // waiting for USB enumeration
+} seq_state_t;
+
+/* When a command got to each stage, esp_timer microseconds, 0 if not yet */
+typedef struct {
+    uint32_t id;
+    int64_t start;          // submitted, or fired for an armed selection
+    int64_t first_key;      // first report delivered to the host
+    int64_t done;
+} seq_times_t;
+
+/* Progress of a command, pushed to whoever registered for it */
+typedef struct {
+    uint32_t id;
+    seq_state_t state;
+    uint16_t key;           // keys sent so far while running, else 0
+    uint16_t total;         // keys in the sequence, 0 if not known yet
+} seq_event_t;
+
+/* Called from the submitting task or the sequencer, must not block */
+typedef void (*seq_progress_fn)(const seq_event_t *event);
+
+/* seq.c */
+void seq_init(void);
+uint32_t seq_submit(seq_cmd_t *cmd);
+uint32_t seq_arm(seq_cmd_t *cmd);
+esp_err_t seq_disarm(void);
+seq_state_t seq_status(uint32_t id);
+const char *seq_state_name(seq_state_t state);
+bool seq_times(uint32_t id, seq_times_t *times);
+void seq_report_complete(void);
+void seq_usb_event(void);
+void seq_led_report(uint8_t leds);
+void seq_set_progress(seq_progress_fn fn);
+
+/* profile.c */
+void profile_default(seq_profile_t *prof);
+esp_err_t profile_load(const char *name, seq_profile_t *prof);
+esp_err_t profile_save(const seq_profile_t *prof);
+esp_err_t profile_delete(const char *name);
+int profile_list(seq_profile_t *profs, int max);
+
+#endif /* SEQ_H_ */
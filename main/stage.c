@@ -0,0 +1,82 @@
+/*
+ * Startup stage times
+ *
+ * Each stage records the esp_timer time it was first reached, so the
+ * time from reset to serving requests can be broken down in the log
+ * and over GET /startup.
+ */
+
+#include <stdatomic.h>
+#include <stdio.h>
+#include <inttypes.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include "stage.h"
+
+static const char *TAG = "stage";
+
+static const char *stage_names[STAGE_COUNT] = {
+    [STAGE_APP_MAIN]      = "app_main",
+    [STAGE_NVS]           = "nvs",
+    [STAGE_CONFIG]        = "config",
+    [STAGE_WIFI_INIT]     = "wifi_init",
+    [STAGE_SEQ]           = "seq",
+    [STAGE_USB_INIT]      = "usb_init",
+    [STAGE_HTTPD]         = "httpd",
+    [STAGE_UDP]           = "udp",
+    [STAGE_INIT_DONE]     = "init_done",
+    [STAGE_USB_MOUNTED]   = "usb_mounted",
+    [STAGE_WIFI_GOT_IP]   = "wifi_got_ip",
+    [STAGE_FIRST_REQUEST] = "first_request",
+};
+
+/* Microseconds since boot, 0 until reached. 32 bits last 71 minutes,
+ * long after the last stage */
+static atomic_uint stage_us[STAGE_COUNT];
+
+/* Log every stage reached so far */
+static void stage_log(void)
+{
+    unsigned prev = 0;
+
+    for (int i = 0; i < STAGE_COUNT; i++) {
+        unsigned us = atomic_load(&stage_us[i]);
+        if (us == 0)
+            continue;
+        ESP_LOGI(TAG, "%-13s %8u us  +%u", stage_names[i], us, us > prev ? us - prev : 0);
+        prev = us;
+    }
+}
+
+/* Record a stage, later marks of the same stage are ignored */
+void stage_mark(stage_t stage)
+{
+    unsigned zero = 0;
+    unsigned now = esp_timer_get_time();
+
+    if (stage >= STAGE_COUNT || atomic_load_explicit(&stage_us[stage], memory_order_relaxed))
+        return;
+    if (!atomic_compare_exchange_strong(&stage_us[stage], &zero, now ? now : 1))
+        return;
+    // Ready to serve, show where the time went
+    if (stage == STAGE_WIFI_GOT_IP)
+        stage_log();
+}
+
+/* Send "stage microseconds" lines, in stage order */
+esp_err_t stage_send(httpd_req_t *req)
+{
+    char line[48];
+    esp_err_t err;
+
+    httpd_resp_set_type(req, "text/plain");
+    for (int i = 0; i < STAGE_COUNT; i++) {
+        unsigned us = atomic_load(&stage_us[i]);
+        if (us == 0)
+            continue;
+        snprintf(line, sizeof(line), "%s %u\n", stage_names[i], us);
+        if ((err = httpd_resp_sendstr_chunk(req, line)) != ESP_OK)
+            return err;
+    }
+    return httpd_resp_sendstr_chunk(req, NULL);
+}
@@ -0,0 +1,30 @@
+/*
+ * Startup stage times
+ */
+
+#ifndef STAGE_H_
+#define STAGE_H_
+
+#include <esp_http_server.h>
+
+/* In the order they usually complete, the first mark of each is kept */
+typedef enum {
+    STAGE_APP_MAIN,         // app_main entered
+    STAGE_NVS,
+    STAGE_CONFIG,
+    STAGE_WIFI_INIT,        // association started
+    STAGE_SEQ,
+    STAGE_USB_INIT,
+    STAGE_HTTPD,            // listening
+    STAGE_UDP,
+    STAGE_INIT_DONE,        // app_main finished
+    STAGE_USB_MOUNTED,      // host enumerated the keyboard
+    STAGE_WIFI_GOT_IP,
+    STAGE_FIRST_REQUEST,    // first HTTP request routed
+    STAGE_COUNT
+} stage_t;
+
+void stage_mark(stage_t stage);
+esp_err_t stage_send(httpd_req_t *req);
+
+#endif /* STAGE_H_ */
@@ -0,0 +1,86 @@
+/*
+ * Task run time statistics
+ *
+ * GET /tasks lists every task with the core it is pinned to, its
+ * priority, the least stack it has ever had free and its share of one
+ * core since boot, then how idle each core has been since boot and
+ * since the previous read. This is the data vTaskGetRunTimeStats()
+ * formats, read with uxTaskGetSystemState() so it can be streamed
+ * without one large buffer. It needs the FreeRTOS trace facility and
+ * run time stats, both turned on in sdkconfig.defaults.
+ */
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <esp_log.h>
+#include "tasks.h"
+
+#define TASKS_MAX       40      // well over what a WiFi and USB build runs
+
+/* Only the httpd task lists tasks, so one static array will do */
+static TaskStatus_t tasks_status[TASKS_MAX];
+
+static const char *TAG = "tasks";
+
+static uint64_t tasks_last_total;
+static uint64_t tasks_last_idle[configNUMBER_OF_CORES];
+
+static unsigned tasks_permille(uint64_t part, uint64_t whole)
+{
+    return whole ? part * 1000 / whole : 0;
+}
+
+esp_err_t tasks_send(httpd_req_t *req)
+{
+    TaskStatus_t *tasks = tasks_status;
+    configRUN_TIME_COUNTER_TYPE total;
+    char line[96], core[4];
+    esp_err_t err;
+
+    // 0 when there are more tasks than entries
+    UBaseType_t count = uxTaskGetSystemState(tasks, TASKS_MAX, &total);
+    if (count == 0) {
+        ESP_LOGI(TAG, "More than %d tasks", TASKS_MAX);
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Too many tasks");
+        return ESP_OK;
+    }
+
+    httpd_resp_set_type(req, "text/plain");
+    err = httpd_resp_sendstr_chunk(req, "# name core prio stack_free run_us cpu_pct\n");
+    for (UBaseType_t i = 0; i < count && err == ESP_OK; i++) {
+        const TaskStatus_t *t = &tasks[i];
+        unsigned pm = tasks_permille(t->ulRunTimeCounter, total);
+
+        if (t->xCoreID == tskNO_AFFINITY)
+            snprintf(core, sizeof(core), "-");
+        else
+            snprintf(core, sizeof(core), "%d", (int)t->xCoreID);
+        snprintf(line, sizeof(line), "%s %s %u %u %"PRIu64" %u.%u\n",
+                 t->pcTaskName, core, (unsigned)t->uxCurrentPriority,
+                 (unsigned)t->usStackHighWaterMark, (uint64_t)t->ulRunTimeCounter,
+                 pm / 10, pm % 10);
+        err = httpd_resp_sendstr_chunk(req, line);
+    }
+
+    if (err == ESP_OK)
+        err = httpd_resp_sendstr_chunk(req, "# core idle_pct idle_pct_since_last_read\n");
+    for (int c = 0; c < configNUMBER_OF_CORES && err == ESP_OK; c++) {
+        TaskHandle_t idle_task = xTaskGetIdleTaskHandleForCore(c);
+        uint64_t idle = 0;
+
+        for (UBaseType_t i = 0; i < count; i++) {
+            if (tasks[i].xHandle == idle_task)
+                idle = tasks[i].ulRunTimeCounter;
+        }
+        unsigned boot = tasks_permille(idle, total);
+        unsigned recent = tasks_permille(idle - tasks_last_idle[c], total - tasks_last_total);
+        tasks_last_idle[c] = idle;
+        snprintf(line, sizeof(line), "%d %u.%u %u.%u\n", c, boot / 10, boot % 10, recent / 10, recent % 10);
+        err = httpd_resp_sendstr_chunk(req, line);
+    }
+    tasks_last_total = total;
+
+    if (err != ESP_OK)
+        return err;
+    return httpd_resp_sendstr_chunk(req, NULL);
+}
@@ -0,0 +1,24 @@
+/*
+ * Task placement and run time statistics
+ */
+
+#ifndef TASKS_H_
+#define TASKS_H_
+
+#include <esp_http_server.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+/* Cores for xTaskCreatePinnedToCore(), the key sequencer gets one to
+ * itself and the network side has the other */
+#if CONFIG_WEBSTER_PIN_TASKS
+#define TASK_CORE_KEYS      CONFIG_WEBSTER_KEY_CORE
+#define TASK_CORE_NET       (1 - CONFIG_WEBSTER_KEY_CORE)
+#else
+#define TASK_CORE_KEYS      tskNO_AFFINITY
+#define TASK_CORE_NET       tskNO_AFFINITY
+#endif
+
+esp_err_t tasks_send(httpd_req_t *req);
+
+#endif /* TASKS_H_ */
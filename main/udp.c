@@ -0,0 +1,205 @@
+/*
+ * UDP control protocol
+ *
+ * One datagram carries one boot selection, so a fleet orchestrator can
+ * fire at many hosts without a TCP handshake or HTTP parsing per host.
+ * Requests and acknowledgements are authenticated with HMAC-SHA256
+ * (truncated to 16 bytes) under a shared key from Kconfig. Each request
+ * carries a sequence number that must increase, so a captured datagram
+ * cannot be replayed. All fields are big endian.
+ *
+ *   request    "WB" ver op seq[4] btn profile[13] mac[16]
+ *   reply      "WB" ver op|0x80 seq[4] id[4] status mac[16]
+ *
+ * Datagrams with a bad MAC are dropped without a reply.
+ */
+
+#include <stddef.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include <esp_log.h>
+#include <mbedtls/md.h>
+#include "lwip/sockets.h"
+#include "config.h"
+#include "seq.h"
+#include "tasks.h"
+
+static const char *TAG = "udp";
+
+#define UDP_VERSION     1
+#define UDP_MAC_LEN     16
+
+/* Sequence numbers are persisted this far ahead so NVS is written once
+ * per UDP_SEQ_RESERVE / 2 commands rather than for every one. A sender
+ * that jumps further ahead, such as one using the time, still costs one
+ * deferred commit per command, but never on the command's path */
+#define UDP_SEQ_RESERVE 256
+
+typedef enum {
+    UDP_OP_SELECT = 1,
+    UDP_OP_ARM,
+    UDP_OP_DISARM,
+} udp_op_t;
+
+typedef enum {
+    UDP_ST_OK,
+    UDP_ST_BUSY,
+    UDP_ST_BAD_SELECTION,
+    UDP_ST_BAD_PROFILE,
+    UDP_ST_REPLAY,          // id carries the last sequence number seen
+    UDP_ST_FAILED,
+    UDP_ST_BAD_REQUEST,
+} udp_status_t;
+
+typedef struct __attribute__((packed)) {
+    uint8_t magic[2];
+    uint8_t version;
+    uint8_t op;
+    uint32_t seq;
+    uint8_t btn;
+    char profile[SEQ_PROFILE_NAME_LEN];     // NUL padded, empty for the default
+    uint8_t mac[UDP_MAC_LEN];
+} udp_req_t;
+
+typedef struct __attribute__((packed)) {
+    uint8_t magic[2];
+    uint8_t version;
+    uint8_t op;
+    uint32_t seq;
+    uint32_t id;
+    uint8_t status;
+    uint8_t mac[UDP_MAC_LEN];
+} udp_resp_t;
+
+static uint32_t udp_seq_last;       // highest sequence number accepted
+static uint32_t udp_seq_saved;      // bound on udp_seq_last given to the settings cache
+
+/* Truncated HMAC-SHA256 over everything before the mac field */
+static void udp_mac(const void *msg, size_t len, uint8_t *mac)
+{
+    uint8_t full[32];
+
+    mbedtls_md_hmac(mbedtls_md_info_from_type(MBEDTLS_MD_SHA256),
+                    (const unsigned char *)CONFIG_WEBSTER_UDP_KEY, strlen(CONFIG_WEBSTER_UDP_KEY),
+                    msg, len, full);
+    memcpy(mac, full, UDP_MAC_LEN);
+}
+
+/* Compare without an early exit so timing does not leak the MAC */
+static bool udp_mac_ok(const uint8_t *a, const uint8_t *b)
+{
+    uint8_t diff = 0;
+
+    for (int i = 0; i < UDP_MAC_LEN; i++)
+        diff |= a[i] ^ b[i];
+    return diff == 0;
+}
+
+/* Keep the persisted sequence bound ahead of the last number used. It
+ * moves once half the reserve is used up, and the settings cache's low
+ * priority task commits it, so no command waits for flash */
+static void udp_seq_advance(void)
+{
+    uint32_t bound = udp_seq_last + UDP_SEQ_RESERVE;
+
+    if (udp_seq_last + UDP_SEQ_RESERVE / 2 <= udp_seq_saved)
+        return;
+    if (config_set_rec(CFG_REC_UDP_SEQ, &bound, sizeof(bound)) == ESP_OK)
+        udp_seq_saved = bound;
+}
+
+/* Act on one authenticated request */
+static udp_status_t udp_handle(const udp_req_t *req, uint32_t *id)
+{
+    seq_cmd_t cmd = { .type = SEQ_CMD_SELECT };
+    char profile[SEQ_PROFILE_NAME_LEN];
+    uint32_t seq = ntohl(req->seq);
+
+    if (seq <= udp_seq_last) {
+        *id = udp_seq_last;
+        return UDP_ST_REPLAY;
+    }
+    udp_seq_last = seq;
+
+    if (req->op == UDP_OP_DISARM)
+        return seq_disarm() == ESP_OK ? UDP_ST_OK : UDP_ST_FAILED;
+    if (req->op != UDP_OP_SELECT && req->op != UDP_OP_ARM)
+        return UDP_ST_BAD_REQUEST;
+
+    cmd.btn = req->btn;
+    if (cmd.btn < 1 || cmd.btn > 4)
+        return UDP_ST_BAD_SELECTION;
+    memcpy(profile, req->profile, sizeof(profile));
+    profile[sizeof(profile) - 1] = '\0';
+    if (profile_load(profile, &cmd.profile) != ESP_OK)
+        return UDP_ST_BAD_PROFILE;
+
+    *id = (req->op == UDP_OP_ARM) ? seq_arm(&cmd) : seq_submit(&cmd);
+    if (*id == 0)
+        return req->op == UDP_OP_ARM ? UDP_ST_FAILED : UDP_ST_BUSY;
+    return UDP_ST_OK;
+}
+
+/* Listener task */
+static void udp_task(void *arg)
+{
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(CONFIG_WEBSTER_UDP_PORT),
+        .sin_addr.s_addr = htonl(INADDR_ANY),
+    };
+    struct sockaddr_in from;
+    socklen_t from_len;
+    udp_req_t req;
+    udp_resp_t resp;
+    uint8_t mac[UDP_MAC_LEN];
+
+    int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (sock < 0 || bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        ESP_LOGE(TAG, "Cannot listen on port %d", CONFIG_WEBSTER_UDP_PORT);
+        if (sock >= 0)
+            close(sock);
+        vTaskDelete(NULL);
+        return;
+    }
+    ESP_LOGI(TAG, "Listening on port %d", CONFIG_WEBSTER_UDP_PORT);
+
+    while (1) {
+        from_len = sizeof(from);
+        int len = recvfrom(sock, &req, sizeof(req), 0, (struct sockaddr *)&from, &from_len);
+        if (len != sizeof(req) || req.magic[0] != 'W' || req.magic[1] != 'B' ||
+            req.version != UDP_VERSION)
+            continue;
+        udp_mac(&req, offsetof(udp_req_t, mac), mac);
+        if (!udp_mac_ok(mac, req.mac)) {
+            ESP_LOGI(TAG, "Bad MAC from %s", inet_ntoa(from.sin_addr));
+            continue;
+        }
+
+        uint32_t id = 0;
+        memset(&resp, 0, sizeof(resp));
+        resp.status = udp_handle(&req, &id);
+        resp.magic[0] = 'W';
+        resp.magic[1] = 'B';
+        resp.version = UDP_VERSION;
+        resp.op = req.op | 0x80;
+        resp.seq = req.seq;
+        resp.id = htonl(id);
+        udp_mac(&resp, offsetof(udp_resp_t, mac), resp.mac);
+        sendto(sock, &resp, sizeof(resp), 0, (struct sockaddr *)&from, from_len);
+        udp_seq_advance();
+    }
+}
+
+/* Start the listener, unless no key is configured */
+void udp_init(void)
+{
+    if (CONFIG_WEBSTER_UDP_PORT == 0 || strlen(CONFIG_WEBSTER_UDP_KEY) == 0) {
+        ESP_LOGI(TAG, "UDP control disabled");
+        return;
+    }
+    if (config_get_rec(CFG_REC_UDP_SEQ, &udp_seq_saved, sizeof(udp_seq_saved)) == ESP_OK)
+        udp_seq_last = udp_seq_saved;
+    xTaskCreatePinnedToCore(udp_task, "udp", 4096, NULL, tskIDLE_PRIORITY + 5, NULL, TASK_CORE_NET);
+}
@@ -10,9 +10,13 @@
 #include "freertos/task.h"
 #include "tinyusb.h"
 #include "class/hid/hid_device.h"
+#include "usb_descriptors.h"
+#include "seq.h"
+#include "stage.h"
 
 static const char *TAG = "usb";
 
+
 /************* TinyUSB descriptors ****************/
 
 #define TUSB_DESC_TOTAL_LEN      (TUD_CONFIG_DESC_LEN + CFG_TUD_HID * TUD_HID_DESC_LEN)
@@ -81,6 +85,32 @@ uint16_t tud_hid_get_report_cb(uint8_t instance, uint8_t report_id, hid_report_t
 // received data on OUT endpoint ( Report ID = 0, Type = 0 )
 void tud_hid_set_report_cb(uint8_t instance, uint8_t report_id, hid_report_type_t report_type, uint8_t const* buffer, uint16_t bufsize)
 {
+    // Keyboard LED state, used by the sequencer for calibration
+    if (report_type == HID_REPORT_TYPE_OUTPUT && report_id == REPORT_ID_KEYBOARD && bufsize >= 1) {
+        seq_led_report(buffer[0]);
+    }
+}
+
+// Invoked when sent REPORT successfully to host
+// Lets the sequencer queue the next report without polling tud_hid_ready()
+void tud_hid_report_complete_cb(uint8_t instance, uint8_t const* report, uint16_t len)
+{
+    seq_report_complete();
+}
+
+/********* TinyUSB device callbacks ***************/
+
+// Invoked when device is mounted
+void tud_mount_cb(void)
+{
+    stage_mark(STAGE_USB_MOUNTED);
+    seq_usb_event();
+}
+
+// Invoked when usb bus is resumed
+void tud_resume_cb(void)
+{
+    seq_usb_event();
 }
 
 void usb_init(void)
@@ -9,12 +9,19 @@
 #include <string.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
-#include "freertos/event_groups.h"
 #include "esp_system.h"
 #include "esp_wifi.h"
 #include "esp_event.h"
 #include "esp_log.h"
-#include "nvs_flash.h"
+#include "esp_mac.h"
+#include "esp_random.h"
+#include "esp_timer.h"
+#include <inttypes.h>
+#include <sys/param.h>
+#include "config.h"
+#include "metrics.h"
+#include "stage.h"
+#include "wifi.h"
 
 #include "lwip/err.h"
 #include "lwip/sys.h"
@@ -31,115 +38,231 @@
 #define ESP_WIFI_SCAN_AUTH_MODE_THRESHOLD WIFI_AUTH_WPA_WPA2_PSK
 #endif
 
-/* FreeRTOS event group to signal when we are connected*/
-static EventGroupHandle_t s_wifi_event_group;
+/* Connection state, driven entirely from WiFi/IP events and the retry timer */
+typedef enum {
+    WIFI_ST_CONNECTING,
+    WIFI_ST_CONNECTED,      // associated and has an address
+    WIFI_ST_BACKOFF,        // waiting for the retry timer
+} wifi_state_t;
 
-/* The event group allows multiple bits for each event, but we only care about two events:
- * - we are connected to the AP with an IP
- * - we failed to connect after the maximum amount of retries */
-#define WIFI_CONNECTED_BIT BIT0
-#define WIFI_FAIL_BIT      BIT1
+/* Last good association and lease, NVS blob "WIFI_CACHE" */
+typedef struct {
+    char ssid[33];              // cache is ignored if the SSID changes
+    uint8_t bssid[6];
+    uint8_t channel;
+    esp_netif_ip_info_t ip;
+} wifi_cache_t;
+
+_Static_assert(sizeof(wifi_cache_t) <= CFG_REC_SIZE, "WiFi cache must fit a settings record");
 
 static const char *TAG = "wifi";
 
+static volatile wifi_state_t s_state = WIFI_ST_CONNECTING;
 static int s_retry_num = 0;
+static bool s_cache_used;       // connecting straight to the cached AP
+static bool s_cache_pinned;     // STA config still names the cached AP
+static wifi_cache_t s_cache;
+static esp_netif_t *s_netif;
+static esp_timer_handle_t s_retry_timer;
+
+/* Power save modes, the index is what NVS "WIFI_PS" holds */
+static const wifi_ps_type_t ps_modes[WIFI_PS_MODES] = { WIFI_PS_NONE, WIFI_PS_MIN_MODEM, WIFI_PS_MAX_MODEM };
+static const char *ps_names[WIFI_PS_MODES] = { "none", "min", "max" };
+static int s_ps = 0;
 
 
 bool wifi_isup(void)
 {
-    EventBits_t bits = xEventGroupGetBits(s_wifi_event_group);
-    if (bits & WIFI_FAIL_BIT)
+    return s_state == WIFI_ST_CONNECTED;
+}
+
+/* Power save mode by name, -1 if unknown */
+int wifi_ps_parse(const char *name)
+{
+    for (int i = 0; i < WIFI_PS_MODES; i++) {
+        if (strcmp(name, ps_names[i]) == 0)
+            return i;
+    }
+    return -1;
+}
+
+const char *wifi_ps_name(int mode)
+{
+    return (mode >= 0 && mode < WIFI_PS_MODES) ? ps_names[mode] : "unknown";
+}
+
+int wifi_get_ps(void)
+{
+    return s_ps;
+}
+
+/* Switch power save mode now and keep it across reboots */
+esp_err_t wifi_set_ps(int mode)
+{
+    esp_err_t err;
+
+    if (mode < 0 || mode >= WIFI_PS_MODES)
+        return ESP_ERR_INVALID_ARG;
+    if (mode == s_ps)
+        return ESP_OK;
+    if ((err = esp_wifi_set_ps(ps_modes[mode])) != ESP_OK)
+        return err;
+    s_ps = mode;
+    ESP_LOGI(TAG, "Power save %s", ps_names[mode]);
+    return config_set_u8(CFG_WIFI_PS, mode, NULL);
+}
+
+/* Read the cached association, false if there is none for this SSID */
+static bool wifi_cache_load(const char *ssid)
+{
+    if (config_get_rec(CFG_REC_WIFI_CACHE, &s_cache, sizeof(s_cache)) != ESP_OK ||
+        strcmp(s_cache.ssid, ssid) != 0) {
+        memset(&s_cache, 0, sizeof(s_cache));
         return false;
-    else
-        return true;
+    }
+    return true;
+}
+
+/* Remember the AP and lease we just got, the settings cache only writes
+ * flash when they change */
+static void wifi_cache_save(const esp_netif_ip_info_t *ip)
+{
+    wifi_config_t wifi_config;
+    wifi_ap_record_t ap;
+    wifi_cache_t cache = { 0 };
+
+    if (esp_wifi_get_config(WIFI_IF_STA, &wifi_config) != ESP_OK ||
+        esp_wifi_sta_get_ap_info(&ap) != ESP_OK)
+        return;
+    strlcpy(cache.ssid, (const char *)wifi_config.sta.ssid, sizeof(cache.ssid));
+    memcpy(cache.bssid, ap.bssid, sizeof(cache.bssid));
+    cache.channel = ap.primary;
+    cache.ip = *ip;
+    if (memcmp(&cache, &s_cache, sizeof(cache)) == 0)
+        return;
+
+    s_cache = cache;
+    if (config_set_rec(CFG_REC_WIFI_CACHE, &cache, sizeof(cache)) == ESP_OK)
+        ESP_LOGI(TAG, "Cached AP "MACSTR" channel %d", MAC2STR(cache.bssid), cache.channel);
+}
+
+/* Retry delay, doubling per failure up to the maximum with +-50% jitter
+ * so a room full of devices does not hammer the AP in step */
+static uint64_t wifi_backoff_us(int retry)
+{
+    uint64_t ms = CONFIG_WEBSTER_WIFI_BACKOFF_MIN_MS;
+
+    for (int i = 1; i < retry && ms < CONFIG_WEBSTER_WIFI_BACKOFF_MAX_MS; i++)
+        ms *= 2;
+    ms = MIN(ms, CONFIG_WEBSTER_WIFI_BACKOFF_MAX_MS);
+    return ms * (500 + esp_random() % 1000);
+}
+
+static void wifi_retry_cb(void *arg)
+{
+    s_state = WIFI_ST_CONNECTING;
+    esp_wifi_connect();
+}
+
+/* Forget the cached BSSID and channel, and go back to DHCP */
+static void wifi_unpin(void)
+{
+    wifi_config_t wifi_config;
+
+    s_cache_pinned = false;
+    esp_wifi_get_config(WIFI_IF_STA, &wifi_config);
+    wifi_config.sta.bssid_set = false;
+    wifi_config.sta.channel = 0;
+    esp_wifi_set_config(WIFI_IF_STA, &wifi_config);
+#if CONFIG_WEBSTER_WIFI_STATIC_IP
+    esp_netif_dhcpc_start(s_netif);     // the lease may be stale too
+#endif
 }
 
 static void event_handler(void* arg, esp_event_base_t event_base,
                                 int32_t event_id, void* event_data)
 {
     if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_START) {
+        s_state = WIFI_ST_CONNECTING;
         esp_wifi_connect();
     } else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_DISCONNECTED) {
-        if (s_retry_num < CONFIG_ESP_MAXIMUM_RETRY) {
+        wifi_event_sta_disconnected_t *event = (wifi_event_sta_disconnected_t *)event_data;
+        ESP_LOGI(TAG, "connect to the AP fail, reason %d", event->reason);
+        atomic_fetch_add(&metric_wifi_reconnects, 1);
+
+        // Whether the cached AP failed or has just been lost, it may have
+        // moved or been replaced, so scan for the SSID from now on
+        if (s_cache_pinned)
+            wifi_unpin();
+        if (s_cache_used) {
+            // The cached AP did not answer, fall back to a normal scan right away
+            s_cache_used = false;
+            s_state = WIFI_ST_CONNECTING;
             esp_wifi_connect();
-            s_retry_num++;
-            ESP_LOGI(TAG, "retry to connect to the AP");
-        } else {
+        } else if (s_state == WIFI_ST_CONNECTED) {
+            // Just lost it, rejoin at once before backing off
             s_retry_num = 0;
-            xEventGroupSetBits(s_wifi_event_group, WIFI_FAIL_BIT);
+            s_state = WIFI_ST_CONNECTING;
+            esp_wifi_connect();
+        } else {
+            uint64_t delay = wifi_backoff_us(++s_retry_num);
+            ESP_LOGI(TAG, "retry %d in %"PRIu64" ms", s_retry_num, delay / 1000);
+            s_state = WIFI_ST_BACKOFF;
+            esp_timer_stop(s_retry_timer);
+            esp_timer_start_once(s_retry_timer, delay);
         }
-        ESP_LOGI(TAG,"connect to the AP fail");
     } else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP) {
         ip_event_got_ip_t* event = (ip_event_got_ip_t*) event_data;
         ESP_LOGI(TAG, "got ip:" IPSTR, IP2STR(&event->ip_info.ip));
         s_retry_num = 0;
-        xEventGroupSetBits(s_wifi_event_group, WIFI_CONNECTED_BIT);
+        s_cache_used = false;
+        s_state = WIFI_ST_CONNECTED;
+        stage_mark(STAGE_WIFI_GOT_IP);
+        wifi_cache_save(&event->ip_info);
     }
 }
 
+/* Start the station, returns at once and connects in the background */
 void wifi_init(void)
 {
     static int initialized = 0;
-    size_t nvs_len;
-    char wifi_ssid[33];
-    char wifi_pass[65];
-
-    if (!initialized) {
-        // Only do this the first time through
-        s_wifi_event_group = xEventGroupCreate();
-        ESP_ERROR_CHECK(esp_netif_init());
-        esp_netif_create_default_wifi_sta();
-
-        esp_event_handler_instance_t instance_any_id;
-        esp_event_handler_instance_t instance_got_ip;
-        ESP_ERROR_CHECK(esp_event_handler_instance_register(WIFI_EVENT,
-                                                        ESP_EVENT_ANY_ID,
-                                                        &event_handler,
-                                                        NULL,
-                                                        &instance_any_id));
-        ESP_ERROR_CHECK(esp_event_handler_instance_register(IP_EVENT,
-                                                        IP_EVENT_STA_GOT_IP,
-                                                        &event_handler,
-                                                        NULL,
-                                                        &instance_got_ip));
-        initialized = 1;
-    } else {
-        // If previously initialized, disconnect and try again
-        ESP_LOGI(TAG, "Disconnect WiFi");
-        ESP_ERROR_CHECK(esp_wifi_stop());
-        ESP_ERROR_CHECK(esp_wifi_deinit());
-        vTaskDelay(pdMS_TO_TICKS(10000));   // allow AP time to recognize disconnect
-        ESP_LOGI(TAG, "Re-initialize WiFi");
-        xEventGroupClearBits(s_wifi_event_group,
-                WIFI_CONNECTED_BIT | WIFI_FAIL_BIT);
-    }
 
-    // Initialize WiFi
+    if (initialized)
+        return;
+    initialized = 1;
+
+    ESP_ERROR_CHECK(esp_netif_init());
+    s_netif = esp_netif_create_default_wifi_sta();
+
+    esp_event_handler_instance_t instance_any_id;
+    esp_event_handler_instance_t instance_got_ip;
+    ESP_ERROR_CHECK(esp_event_handler_instance_register(WIFI_EVENT,
+                                                    ESP_EVENT_ANY_ID,
+                                                    &event_handler,
+                                                    NULL,
+                                                    &instance_any_id));
+    ESP_ERROR_CHECK(esp_event_handler_instance_register(IP_EVENT,
+                                                    IP_EVENT_STA_GOT_IP,
+                                                    &event_handler,
+                                                    NULL,
+                                                    &instance_got_ip));
+
+    const esp_timer_create_args_t timer_args = {
+        .callback = wifi_retry_cb,
+        .name = "wifi_retry",
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&timer_args, &s_retry_timer));
+
+    // Initialize WiFi, credentials live in our own NVS keys so keep the driver's copy in RAM
     wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
     ESP_ERROR_CHECK(esp_wifi_init(&cfg));
+    ESP_ERROR_CHECK(esp_wifi_set_storage(WIFI_STORAGE_RAM));
 
-    // Get SSID/password from NVS
-    nvs_handle_t nvsHandle;
-    esp_err_t err = nvs_open("storage", NVS_READWRITE, &nvsHandle);
-    if (err != ESP_OK) {
-        ESP_LOGI(TAG, "Error (%s) opening NVS handle!", esp_err_to_name(err));
-        strlcpy(wifi_ssid, CONFIG_ESP_WIFI_SSID, sizeof(wifi_ssid));
-        strlcpy(wifi_pass, CONFIG_ESP_WIFI_PASSWORD, sizeof(wifi_pass));
-    } else {
-        nvs_len = sizeof(wifi_ssid);
-        err = nvs_get_str(nvsHandle, "WIFI_SSID", wifi_ssid, &nvs_len);
-        if ( err != ESP_OK ) {
-            ESP_LOGI(TAG, "WiFi SSID not set, using default");
-            strlcpy(wifi_ssid, CONFIG_ESP_WIFI_SSID, sizeof(wifi_ssid));
-        } else
-        nvs_len = sizeof(wifi_pass);
-        err = nvs_get_str(nvsHandle, "WIFI_PASS", wifi_pass, &nvs_len);
-        if ( err != ESP_OK ) {
-            ESP_LOGI(TAG, "WiFi password not set, using default");
-            strlcpy(wifi_pass, CONFIG_ESP_WIFI_PASSWORD, sizeof(wifi_pass));
-        }
-        nvs_close(nvsHandle);
-    }
+    // Get SSID/password, NVS or the Kconfig defaults
+    config_t settings;
+    config_get(&settings);
+    if (settings.wifi_ps < WIFI_PS_MODES)
+        s_ps = settings.wifi_ps;
 
     // Setup wifi configuration
     wifi_config_t wifi_config = {
@@ -151,7 +274,8 @@ void wifi_init(void)
              */
             .threshold.authmode = ESP_WIFI_SCAN_AUTH_MODE_THRESHOLD,
             .sae_pwe_h2e = WPA3_SAE_PWE_BOTH,
-            .sae_h2e_identifier = ""
+            .sae_h2e_identifier = "",
+            .listen_interval = CONFIG_WEBSTER_WIFI_LISTEN_INTERVAL,   // beacons, max modem only
         },
     };
 
@@ -160,36 +284,38 @@ void wifi_init(void)
      * wifi_cfg->sta.ssid is also 32 bytes long (without extra 1 byte for null character).
      * Although, this is not a matter for concern because esp_wifi library reads the SSID
      * upto 32 bytes in absence of null termination */
-    const size_t ssid_len = strnlen(wifi_ssid, sizeof(wifi_config.sta.ssid));
+    const size_t ssid_len = strnlen(settings.wifi_ssid, sizeof(wifi_config.sta.ssid));
     /* Ensure SSID less than 32 bytes is null terminated */
     memset(wifi_config.sta.ssid, 0, sizeof(wifi_config.sta.ssid));
-    memcpy(wifi_config.sta.ssid, wifi_ssid, ssid_len);
+    memcpy(wifi_config.sta.ssid, settings.wifi_ssid, ssid_len);
 
     /* Using strlcpy allows both max passphrase length (63 bytes) and ensures null termination
      * because size of wifi_config.sta.password is 64 bytes (1 extra byte for null character) */
-    strlcpy((char *) wifi_config.sta.password, wifi_pass, sizeof(wifi_config.sta.password));
+    strlcpy((char *) wifi_config.sta.password, settings.wifi_pass, sizeof(wifi_config.sta.password));
+
+    /* Stop the scan at the first match, and with a cached AP skip it
+     * altogether by going straight to its BSSID and channel */
+    wifi_config.sta.scan_method = WIFI_FAST_SCAN;
+    if (wifi_cache_load(settings.wifi_ssid)) {
+        ESP_LOGI(TAG, "Fast connect to "MACSTR" channel %d", MAC2STR(s_cache.bssid), s_cache.channel);
+        wifi_config.sta.bssid_set = true;
+        memcpy(wifi_config.sta.bssid, s_cache.bssid, sizeof(wifi_config.sta.bssid));
+        wifi_config.sta.channel = s_cache.channel;
+        s_cache_used = true;
+        s_cache_pinned = true;
+#if CONFIG_WEBSTER_WIFI_STATIC_IP
+        // Reuse the last lease instead of waiting on DHCP
+        if (s_cache.ip.ip.addr != 0) {
+            esp_netif_dhcpc_stop(s_netif);
+            esp_netif_set_ip_info(s_netif, &s_cache.ip);
+        }
+#endif
+    }
 
     ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA) );
     ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_STA, &wifi_config) );
     ESP_ERROR_CHECK(esp_wifi_start() );
+    ESP_ERROR_CHECK(esp_wifi_set_ps(ps_modes[s_ps]) );
 
     ESP_LOGI(TAG, "wifi_init_sta finished.");
-
-    /* Waiting until either the connection is established (WIFI_CONNECTED_BIT) or connection failed for the maximum
-     * number of re-tries (WIFI_FAIL_BIT). The bits are set by event_handler() (see above) */
-    EventBits_t bits = xEventGroupWaitBits(s_wifi_event_group,
-            WIFI_CONNECTED_BIT | WIFI_FAIL_BIT,
-            pdFALSE,
-            pdFALSE,
-            portMAX_DELAY);
-
-    /* xEventGroupWaitBits() returns the bits before the call returned, hence we can test which event actually
-     * happened. */
-    if (bits & WIFI_CONNECTED_BIT) {
-        ESP_LOGI(TAG, "connected to ap SSID:%s", wifi_ssid);
-    } else if (bits & WIFI_FAIL_BIT) {
-        ESP_LOGI(TAG, "Failed to connect to SSID:%s", wifi_ssid);
-    } else {
-        ESP_LOGE(TAG, "UNEXPECTED EVENT");
-    }
 }
@@ -0,0 +1,21 @@
+/*
+ * WiFi station interface
+ */
+
+#ifndef WIFI_H_
+#define WIFI_H_
+
+#include <stdbool.h>
+#include "esp_err.h"
+
+/* Power save modes: none, min modem, max modem */
+#define WIFI_PS_MODES   3
+
+void wifi_init(void);
+bool wifi_isup(void);
+int wifi_ps_parse(const char *name);
+const char *wifi_ps_name(int mode);
+int wifi_get_ps(void);
+esp_err_t wifi_set_ps(int mode);
+
+#endif /* WIFI_H_ */
@@ -0,0 +1,65 @@
+/*
+ * Wake-on-LAN
+ *
+ * Sends the magic packet (6 x 0xff then the target MAC 16 times) as a
+ * UDP datagram from the station interface.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <esp_log.h>
+#include "lwip/sockets.h"
+
+static const char *TAG = "wol";
+
+#define WOL_REPEAT      3       // datagrams are cheap, NICs miss them
+
+/* Parse "aa:bb:cc:dd:ee:ff" (or with '-'), false if malformed */
+bool wol_parse_mac(const char *str, uint8_t *mac)
+{
+    for (int i = 0; i < 6; i++) {
+        char *end;
+        unsigned long v = strtoul(str, &end, 16);
+        if (end != str + 2 || v > 0xff)
+            return false;
+        if (i < 5 && *end != ':' && *end != '-')
+            return false;
+        if (i == 5 && *end != '\0')
+            return false;
+        mac[i] = v;
+        str = end + 1;
+    }
+    return true;
+}
+
+/* Send the magic packet for mac to addr:port, addr is usually a broadcast */
+esp_err_t wol_send(const uint8_t *mac, uint32_t addr, uint16_t port)
+{
+    uint8_t pkt[6 + 16 * 6];
+    struct sockaddr_in to = {
+        .sin_family = AF_INET,
+        .sin_port = htons(port),
+        .sin_addr.s_addr = addr,
+    };
+    int on = 1;
+    esp_err_t err = ESP_OK;
+
+    memset(pkt, 0xff, 6);
+    for (int i = 0; i < 16; i++)
+        memcpy(pkt + 6 + i * 6, mac, 6);
+
+    int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (sock < 0)
+        return ESP_FAIL;
+    setsockopt(sock, SOL_SOCKET, SO_BROADCAST, &on, sizeof(on));
+    for (int i = 0; i < WOL_REPEAT; i++) {
+        if (sendto(sock, pkt, sizeof(pkt), 0, (struct sockaddr *)&to, sizeof(to)) != sizeof(pkt)) {
+            ESP_LOGI(TAG, "sendto failed (%d)", errno);
+            err = ESP_FAIL;
+        }
+    }
+    close(sock);
+    return err;
+}
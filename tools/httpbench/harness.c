@@ -0,0 +1,362 @@
+/*
+ * Request harness for the HTTP handlers
+ *
+ * Builds main/httpd.c unchanged and calls its route_handler() the way
+ * the httpd task would, with the request and the socket replaced by
+ * memory. Reads are cut into the segment sizes the caller asks for and
+ * may time out first, so a body can be split at every possible place.
+ * admit.c, form.c, config.c, ota.c, metrics.c, pool.c and profile.c are
+ * the real ones.
+ * The sequencer, WiFi and the log ring are small stubs, their handlers
+ * are not what is being measured.
+ */
+
+#include "httpd.c"
+#include "harness.h"
+
+typedef struct {
+    httpd_req_t req;
+    const hb_req_t *in;
+    hb_resp_t *out;
+    size_t pos;                 // next body byte
+    int segment;
+    unsigned recvs;
+    int status;
+    bool chunked;               // a chunked response is in progress
+} hb_conn_t;
+
+/* Keep the start of the response body for the caller to check */
+static void hb_resp_body(hb_conn_t *c, const char *buf, size_t len)
+{
+    size_t have = MIN(c->out->len, sizeof(c->out->body) - 1);
+    size_t n = MIN(len, sizeof(c->out->body) - 1 - have);
+
+    if (n)
+        memcpy(c->out->body + have, buf, n);
+    c->out->body[have + n] = '\0';
+    c->out->len += len;
+}
+
+/* ---- esp_http_server, as the handlers see it ---- */
+
+int httpd_req_recv(httpd_req_t *req, char *buf, size_t len)
+{
+    hb_conn_t *c = req->aux;
+    const hb_req_t *in = c->in;
+    size_t remaining = in->content_len - c->pos;
+
+    // Like the server, never read past Content-Length
+    len = MIN(len, remaining);
+    if (len == 0)
+        return 0;
+    c->recvs++;
+    if (in->timeout_every && c->recvs % in->timeout_every == 0)
+        return HTTPD_SOCK_ERR_TIMEOUT;
+    if (c->pos >= in->body_len)
+        return 0;           // client went away
+    if (in->nsegments) {
+        uint16_t seg = in->segments[c->segment++ % in->nsegments];
+        if (seg)
+            len = MIN(len, seg);
+    }
+    len = MIN(len, in->body_len - c->pos);
+    memcpy(buf, in->body + c->pos, len);
+    c->pos += len;
+    return len;
+}
+
+int httpd_req_to_sockfd(httpd_req_t *req)
+{
+    return 3;
+}
+
+esp_err_t httpd_req_get_hdr_value_str(httpd_req_t *req, const char *field, char *val, size_t size)
+{
+    hb_conn_t *c = req->aux;
+    const char *p = c->in->headers;
+    size_t flen = strlen(field);
+
+    if (val == NULL || size == 0)
+        return ESP_ERR_INVALID_ARG;
+    while (p && *p) {
+        const char *end = strstr(p, "\r\n");
+        size_t line = end ? (size_t)(end - p) : strlen(p);
+
+        if (line > flen && p[flen] == ':' && strncasecmp(p, field, flen) == 0) {
+            const char *v = p + flen + 1;
+            while (*v == ' ')
+                v++;
+            size_t vlen = p + line - v;
+            strlcpy(val, v, MIN(size, vlen + 1));
+            return (size < vlen + 1) ? ESP_ERR_HTTPD_RESULT_TRUNC : ESP_OK;
+        }
+        p = end ? end + 2 : NULL;
+    }
+    return ESP_ERR_NOT_FOUND;
+}
+
+esp_err_t httpd_req_get_url_query_str(httpd_req_t *req, char *buf, size_t size)
+{
+    const char *q = strchr(req->uri, '?');
+    size_t len;
+
+    if (q == NULL)
+        return ESP_ERR_NOT_FOUND;
+    if (buf == NULL || size == 0)
+        return ESP_ERR_INVALID_ARG;
+    q++;
+    len = strcspn(q, "#");
+    strlcpy(buf, q, MIN(size, len + 1));
+    return (size < len + 1) ? ESP_ERR_HTTPD_RESULT_TRUNC : ESP_OK;
+}
+
+/* Same matching as the server: keys compare without case, a value
+ * that does not fit is truncated and reported as such */
+esp_err_t httpd_query_key_value(const char *query, const char *key, char *val, size_t size)
+{
+    const char *p = query;
+    size_t klen = strlen(key);
+
+    if (query == NULL || key == NULL || val == NULL)
+        return ESP_ERR_INVALID_ARG;
+    while (*p) {
+        const char *eq = strchr(p, '=');
+        if (eq == NULL)
+            break;
+        if ((size_t)(eq - p) != klen || strncasecmp(p, key, klen) != 0) {
+            p = strchr(eq, '&');
+            if (p == NULL)
+                break;
+            p++;
+            continue;
+        }
+        const char *v = eq + 1;
+        size_t vlen = strcspn(v, "&");
+        strlcpy(val, v, MIN(size, vlen + 1));
+        return (size < vlen + 1) ? ESP_ERR_HTTPD_RESULT_TRUNC : ESP_OK;
+    }
+    return ESP_ERR_NOT_FOUND;
+}
+
+esp_err_t httpd_resp_set_status(httpd_req_t *req, const char *status)
+{
+    hb_conn_t *c = req->aux;
+
+    c->status = atoi(status);
+    return ESP_OK;
+}
+
+esp_err_t httpd_resp_set_type(httpd_req_t *req, const char *type)
+{
+    return ESP_OK;
+}
+
+esp_err_t httpd_resp_set_hdr(httpd_req_t *req, const char *field, const char *value)
+{
+    hb_conn_t *c = req->aux;
+
+    if (strcasecmp(field, "ETag") == 0)
+        strlcpy(c->out->etag, value, sizeof(c->out->etag));
+    return ESP_OK;
+}
+
+esp_err_t httpd_resp_send(httpd_req_t *req, const char *buf, ssize_t len)
+{
+    hb_conn_t *c = req->aux;
+
+    if (len == HTTPD_RESP_USE_STRLEN)
+        len = buf ? strlen(buf) : 0;
+    hb_resp_body(c, buf, len);
+    c->out->status = c->status;
+    c->out->responses++;
+    return ESP_OK;
+}
+
+esp_err_t httpd_resp_send_chunk(httpd_req_t *req, const char *buf, ssize_t len)
+{
+    hb_conn_t *c = req->aux;
+
+    if (len == HTTPD_RESP_USE_STRLEN)
+        len = buf ? strlen(buf) : 0;
+    if (len > 0) {
+        c->chunked = true;
+        hb_resp_body(c, buf, len);
+        return ESP_OK;
+    }
+    // An empty chunk ends the response
+    c->chunked = false;
+    c->out->status = c->status;
+    c->out->responses++;
+    return ESP_OK;
+}
+
+esp_err_t httpd_resp_send_err(httpd_req_t *req, httpd_err_code_t code, const char *msg)
+{
+    hb_conn_t *c = req->aux;
+
+    c->status = (code == HTTPD_400_BAD_REQUEST) ? 400 : (code == HTTPD_404_NOT_FOUND) ? 404 : 500;
+    return httpd_resp_send(req, msg, HTTPD_RESP_USE_STRLEN);
+}
+
+/* Not reached, the server is never started and /ws is not routed */
+bool httpd_uri_match_wildcard(const char *tmpl, const char *uri, size_t len) { return false; }
+esp_err_t httpd_start(httpd_handle_t *handle, const httpd_config_t *config) { return ESP_FAIL; }
+esp_err_t httpd_stop(httpd_handle_t handle) { return ESP_OK; }
+esp_err_t httpd_register_uri_handler(httpd_handle_t handle, const httpd_uri_t *uri) { return ESP_OK; }
+esp_err_t httpd_queue_work(httpd_handle_t handle, httpd_work_fn_t work, void *arg) { return ESP_FAIL; }
+esp_err_t httpd_ws_recv_frame(httpd_req_t *req, httpd_ws_frame_t *frame, size_t max_len) { return ESP_FAIL; }
+esp_err_t httpd_ws_send_frame(httpd_req_t *req, httpd_ws_frame_t *frame) { return ESP_FAIL; }
+esp_err_t httpd_ws_send_frame_async(httpd_handle_t handle, int fd, httpd_ws_frame_t *frame) { return ESP_FAIL; }
+httpd_ws_client_info_t httpd_ws_get_fd_info(httpd_handle_t handle, int fd) { return HTTPD_WS_CLIENT_INVALID; }
+
+/* ---- Stubs for the rest of the firmware ---- */
+
+/* Embedded assets, the sources stand in for the minified and gzipped files */
+#define HB_ASSET(name, file)                                            \
+    __asm__(".pushsection .rodata\n"                                    \
+            "_binary_" #name "_min_start: .incbin \"" HB_WWW "/" file "\"\n" \
+            "_binary_" #name "_min_end:\n"                              \
+            "_binary_" #name "_gz_start: .incbin \"" HB_WWW "/" file "\"\n" \
+            "_binary_" #name "_gz_end:\n"                               \
+            ".popsection\n")
+HB_ASSET(index_html, "index.html.in");
+HB_ASSET(config_html, "config.html");
+HB_ASSET(favicon_ico, "favicon.ico");
+
+static atomic_uint hb_seq_id;
+static int hb_wifi_ps;
+
+uint32_t seq_submit(seq_cmd_t *cmd)
+{
+    return cmd->id = atomic_fetch_add(&hb_seq_id, 1) + 1;
+}
+
+uint32_t seq_arm(seq_cmd_t *cmd)
+{
+    return seq_submit(cmd);
+}
+
+esp_err_t seq_disarm(void)
+{
+    return ESP_OK;
+}
+
+seq_state_t seq_status(uint32_t id)
+{
+    return (id && id <= atomic_load(&hb_seq_id)) ? SEQ_STATE_DONE : SEQ_STATE_UNKNOWN;
+}
+
+const char *seq_state_name(seq_state_t state)
+{
+    return (state == SEQ_STATE_DONE) ? "done" : "unknown";
+}
+
+bool seq_times(uint32_t id, seq_times_t *times)
+{
+    return false;
+}
+
+void seq_set_progress(seq_progress_fn fn)
+{
+}
+
+int wifi_ps_parse(const char *name)
+{
+    for (int i = 0; i < WIFI_PS_MODES; i++) {
+        if (strcmp(name, wifi_ps_name(i)) == 0)
+            return i;
+    }
+    return -1;
+}
+
+const char *wifi_ps_name(int mode)
+{
+    static const char *names[WIFI_PS_MODES] = { "none", "min", "max" };
+
+    return (mode >= 0 && mode < WIFI_PS_MODES) ? names[mode] : "unknown";
+}
+
+int wifi_get_ps(void)
+{
+    return hb_wifi_ps;
+}
+
+esp_err_t wifi_set_ps(int mode)
+{
+    if (mode < 0 || mode >= WIFI_PS_MODES)
+        return ESP_ERR_INVALID_ARG;
+    if (mode == hb_wifi_ps)
+        return ESP_OK;
+    hb_wifi_ps = mode;
+    return config_set_u8(CFG_WIFI_PS, mode, NULL);
+}
+
+void stage_mark(stage_t stage)
+{
+}
+
+esp_err_t stage_send(httpd_req_t *req)
+{
+    return httpd_resp_sendstr_chunk(req, "app_main 0\n");
+}
+
+esp_err_t tasks_send(httpd_req_t *req)
+{
+    return httpd_resp_sendstr_chunk(req, "seq 1 6 2048 0 0.0\n");
+}
+
+esp_err_t logring_send(httpd_req_t *req, unsigned count)
+{
+    return httpd_resp_sendstr_chunk(req, "I (0) hb: log line\n");
+}
+
+bool wol_parse_mac(const char *str, uint8_t *mac)
+{
+    unsigned m[6];
+    char end;
+
+    if (sscanf(str, "%2x:%2x:%2x:%2x:%2x:%2x%c", &m[0], &m[1], &m[2], &m[3], &m[4], &m[5], &end) != 6)
+        return false;
+    for (int i = 0; i < 6; i++)
+        mac[i] = m[i];
+    return true;
+}
+
+esp_err_t wol_send(const uint8_t *mac, uint32_t addr, uint16_t port)
+{
+    return ESP_OK;
+}
+
+/* ---- Harness ---- */
+
+void hb_init(void)
+{
+    pool_init();
+    config_init();
+    // Every request comes from one client, the benchmark is not to be rate limited
+    config_set_u8(CFG_HTTP_RATE, 0, NULL);
+}
+
+/* Run one request through the route table, as the httpd task would */
+void hb_request(const hb_req_t *in, hb_resp_t *out)
+{
+    hb_conn_t c = { .in = in, .out = out, .status = 200 };
+
+    memset(out, 0, sizeof(*out));
+    c.req.handle = &c;
+    c.req.method = in->method;
+    c.req.content_len = in->content_len;
+    c.req.aux = &c;
+    // The server answers 414 itself for a URI too long for req->uri
+    if (strlen(in->uri) > HTTPD_MAX_URI_LEN) {
+        out->status = 414;
+        out->responses = 1;
+        return;
+    }
+    strcpy((char *)c.req.uri, in->uri);
+
+    out->ret = route_handler(&c.req);
+    out->consumed = c.pos;
+    out->recvs = c.recvs;
+    out->unfinished = c.chunked;
+}
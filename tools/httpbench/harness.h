@@ -0,0 +1,40 @@
+/*
+ * In-process HTTP requests against the firmware's handlers
+ */
+
+#ifndef HARNESS_H_
+#define HARNESS_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_http_server.h"
+
+typedef struct {
+    httpd_method_t method;
+    const char *uri;
+    const char *headers;        // "Name: value\r\n" lines, or NULL
+    const uint8_t *body;
+    size_t body_len;            // bytes the client sends before it goes away
+    size_t content_len;         // Content-Length, usually body_len
+    const uint16_t *segments;   // largest read each recv returns, in turn, 0 = no limit
+    int nsegments;
+    unsigned timeout_every;     // every Nth recv times out first, 0 = never
+} hb_req_t;
+
+typedef struct {
+    esp_err_t ret;              // what the handler returned
+    int status;
+    unsigned responses;         // complete responses sent, must not exceed one
+    bool unfinished;            // a chunked response was never ended
+    size_t consumed;            // body bytes the handler read
+    unsigned recvs;
+    char etag[40];
+    size_t len;                 // response body length
+    char body[256];             // start of the response body
+} hb_resp_t;
+
+void hb_init(void);
+void hb_request(const hb_req_t *req, hb_resp_t *resp);
+
+#endif /* HARNESS_H_ */
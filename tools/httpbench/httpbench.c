@@ -0,0 +1,255 @@
+/*
+ * HTTP handler benchmark
+ *
+ * Drives the firmware's handlers in-process (see harness.c) and reports
+ * requests per second and p50/p99 handler latency per route, then OTA
+ * ingest rate into a file-backed update partition for a raw, a gzipped
+ * and a chunked upload. Bodies arrive in TCP segment sized reads, as
+ * they would from the socket.
+ *
+ *     make && ./httpbench
+ *     ./httpbench -n 20000 -s 536 -k 512 -f /tmp/ota.bin
+ *
+ * Numbers are host CPU time, useful for comparing one change against
+ * the next, not as what the ESP32 will do.
+ */
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <openssl/sha.h>
+#include <zlib.h>
+#include "esp_ota_ops.h"
+#include "esp_log.h"
+#include "harness.h"
+
+typedef struct {
+    const char *name;
+    httpd_method_t method;
+    const char *uri;
+    const char *headers;
+    const char *body;
+    int status;                 // expected
+} bench_route_t;
+
+static char etag_hdr[80];       // If-None-Match with the current index.html tag
+
+static const bench_route_t bench_routes[] = {
+    { "GET /",              HTTP_GET,  "/", NULL, NULL, 307 },
+    { "GET /index.html",    HTTP_GET,  "/index.html", "Accept-Encoding: gzip, deflate\r\n", NULL, 200 },
+    { "GET /index.html 304", HTTP_GET, "/index.html", etag_hdr, NULL, 304 },
+    { "GET /ctrl/status",   HTTP_GET,  "/ctrl/status?id=1", NULL, NULL, 200 },
+    { "POST /ctrl",         HTTP_POST, "/ctrl?key=b2", NULL, NULL, 200 },
+    { "POST /ctrl +body",   HTTP_POST, "/ctrl?key=b2&profile=grub", NULL,
+      "garbage that the handler has to read and throw away before it answers, "
+      "sent by some clients along with the query", 200 },
+    { "POST /config form",  HTTP_POST, "/config", "Content-Type: application/x-www-form-urlencoded\r\n",
+      "wifi_ssid=benchnet&wifi_pass=correct+horse%20battery&wifi_ps=min", 200 },
+    { "POST /config json",  HTTP_POST, "/config", "Content-Type: application/json\r\n",
+      "{\"wifi_ssid\": \"benchnet\", \"wifi_pass\": \"correct horse battery\", \"wifi_ps\": \"min\"}", 200 },
+    { "POST /profile",      HTTP_POST, "/profile?name=bench&press=5000&gap=20000&lead=0x2c&count=5", NULL, NULL, 200 },
+    { "GET /profile",       HTTP_GET,  "/profile", NULL, NULL, 200 },
+    { "GET /metrics",       HTTP_GET,  "/metrics", NULL, NULL, 200 },
+    { "POST /log",          HTTP_POST, "/log?tag=wifi&level=debug", NULL, NULL, 200 },
+    { "GET /missing",       HTTP_GET,  "/missing", NULL, NULL, 404 },
+};
+
+static int64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int cmp_i64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+static void bench_route(const bench_route_t *r, int n, const uint16_t *seg)
+{
+    int64_t *lat = malloc(n * sizeof(*lat));
+    size_t len = r->body ? strlen(r->body) : 0;
+    hb_req_t req = {
+        .method = r->method, .uri = r->uri, .headers = r->headers,
+        .body = (const uint8_t *)r->body, .body_len = len, .content_len = len,
+        .segments = seg, .nsegments = 1,
+    };
+    hb_resp_t resp;
+    int bad = 0;
+
+    int64_t start = now_ns();
+    for (int i = 0; i < n; i++) {
+        int64_t t = now_ns();
+        hb_request(&req, &resp);
+        lat[i] = now_ns() - t;
+        bad += (resp.status != r->status);
+    }
+    int64_t total = now_ns() - start;
+
+    qsort(lat, n, sizeof(*lat), cmp_i64);
+    printf("%-22s %8d %10.0f %9.2f %9.2f %9.2f%s\n", r->name, n,
+           n * 1e9 / total, lat[n / 2] / 1e3, lat[(int)(n * 0.99)] / 1e3, lat[n - 1] / 1e3,
+           bad ? "  unexpected status" : "");
+    if (bad)
+        fprintf(stderr, "%s: %d of %d answered %d, last: %s\n", r->name, bad, n, resp.status, resp.body);
+    free(lat);
+}
+
+/* A firmware-like image, about half of it compresses */
+static uint8_t *make_image(size_t size)
+{
+    static const char text[] = "esp_http_server webster key sequencer ota_write NVS storage ";
+    uint8_t *img = malloc(size);
+    uint32_t x = 2463534242u;
+
+    for (size_t i = 0; i < size; i += 64) {
+        bool random = (i / 64) % 2;
+        for (size_t j = i; j < i + 64 && j < size; j++) {
+            x ^= x << 13;
+            x ^= x >> 17;
+            x ^= x << 5;
+            img[j] = random ? x : text[j % (sizeof(text) - 1)];
+        }
+    }
+    img[0] = 0xe9;      // app image magic
+    return img;
+}
+
+static uint8_t *gzip_image(const uint8_t *img, size_t size, size_t *gz_len)
+{
+    z_stream z = { 0 };
+    uLong bound;
+    uint8_t *out;
+
+    deflateInit2(&z, 9, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY);
+    bound = deflateBound(&z, size);
+    out = malloc(bound);
+    z.next_in = (Bytef *)img;
+    z.avail_in = size;
+    z.next_out = out;
+    z.avail_out = bound;
+    deflate(&z, Z_FINISH);
+    *gz_len = z.total_out;
+    deflateEnd(&z);
+    return out;
+}
+
+static bool flash_matches(const uint8_t *img, size_t size)
+{
+    uint8_t *buf = malloc(size);
+    bool same = esp_partition_read(esp_ota_get_next_update_partition(NULL), 0, buf, size) == ESP_OK &&
+                memcmp(buf, img, size) == 0;
+
+    free(buf);
+    return same;
+}
+
+static void ota_report(const char *name, const uint8_t *img, size_t size, size_t wire,
+                       int64_t ns, const hb_resp_t *resp)
+{
+    bool ok = strncmp(resp->body, "Update complete", 15) == 0 && flash_matches(img, size) &&
+              hb_flash_unerased == 0;
+
+    printf("%-22s %8.2f MB %8.2f MB %9.2f MB/s %9.2f MB/s  %s\n", name,
+           size / 1e6, wire / 1e6, size * 1e3 / ns, wire * 1e3 / ns,
+           ok ? "ok" : "FAIL");
+    if (!ok)
+        fprintf(stderr, "%s: %s, %u unerased writes\n", name, resp->body, hb_flash_unerased);
+}
+
+static void bench_ota(size_t size, const uint16_t *seg)
+{
+    uint8_t *img = make_image(size);
+    size_t gz_len;
+    uint8_t *gz = gzip_image(img, size, &gz_len);
+    hb_req_t req = { .method = HTTP_POST, .uri = "/update", .segments = seg, .nsegments = 1 };
+    hb_resp_t resp;
+    int64_t t;
+
+    printf("\n%-22s %11s %11s %14s %14s\n", "upload", "image", "sent", "image rate", "wire rate");
+
+    req.body = img;
+    req.body_len = req.content_len = size;
+    t = now_ns();
+    hb_request(&req, &resp);
+    ota_report("POST /update raw", img, size, size, now_ns() - t, &resp);
+
+    req.body = gz;
+    req.body_len = req.content_len = gz_len;
+    t = now_ns();
+    hb_request(&req, &resp);
+    ota_report("POST /update gzip", img, size, gz_len, now_ns() - t, &resp);
+
+    // Resumable upload, chunks as large as the OTA buffers hold
+    const size_t chunk = CONFIG_WEBSTER_OTA_BUF_COUNT * CONFIG_WEBSTER_OTA_BUF_SIZE;
+    char uri[160], hex[65];
+    uint8_t digest[32];
+    t = now_ns();
+    for (size_t ofs = 0; ofs < gz_len; ofs += chunk) {
+        size_t len = gz_len - ofs < chunk ? gz_len - ofs : chunk;
+        SHA256(gz + ofs, len, digest);
+        for (int i = 0; i < 32; i++)
+            sprintf(hex + 2 * i, "%02x", digest[i]);
+        snprintf(uri, sizeof(uri), "/update?offset=%zu&total=%zu&sha256=%s", ofs, gz_len, hex);
+        req.uri = uri;
+        req.body = gz + ofs;
+        req.body_len = req.content_len = len;
+        hb_request(&req, &resp);
+        if (resp.status != 200)
+            break;
+    }
+    ota_report("POST /update chunks", img, size, gz_len, now_ns() - t, &resp);
+
+    free(gz);
+    free(img);
+}
+
+static void usage(void)
+{
+    fprintf(stderr,
+        "usage: httpbench [-n requests] [-s segment] [-k KiB] [-f flash_file] [-v]\n"
+        "  -n  requests per route (default 5000)\n"
+        "  -s  largest read the socket returns, 0 for the whole body (default 1436)\n"
+        "  -k  OTA image size in KiB, 0 to skip (default 960, the partition is 1024)\n"
+        "  -f  file for the update partition (default a temporary file)\n"
+        "  -v  show the firmware's log, twice for debug\n");
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    int n = 5000, kib = 960, opt;
+    uint16_t seg = 1436;
+
+    while ((opt = getopt(argc, argv, "n:s:k:f:v")) != -1) {
+        switch (opt) {
+        case 'n': n = atoi(optarg); break;
+        case 's': seg = atoi(optarg); break;
+        case 'k': kib = atoi(optarg); break;
+        case 'f': hb_flash_path = optarg; break;
+        case 'v': hb_verbose++; break;
+        default: usage();
+        }
+    }
+    if (n < 1 || kib < 0 || kib > 1024)
+        usage();
+
+    hb_init();
+    hb_req_t get = { .method = HTTP_GET, .uri = "/index.html" };
+    hb_resp_t resp;
+    hb_request(&get, &resp);
+    snprintf(etag_hdr, sizeof(etag_hdr), "If-None-Match: %s\r\n", resp.etag);
+
+    printf("%-22s %8s %10s %9s %9s %9s\n", "route", "requests", "req/s", "p50_us", "p99_us", "max_us");
+    for (size_t i = 0; i < sizeof(bench_routes) / sizeof(bench_routes[0]); i++)
+        bench_route(&bench_routes[i], n, &seg);
+    if (kib)
+        bench_ota((size_t)kib << 10, &seg);
+    return 0;
+}
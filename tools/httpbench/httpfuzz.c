@@ -0,0 +1,383 @@
+/*
+ * Fuzz target for the HTTP handlers
+ *
+ * Each input picks a route, how the socket splits the body, and a few
+ * request flags, followed by a line of URI or query text and the body:
+ *
+ *     byte 0       route, see fuzz_routes
+ *     bytes 1-4    largest read for successive recv calls, 0 = no limit
+ *     byte 5       flags, FUZZ_*
+ *     then         query (or whole URI) up to '\n', then the body
+ *
+ * Besides what the sanitizers catch, every request must be answered at
+ * most once, and a handler that returns ESP_OK must have answered and
+ * ended any chunked response. The update partition must only ever be
+ * written where it was erased, and request buffers must be back in
+ * their pool once the handler returns.
+ *
+ * With clang and libFuzzer:   make httpfuzz-lf && ./httpfuzz-lf corpus/
+ * Anywhere else:              make httpfuzz && ./httpfuzz -n 5000000
+ * The second build has its own random mutator, saves a failing input to
+ * httpfuzz-crash.bin and replays files given on the command line, such
+ * as that one or a crash libFuzzer saved.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <openssl/sha.h>
+#include <zlib.h>
+#include "esp_log.h"
+#include "esp_partition.h"
+#include "harness.h"
+#include "pool.h"
+
+#define FUZZ_CT_MASK        0x03    // Content-Type: none, form, JSON, text
+#define FUZZ_TIMEOUTS       0x04    // every third recv times out first
+#define FUZZ_SHORT          0x08    // client goes away half way through the body
+#define FUZZ_GZIP           0x10    // Accept-Encoding: gzip
+#define FUZZ_RAW_URI        0x20    // the line is the whole URI
+
+#define FUZZ_HDR            6
+
+static const struct {
+    httpd_method_t method;
+    const char *path;
+} fuzz_routes[] = {
+    { HTTP_POST, "/ctrl?" },
+    { HTTP_POST, "/config?" },
+    { HTTP_POST, "/update?" },
+    { HTTP_POST, "/profile?" },
+    { HTTP_POST, "/log?" },
+    { HTTP_POST, "/boot?" },
+    { HTTP_GET,  "/ctrl/status?" },
+    { HTTP_GET,  "/log?" },
+    { HTTP_GET,  "/profile" },
+    { HTTP_GET,  "/boot" },
+    { HTTP_GET,  "/update" },
+    { HTTP_GET,  "/index.html" },
+    { HTTP_GET,  "/metrics" },
+    { HTTP_POST, "/nowhere?" },
+};
+
+static const char *fuzz_types[] = {
+    NULL,
+    "Content-Type: application/x-www-form-urlencoded\r\n",
+    "Content-Type: application/json\r\n",
+    "Content-Type: text/plain\r\n",
+};
+
+static int fuzz_status;         // of the last request, 0 if never answered
+
+static void fuzz_fail(const char *what, const char *uri, const hb_resp_t *resp)
+{
+    fprintf(stderr, "httpfuzz: %s\n  uri %s\n  ret %d status %d responses %u: %s\n",
+            what, uri, resp->ret, resp->status, resp->responses, resp->body);
+    abort();
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    static char uri[2 * HTTPD_MAX_URI_LEN];
+    char headers[128];
+    uint16_t segments[4];
+    hb_req_t req = { .uri = uri, .headers = headers, .segments = segments, .nsegments = 4 };
+    hb_resp_t resp;
+
+    if (size < FUZZ_HDR)
+        return 0;
+    int route = data[0] % (sizeof(fuzz_routes) / sizeof(fuzz_routes[0]));
+    for (int i = 0; i < 4; i++)
+        segments[i] = data[1 + i];
+    uint8_t flags = data[5];
+    data += FUZZ_HDR;
+    size -= FUZZ_HDR;
+
+    // URI text stops at the newline, or at a NUL the server could not have passed on
+    const uint8_t *nl = memchr(data, '\n', size);
+    size_t line = nl ? (size_t)(nl - data) : size;
+    line = strnlen((const char *)data, line);
+    line = line < HTTPD_MAX_URI_LEN ? line : HTTPD_MAX_URI_LEN;
+    if (flags & FUZZ_RAW_URI) {
+        uri[0] = '/';
+        memcpy(uri + 1, data, line);
+        uri[line + 1] = '\0';
+        req.method = (data[-FUZZ_HDR] & 0x80) ? HTTP_POST : HTTP_GET;
+    } else {
+        size_t plen = strlen(fuzz_routes[route].path);
+        memcpy(uri, fuzz_routes[route].path, plen);
+        memcpy(uri + plen, data, line);
+        uri[plen + line] = '\0';
+        req.method = fuzz_routes[route].method;
+    }
+    if (nl) {
+        req.body = nl + 1;
+        req.content_len = size - (nl + 1 - data);
+    }
+    req.body_len = (flags & FUZZ_SHORT) ? req.content_len / 2 : req.content_len;
+    req.timeout_every = (flags & FUZZ_TIMEOUTS) ? 3 : 0;
+    snprintf(headers, sizeof(headers), "%s%s",
+             fuzz_types[flags & FUZZ_CT_MASK] ? fuzz_types[flags & FUZZ_CT_MASK] : "",
+             (flags & FUZZ_GZIP) ? "Accept-Encoding: gzip\r\n" : "");
+
+    hb_request(&req, &resp);
+
+    if (resp.responses > 1)
+        fuzz_fail("answered more than once", uri, &resp);
+    if (resp.ret == ESP_OK && (resp.responses == 0 || resp.unfinished))
+        fuzz_fail("returned ESP_OK without a complete response", uri, &resp);
+    if (hb_flash_unerased)
+        fuzz_fail("wrote flash that was not erased", uri, &resp);
+    // OTA buffers may still be with the writer and a chunked upload keeps
+    // its decompressor between requests, request buffers must all be back
+    for (int i = 0; i < pool_count(); i++) {
+        pool_stats_t st;
+        pool_stats(i, &st);
+        if (strcmp(st.name, "small") == 0 && st.in_use)
+            fuzz_fail("kept a request buffer", uri, &resp);
+    }
+    fuzz_status = resp.responses ? resp.status : 0;
+    return 0;
+}
+
+#ifdef HB_LIBFUZZER
+
+int LLVMFuzzerInitialize(int *argc, char ***argv)
+{
+    hb_init();
+    return 0;
+}
+
+#else
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sanitizer/common_interface_defs.h>
+
+typedef struct {
+    uint8_t *data;
+    size_t len;
+} fuzz_input_t;
+
+#define FUZZ_MAX_SEEDS  16
+#define FUZZ_MAX_LEN    (24 * 1024)
+
+#define FUZZ_CRASH      "httpfuzz-crash.bin"
+
+static fuzz_input_t seeds[FUZZ_MAX_SEEDS];
+static fuzz_input_t current;
+static int nseeds;
+static uint64_t rng = 0x9e3779b97f4a7c15ull;
+
+static uint32_t rnd(void)
+{
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return rng >> 32;
+}
+
+static void add_seed(uint8_t route, const uint8_t seg[4], uint8_t flags, const char *line,
+                     const void *body, size_t len)
+{
+    fuzz_input_t *s = &seeds[nseeds++];
+
+    s->len = FUZZ_HDR + strlen(line) + 1 + len;
+    s->data = malloc(s->len);
+    s->data[0] = route;
+    memcpy(s->data + 1, seg, 4);
+    s->data[5] = flags;
+    memcpy(s->data + FUZZ_HDR, line, strlen(line));
+    s->data[FUZZ_HDR + strlen(line)] = '\n';
+    memcpy(s->data + FUZZ_HDR + strlen(line) + 1, body, len);
+}
+
+/* One valid request per route family, the mutator works from these */
+static void make_seeds(void)
+{
+    static const uint8_t whole[4] = { 0 }, small[4] = { 7, 1, 3, 64 };
+    static uint8_t img[6000];
+    static uint8_t gz[8000];
+    char line[160], hex[65];
+    uint8_t digest[32];
+    uLongf gz_len;
+    z_stream z = { 0 };
+
+    add_seed(0, whole, 0, "key=b2&profile=grub", "", 0);
+    add_seed(0, small, FUZZ_TIMEOUTS, "key=b1&arm=1", "junk=1", 6);
+    add_seed(1, small, 1, "", "wifi_ssid=net%41&wifi_pass=pa+ss&wifi_ps=max", 44);
+    add_seed(1, small, 2, "", "{\"wifi_ssid\":\"n\\u00e9t\",\"wifi_pass\":\"x\",\"wifi_ps\":\"min\",\"n\":1}", 61);
+    add_seed(3, whole, 0, "name=fz&press=1000&gap=2000&lead=0x2c&count=3&select=0x51", "", 0);
+    add_seed(3, whole, 0, "name=fz&delete=1", "", 0);
+    add_seed(4, whole, 0, "tag=*&level=debug", "", 0);
+    add_seed(5, whole, 0, "mac=00:11:22:33:44:55&key=b3&to=192.168.1.9&port=7", "", 0);
+    add_seed(6, whole, FUZZ_GZIP, "id=1", "", 0);
+    add_seed(7, whole, 0, "n=5", "", 0);
+
+    // A small image, raw and gzipped
+    for (size_t i = 0; i < sizeof(img); i++)
+        img[i] = (i % 97 < 50) ? i * 31 : 'w';
+    img[0] = 0xe9;
+    add_seed(2, small, 0, "", img, sizeof(img));
+    deflateInit2(&z, 9, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY);
+    z.next_in = img;
+    z.avail_in = sizeof(img);
+    z.next_out = gz;
+    z.avail_out = sizeof(gz);
+    deflate(&z, Z_FINISH);
+    gz_len = z.total_out;
+    deflateEnd(&z);
+    add_seed(2, small, 0, "", gz, gz_len);
+
+    // First chunk of a resumable upload
+    SHA256(gz, 1000, digest);
+    for (int i = 0; i < 32; i++)
+        sprintf(hex + 2 * i, "%02x", digest[i]);
+    snprintf(line, sizeof(line), "offset=0&total=%lu&sha256=%s", (unsigned long)gz_len, hex);
+    add_seed(2, whole, 0, line, gz, 1000);
+}
+
+/* Copy a seed and apply a few random edits */
+static size_t mutate(uint8_t *out)
+{
+    const fuzz_input_t *s = &seeds[rnd() % nseeds];
+    size_t len = s->len;
+    int edits = 1 + rnd() % 8;
+
+    memcpy(out, s->data, len);
+    for (int i = 0; i < edits; i++) {
+        size_t pos = len ? rnd() % len : 0;
+        switch (rnd() % 8) {
+        case 0:         // flip a bit
+            if (len)
+                out[pos] ^= 1 << (rnd() % 8);
+            break;
+        case 1:         // an interesting byte
+            if (len)
+                out[pos] = "%&=+\\\"{}:,\n\0\xff\x7f" "0u"[rnd() % 16];
+            break;
+        case 2:         // insert a byte
+            if (len < FUZZ_MAX_LEN) {
+                memmove(out + pos + 1, out + pos, len - pos);
+                out[pos] = rnd();
+                len++;
+            }
+            break;
+        case 3:         // delete a run
+            if (len) {
+                size_t n = 1 + rnd() % 16;
+                n = n < len - pos ? n : len - pos;
+                memmove(out + pos, out + pos + n, len - pos - n);
+                len -= n;
+            }
+            break;
+        case 4:         // repeat a run, to grow keys and values past their buffers
+            if (len) {
+                size_t n = 1 + rnd() % 64;
+                n = n < len - pos ? n : len - pos;
+                int times = 1 + rnd() % 8;
+                while (times-- && len + n <= FUZZ_MAX_LEN) {
+                    memmove(out + pos + n, out + pos, len - pos);
+                    len += n;
+                }
+            }
+            break;
+        case 5:         // new read sizes
+            for (int j = 1; j < FUZZ_HDR - 1 && len > j; j++)
+                out[j] = (rnd() % 4) ? rnd() % 16 : rnd();
+            break;
+        case 6:         // new flags
+            if (len > 5)
+                out[5] = rnd();
+            break;
+        case 7:         // truncate
+            len = pos;
+            break;
+        }
+    }
+    return len;
+}
+
+/* Keep the input that failed, so it can be replayed */
+static void save_current(void)
+{
+    static const char msg[] = "httpfuzz: input saved to " FUZZ_CRASH "\n";
+    int fd = open(FUZZ_CRASH, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    if (fd >= 0) {
+        if (write(fd, current.data, current.len) == (ssize_t)current.len)
+            write(STDERR_FILENO, msg, sizeof(msg) - 1);
+        close(fd);
+    }
+}
+
+static void on_abort(int sig)
+{
+    save_current();
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+static void replay(const char *path)
+{
+    FILE *f = fopen(path, "rb");
+    static uint8_t buf[1 << 20];
+    size_t len;
+
+    if (f == NULL) {
+        perror(path);
+        exit(2);
+    }
+    len = fread(buf, 1, sizeof(buf), f);
+    fclose(f);
+    LLVMFuzzerTestOneInput(buf, len);
+    printf("%s: ok\n", path);
+}
+
+int main(int argc, char **argv)
+{
+    static uint8_t buf[FUZZ_MAX_LEN + FUZZ_HDR];
+    long iterations = 1000000, classes[6] = { 0 };
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:s:v")) != -1) {
+        switch (opt) {
+        case 'n': iterations = atol(optarg); break;
+        case 's': rng = strtoull(optarg, NULL, 0) | 1; break;
+        case 'v': hb_verbose++; break;
+        default:
+            fprintf(stderr, "usage: httpfuzz [-n iterations] [-s seed] [-v] [input...]\n");
+            return 2;
+        }
+    }
+
+    hb_init();
+    if (optind < argc) {
+        for (int i = optind; i < argc; i++)
+            replay(argv[i]);
+        return 0;
+    }
+
+    __sanitizer_set_death_callback(save_current);
+    signal(SIGABRT, on_abort);
+    make_seeds();
+    for (int i = 0; i < nseeds; i++) {
+        current = seeds[i];
+        LLVMFuzzerTestOneInput(current.data, current.len);
+    }
+    current.data = buf;
+    for (long i = 1; i <= iterations; i++) {
+        current.len = mutate(buf);
+        LLVMFuzzerTestOneInput(buf, current.len);
+        classes[fuzz_status / 100]++;
+        if (i % 100000 == 0)
+            fprintf(stderr, "httpfuzz: %ld inputs\n", i);
+    }
+    printf("httpfuzz: %ld inputs, no failures, %ld 2xx %ld 3xx %ld 4xx %ld 5xx %ld unanswered\n",
+           iterations, classes[2], classes[3], classes[4], classes[5], classes[0]);
+    return 0;
+}
+
+#endif
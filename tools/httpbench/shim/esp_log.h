@@ -0,0 +1,22 @@
+#pragma once
+#include <inttypes.h>
+#include <stdio.h>
+#include "esp_err.h"
+
+/* Set by -v, otherwise the firmware's logging is dropped */
+extern int hb_verbose;
+
+typedef enum {
+    ESP_LOG_NONE, ESP_LOG_ERROR, ESP_LOG_WARN, ESP_LOG_INFO, ESP_LOG_DEBUG, ESP_LOG_VERBOSE
+} esp_log_level_t;
+
+#define HB_LOG(l, tag, fmt, ...) do {                                   \
+        if (hb_verbose)                                                 \
+            fprintf(stderr, l " %s: " fmt "\n", tag, ##__VA_ARGS__);    \
+    } while (0)
+#define ESP_LOGE(tag, fmt, ...) HB_LOG("E", tag, fmt, ##__VA_ARGS__)
+#define ESP_LOGW(tag, fmt, ...) HB_LOG("W", tag, fmt, ##__VA_ARGS__)
+#define ESP_LOGI(tag, fmt, ...) HB_LOG("I", tag, fmt, ##__VA_ARGS__)
+#define ESP_LOGD(tag, fmt, ...) do { if (hb_verbose > 1) HB_LOG("D", tag, fmt, ##__VA_ARGS__); } while (0)
+
+void esp_log_level_set(const char *tag, esp_log_level_t level);
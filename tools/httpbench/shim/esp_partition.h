@@ -0,0 +1,21 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+
+typedef struct {
+    int subtype;
+    uint32_t address;
+    uint32_t size;
+    const char *label;
+} esp_partition_t;
+
+/* A file stands in for the partition with NOR flash rules: erase sets
+ * whole sectors to 0xff and a write can only clear bits */
+esp_err_t esp_partition_read(const esp_partition_t *part, size_t ofs, void *dst, size_t len);
+esp_err_t esp_partition_erase_range(const esp_partition_t *part, size_t ofs, size_t len);
+
+/* Backing file, a temporary one if NULL. Set before the first update */
+extern const char *hb_flash_path;
+/* Writes that needed a bit set, i.e. went to flash nobody erased */
+extern unsigned hb_flash_unerased;
@@ -0,0 +1,5 @@
+#pragma once
+#include <stdint.h>
+
+/* The ROM CRC-32 matches zlib's, pre and post inverted, see shim.c */
+uint32_t esp_rom_crc32_le(uint32_t crc, const uint8_t *buf, uint32_t len);
@@ -0,0 +1,10 @@
+#pragma once
+#include "freertos/queue.h"
+
+/* As in FreeRTOS, semaphores are queues of empty items */
+typedef QueueHandle_t SemaphoreHandle_t;
+
+SemaphoreHandle_t xSemaphoreCreateBinary(void);
+SemaphoreHandle_t xSemaphoreCreateMutex(void);
+#define xSemaphoreTake(s, ticks)    xQueueReceive((s), NULL, (ticks))
+#define xSemaphoreGive(s)           xQueueSend((s), NULL, 0)
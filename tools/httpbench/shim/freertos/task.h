@@ -0,0 +1,15 @@
+#pragma once
+#include "freertos/FreeRTOS.h"
+
+/* Tasks are detached POSIX threads */
+typedef struct hb_task *TaskHandle_t;
+typedef void (*TaskFunction_t)(void *);
+
+BaseType_t xTaskCreate(TaskFunction_t fn, const char *name, uint32_t stack, void *arg,
+                       UBaseType_t prio, TaskHandle_t *handle);
+#define xTaskCreatePinnedToCore(fn, name, stack, arg, prio, handle, core) \
+    xTaskCreate(fn, name, stack, arg, prio, handle)
+void vTaskDelay(TickType_t ticks);
+/* Counting notifications, a wait is either forever or none at all */
+BaseType_t xTaskNotifyGive(TaskHandle_t task);
+uint32_t ulTaskNotifyTake(BaseType_t clear, TickType_t wait);
@@ -0,0 +1,20 @@
+#pragma once
+#include <openssl/sha.h>
+
+/* mbedtls API over OpenSSL */
+typedef SHA256_CTX mbedtls_sha256_context;
+
+static inline void mbedtls_sha256_init(mbedtls_sha256_context *ctx) { }
+static inline void mbedtls_sha256_free(mbedtls_sha256_context *ctx) { }
+static inline int mbedtls_sha256_starts(mbedtls_sha256_context *ctx, int is224)
+{
+    return SHA256_Init(ctx) ? 0 : -1;
+}
+static inline int mbedtls_sha256_update(mbedtls_sha256_context *ctx, const unsigned char *p, size_t len)
+{
+    return SHA256_Update(ctx, p, len) ? 0 : -1;
+}
+static inline int mbedtls_sha256_finish(mbedtls_sha256_context *ctx, unsigned char out[32])
+{
+    return SHA256_Final(out, ctx) ? 0 : -1;
+}
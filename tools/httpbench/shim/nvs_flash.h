@@ -0,0 +1,31 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+
+/* Kept in RAM for the life of the process, see shim.c */
+typedef uint32_t nvs_handle_t;
+typedef struct nvs_iter *nvs_iterator_t;
+typedef enum { NVS_READONLY, NVS_READWRITE } nvs_open_mode_t;
+typedef enum { NVS_TYPE_U8 = 0x01, NVS_TYPE_U16 = 0x02, NVS_TYPE_U32 = 0x04, NVS_TYPE_STR = 0x21, NVS_TYPE_BLOB = 0x42, NVS_TYPE_ANY = 0xff } nvs_type_t;
+typedef struct { char namespace_name[16]; char key[16]; nvs_type_t type; } nvs_entry_info_t;
+#define NVS_DEFAULT_PART_NAME "nvs"
+
+esp_err_t nvs_open(const char *ns, nvs_open_mode_t mode, nvs_handle_t *h);
+void nvs_close(nvs_handle_t h);
+esp_err_t nvs_commit(nvs_handle_t h);
+esp_err_t nvs_get_str(nvs_handle_t h, const char *key, char *value, size_t *len);
+esp_err_t nvs_set_str(nvs_handle_t h, const char *key, const char *value);
+esp_err_t nvs_get_u8(nvs_handle_t h, const char *key, uint8_t *value);
+esp_err_t nvs_set_u8(nvs_handle_t h, const char *key, uint8_t value);
+esp_err_t nvs_get_u16(nvs_handle_t h, const char *key, uint16_t *value);
+esp_err_t nvs_set_u16(nvs_handle_t h, const char *key, uint16_t value);
+esp_err_t nvs_get_u32(nvs_handle_t h, const char *key, uint32_t *value);
+esp_err_t nvs_set_u32(nvs_handle_t h, const char *key, uint32_t value);
+esp_err_t nvs_get_blob(nvs_handle_t h, const char *key, void *value, size_t *len);
+esp_err_t nvs_set_blob(nvs_handle_t h, const char *key, const void *value, size_t len);
+esp_err_t nvs_erase_key(nvs_handle_t h, const char *key);
+esp_err_t nvs_entry_find(const char *part, const char *ns, nvs_type_t type, nvs_iterator_t *it);
+esp_err_t nvs_entry_next(nvs_iterator_t *it);
+esp_err_t nvs_entry_info(nvs_iterator_t it, nvs_entry_info_t *info);
+void nvs_release_iterator(nvs_iterator_t it);
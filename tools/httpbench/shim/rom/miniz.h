@@ -0,0 +1,108 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+// zlib's gz_header type would clash with ota.c's function of that name
+#define gz_header zlib_gz_header
+#include <zlib.h>
+#undef gz_header
+
+/* The ROM's tinfl API over zlib raw inflate. zlib's allocations come
+ * from an arena inside the decompressor, so free() of the decompressor
+ * releases everything, as it does with the real tinfl. */
+#define TINFL_LZ_DICT_SIZE          32768
+#define TINFL_FLAG_HAS_MORE_INPUT   2
+
+typedef enum {
+    TINFL_STATUS_FAILED = -1,
+    TINFL_STATUS_DONE = 0,
+    TINFL_STATUS_NEEDS_MORE_INPUT = 1,
+    TINFL_STATUS_HAS_MORE_OUTPUT = 2,
+} tinfl_status;
+
+typedef struct {
+    uint32_t m_num_bits;        // bits read ahead, as the ROM's
+    z_stream z;
+    bool failed;
+    bool done;                  // end seen, reported on the next call
+    size_t used;
+    _Alignas(16) uint8_t arena[48 * 1024];
+} tinfl_decompressor;
+
+/* The ROM's tinfl (miniz 1.15) does not give back the whole bytes left
+ * in its bit buffer at the end of the stream, so up to 3 bytes past it
+ * are reported as consumed, sometimes by the call before the one that
+ * returns DONE. zlib stops exactly at the end, so that is put back in
+ * unless this is cleared */
+extern bool hb_tinfl_lookahead;
+
+static voidpf tinfl_zalloc(voidpf opaque, uInt items, uInt size)
+{
+    tinfl_decompressor *r = opaque;
+    size_t n = ((size_t)items * size + 15) & ~(size_t)15;
+
+    if (r->used + n > sizeof(r->arena))
+        return Z_NULL;
+    r->used += n;
+    return r->arena + r->used - n;
+}
+
+static void tinfl_zfree(voidpf opaque, voidpf p)
+{
+}
+
+static inline void tinfl_init(tinfl_decompressor *r)
+{
+    memset(&r->z, 0, sizeof(r->z));
+    r->m_num_bits = 0;
+    r->done = false;
+    r->used = 0;
+    r->z.zalloc = tinfl_zalloc;
+    r->z.zfree = tinfl_zfree;
+    r->z.opaque = r;
+    r->failed = inflateInit2(&r->z, -15) != Z_OK;
+}
+
+static inline tinfl_status tinfl_decompress(tinfl_decompressor *r, const uint8_t *in, size_t *in_sz,
+                                            uint8_t *out_start, uint8_t *out_next, size_t *out_sz,
+                                            uint32_t flags)
+{
+    int ret;
+
+    if (r->failed)
+        return TINFL_STATUS_FAILED;
+    if (r->done) {
+        *in_sz = 0;
+        *out_sz = 0;
+        return TINFL_STATUS_DONE;
+    }
+    r->z.next_in = (Bytef *)in;
+    r->z.avail_in = *in_sz;
+    r->z.next_out = out_next;
+    r->z.avail_out = *out_sz;
+    ret = inflate(&r->z, Z_NO_FLUSH);
+    if (ret == Z_STREAM_END && hb_tinfl_lookahead) {
+        // Vary how far it read ahead, and whether DONE comes a call later
+        uInt ahead = 1 + r->z.total_in % 3;
+
+        if (ahead > r->z.avail_in)
+            ahead = r->z.avail_in;
+
+        r->z.avail_in -= ahead;
+        r->m_num_bits = 8 * ahead + r->z.total_in % 8;
+        if (ahead && (r->z.total_in & 4)) {
+            r->done = true;
+            ret = Z_OK;
+        }
+    }
+    *in_sz -= r->z.avail_in;
+    *out_sz -= r->z.avail_out;
+    if (ret == Z_STREAM_END)
+        return TINFL_STATUS_DONE;
+    if (r->done)
+        return TINFL_STATUS_HAS_MORE_OUTPUT;
+    if (ret != Z_OK && ret != Z_BUF_ERROR)
+        return TINFL_STATUS_FAILED;
+    return r->z.avail_out == 0 ? TINFL_STATUS_HAS_MORE_OUTPUT : TINFL_STATUS_NEEDS_MORE_INPUT;
+}
@@ -0,0 +1,37 @@
+/* Kconfig values for the host build, forced in with -include */
+#pragma once
+#define CONFIG_ESP_WIFI_SSID                "myssid"
+#define CONFIG_ESP_WIFI_PASSWORD            "mypassword"
+#define CONFIG_WEBSTER_WIFI_PS_NONE         1
+#define CONFIG_WEBSTER_CONFIG_COMMIT_MS     1000
+#define CONFIG_WEBSTER_DEFAULT_PROFILE      "grub"
+#define CONFIG_WEBSTER_KEY_PRESS_US         10000
+#define CONFIG_WEBSTER_KEY_GAP_US           500000
+#define CONFIG_WEBSTER_OTA_BUF_COUNT        4
+#define CONFIG_WEBSTER_OTA_BUF_SIZE         4096
+#define CONFIG_WEBSTER_OTA_PREERASE         0
+#define CONFIG_WEBSTER_POOL_SMALL_SIZE      256
+#define CONFIG_WEBSTER_POOL_SMALL_COUNT     4
+#define CONFIG_WEBSTER_HTTP_MAX_SOCKETS     8
+#define CONFIG_WEBSTER_HTTP_TIMEOUT         5
+#define CONFIG_WEBSTER_HTTP_RATE            10
+#define CONFIG_WEBSTER_HTTP_BURST           20
+#define CONFIG_WEBSTER_SEQ_PRIORITY         6
+#define CONFIG_WEBSTER_HTTPD_PRIORITY       5
+#define CONFIG_FREERTOS_HZ                  1000
+#define CONFIG_LWIP_MAX_SOCKETS             16
+
+/* glibc only has strlcpy from 2.38 */
+#include <string.h>
+static inline size_t hb_strlcpy(char *dst, const char *src, size_t size)
+{
+    size_t len = strlen(src);
+
+    if (size) {
+        size_t n = len < size - 1 ? len : size - 1;
+        memcpy(dst, src, n);
+        dst[n] = '\0';
+    }
+    return len;
+}
+#define strlcpy hb_strlcpy
@@ -0,0 +1,688 @@
+/*
+ * Host implementations of the ESP-IDF and FreeRTOS calls the firmware
+ * makes outside the HTTP server: tasks and queues on POSIX threads, a
+ * monotonic esp_timer, NVS in RAM, and the OTA partition in a file.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <zlib.h>
+#include "esp_err.h"
+#include "esp_event.h"
+#include "esp_log.h"
+#include "esp_rom_crc.h"
+#include "esp_ota_ops.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "esp_wifi.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "nvs_flash.h"
+#include "spi_flash_mmap.h"
+
+int hb_verbose;
+
+const char *esp_err_to_name(esp_err_t err)
+{
+    switch (err) {
+    case ESP_OK:                        return "ESP_OK";
+    case ESP_FAIL:                      return "ESP_FAIL";
+    case ESP_ERR_NO_MEM:                return "ESP_ERR_NO_MEM";
+    case ESP_ERR_INVALID_ARG:           return "ESP_ERR_INVALID_ARG";
+    case ESP_ERR_INVALID_STATE:         return "ESP_ERR_INVALID_STATE";
+    case ESP_ERR_INVALID_SIZE:          return "ESP_ERR_INVALID_SIZE";
+    case ESP_ERR_NOT_FOUND:             return "ESP_ERR_NOT_FOUND";
+    case ESP_ERR_NOT_SUPPORTED:         return "ESP_ERR_NOT_SUPPORTED";
+    case ESP_ERR_INVALID_RESPONSE:      return "ESP_ERR_INVALID_RESPONSE";
+    case ESP_ERR_INVALID_CRC:           return "ESP_ERR_INVALID_CRC";
+    case ESP_ERR_NVS_NOT_FOUND:         return "ESP_ERR_NVS_NOT_FOUND";
+    case ESP_ERR_NVS_READ_ONLY:         return "ESP_ERR_NVS_READ_ONLY";
+    case ESP_ERR_NVS_INVALID_LENGTH:    return "ESP_ERR_NVS_INVALID_LENGTH";
+    case ESP_ERR_OTA_VALIDATE_FAILED:   return "ESP_ERR_OTA_VALIDATE_FAILED";
+    default:                            return "ESP_ERR";
+    }
+}
+
+void esp_log_level_set(const char *tag, esp_log_level_t level)
+{
+}
+
+esp_err_t esp_register_shutdown_handler(shutdown_handler_t handler)
+{
+    return ESP_OK;
+}
+
+bool hb_tinfl_lookahead = true;
+
+uint32_t esp_rom_crc32_le(uint32_t crc, const uint8_t *buf, uint32_t len)
+{
+    return crc32(crc, buf, len);
+}
+
+uint32_t esp_get_free_heap_size(void)
+{
+    return 200 * 1024;
+}
+
+uint32_t esp_get_minimum_free_heap_size(void)
+{
+    return 160 * 1024;
+}
+
+esp_event_base_t const IP_EVENT = "IP_EVENT";
+esp_event_base_t const WIFI_EVENT = "WIFI_EVENT";
+
+esp_err_t esp_event_handler_register(esp_event_base_t base, int32_t id,
+                                     esp_event_handler_t handler, void *arg)
+{
+    return ESP_OK;
+}
+
+esp_err_t esp_event_handler_unregister(esp_event_base_t base, int32_t id, esp_event_handler_t handler)
+{
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_sta_get_ap_info(wifi_ap_record_t *ap)
+{
+    ap->rssi = -50;
+    return ESP_OK;
+}
+
+/* ---- Tasks, queues and semaphores ---- */
+
+struct hb_queue {
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    size_t item_size;
+    size_t len;
+    size_t count;
+    size_t head;
+    uint8_t *items;
+};
+
+struct hb_task {
+    TaskFunction_t fn;
+    void *arg;
+    pthread_mutex_t lock;
+    pthread_cond_t notified;
+    uint32_t notify;
+};
+
+static __thread struct hb_task *hb_task_self;
+
+/* The task is never deleted, its handle stays valid for notifications */
+static void *hb_task_main(void *p)
+{
+    hb_task_self = p;
+    hb_task_self->fn(hb_task_self->arg);
+    return NULL;
+}
+
+BaseType_t xTaskCreate(TaskFunction_t fn, const char *name, uint32_t stack, void *arg,
+                       UBaseType_t prio, TaskHandle_t *handle)
+{
+    struct hb_task *task = calloc(1, sizeof(*task));
+    pthread_t thread;
+
+    if (task == NULL)
+        return pdFALSE;
+    task->fn = fn;
+    task->arg = arg;
+    pthread_mutex_init(&task->lock, NULL);
+    pthread_cond_init(&task->notified, NULL);
+    if (pthread_create(&thread, NULL, hb_task_main, task) != 0) {
+        free(task);
+        return pdFALSE;
+    }
+    pthread_detach(thread);
+    if (handle)
+        *handle = task;
+    return pdPASS;
+}
+
+BaseType_t xTaskNotifyGive(TaskHandle_t task)
+{
+    pthread_mutex_lock(&task->lock);
+    task->notify++;
+    pthread_cond_signal(&task->notified);
+    pthread_mutex_unlock(&task->lock);
+    return pdPASS;
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clear, TickType_t wait)
+{
+    struct hb_task *task = hb_task_self;
+    uint32_t value;
+
+    pthread_mutex_lock(&task->lock);
+    while (task->notify == 0 && wait == portMAX_DELAY)
+        pthread_cond_wait(&task->notified, &task->lock);
+    value = task->notify;
+    task->notify = clear ? 0 : (value ? value - 1 : 0);
+    pthread_mutex_unlock(&task->lock);
+    return value;
+}
+
+void vTaskDelay(TickType_t ticks)
+{
+    uint64_t us = (uint64_t)ticks * 1000000 / CONFIG_FREERTOS_HZ;
+    struct timespec ts = { .tv_sec = us / 1000000, .tv_nsec = us % 1000000 * 1000 };
+
+    nanosleep(&ts, NULL);
+}
+
+QueueHandle_t xQueueCreate(UBaseType_t len, UBaseType_t item_size)
+{
+    struct hb_queue *q = calloc(1, sizeof(*q));
+    pthread_condattr_t attr;
+
+    if (q == NULL)
+        return NULL;
+    q->items = calloc(len ? len : 1, item_size ? item_size : 1);
+    if (q->items == NULL) {
+        free(q);
+        return NULL;
+    }
+    q->item_size = item_size;
+    q->len = len;
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&q->changed, &attr);
+    pthread_condattr_destroy(&attr);
+    return q;
+}
+
+/* Wait for room or an item until the ticks run out, lock held */
+static bool hb_queue_wait(struct hb_queue *q, bool sending, TickType_t ticks)
+{
+    struct timespec deadline;
+
+    if (ticks != portMAX_DELAY) {
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        uint64_t ns = deadline.tv_nsec + (uint64_t)ticks * 1000000000 / CONFIG_FREERTOS_HZ;
+        deadline.tv_sec += ns / 1000000000;
+        deadline.tv_nsec = ns % 1000000000;
+    }
+    while (sending ? q->count == q->len : q->count == 0) {
+        if (ticks == 0)
+            return false;
+        if (ticks == portMAX_DELAY)
+            pthread_cond_wait(&q->changed, &q->lock);
+        else if (pthread_cond_timedwait(&q->changed, &q->lock, &deadline) == ETIMEDOUT)
+            return sending ? q->count < q->len : q->count > 0;
+    }
+    return true;
+}
+
+BaseType_t xQueueSend(QueueHandle_t q, const void *item, TickType_t ticks)
+{
+    pthread_mutex_lock(&q->lock);
+    if (!hb_queue_wait(q, true, ticks)) {
+        pthread_mutex_unlock(&q->lock);
+        return pdFALSE;
+    }
+    if (q->item_size)
+        memcpy(q->items + (q->head + q->count) % q->len * q->item_size, item, q->item_size);
+    q->count++;
+    pthread_cond_broadcast(&q->changed);
+    pthread_mutex_unlock(&q->lock);
+    return pdTRUE;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t q, void *item, TickType_t ticks)
+{
+    pthread_mutex_lock(&q->lock);
+    if (!hb_queue_wait(q, false, ticks)) {
+        pthread_mutex_unlock(&q->lock);
+        return pdFALSE;
+    }
+    if (q->item_size)
+        memcpy(item, q->items + q->head * q->item_size, q->item_size);
+    q->head = (q->head + 1) % q->len;
+    q->count--;
+    pthread_cond_broadcast(&q->changed);
+    pthread_mutex_unlock(&q->lock);
+    return pdTRUE;
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinary(void)
+{
+    return xQueueCreate(1, 0);
+}
+
+/* Not recursive and without priority inheritance, neither is used */
+SemaphoreHandle_t xSemaphoreCreateMutex(void)
+{
+    SemaphoreHandle_t s = xQueueCreate(1, 0);
+
+    if (s)
+        xSemaphoreGive(s);
+    return s;
+}
+
+/* ---- esp_timer ---- */
+
+struct esp_timer {
+    bool armed;
+};
+
+int64_t esp_timer_get_time(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+esp_err_t esp_timer_create(const esp_timer_create_args_t *args, esp_timer_handle_t *handle)
+{
+    *handle = calloc(1, sizeof(struct esp_timer));
+    return *handle ? ESP_OK : ESP_ERR_NO_MEM;
+}
+
+esp_err_t esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeout_us)
+{
+    if (timer->armed)
+        return ESP_ERR_INVALID_STATE;
+    timer->armed = true;
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_stop(esp_timer_handle_t timer)
+{
+    if (!timer->armed)
+        return ESP_ERR_INVALID_STATE;
+    timer->armed = false;
+    return ESP_OK;
+}
+
+/* ---- NVS ---- */
+
+#define NVS_ENTRIES     64
+#define NVS_NAMESPACES  4
+
+typedef struct {
+    uint8_t ns;             // index into nvs_ns, 0 when the entry is free
+    char key[16];
+    nvs_type_t type;
+    size_t len;
+    void *data;
+} nvs_entry_t;
+
+struct nvs_iter {
+    int idx;
+    uint8_t ns;
+    nvs_type_t type;
+};
+
+static pthread_mutex_t nvs_lock = PTHREAD_MUTEX_INITIALIZER;
+static char nvs_ns[NVS_NAMESPACES + 1][16];
+static nvs_entry_t nvs_entries[NVS_ENTRIES];
+
+/* Handles are the namespace index, plus a flag for read-write */
+#define NVS_RW  0x100
+
+esp_err_t nvs_open(const char *ns, nvs_open_mode_t mode, nvs_handle_t *h)
+{
+    int free_ns = 0;
+
+    if (strlen(ns) > 15)
+        return ESP_ERR_INVALID_ARG;
+    pthread_mutex_lock(&nvs_lock);
+    for (int i = 1; i <= NVS_NAMESPACES; i++) {
+        if (strcmp(nvs_ns[i], ns) == 0) {
+            *h = i | (mode == NVS_READWRITE ? NVS_RW : 0);
+            pthread_mutex_unlock(&nvs_lock);
+            return ESP_OK;
+        }
+        if (nvs_ns[i][0] == '\0' && free_ns == 0)
+            free_ns = i;
+    }
+    // Like NVS, a read-only open of a namespace never written fails
+    if (mode == NVS_READONLY || free_ns == 0) {
+        pthread_mutex_unlock(&nvs_lock);
+        return mode == NVS_READONLY ? ESP_ERR_NVS_NOT_FOUND : ESP_ERR_NO_MEM;
+    }
+    strcpy(nvs_ns[free_ns], ns);
+    *h = free_ns | NVS_RW;
+    pthread_mutex_unlock(&nvs_lock);
+    return ESP_OK;
+}
+
+void nvs_close(nvs_handle_t h)
+{
+}
+
+esp_err_t nvs_commit(nvs_handle_t h)
+{
+    return ESP_OK;
+}
+
+static nvs_entry_t *nvs_find(nvs_handle_t h, const char *key)
+{
+    for (int i = 0; i < NVS_ENTRIES; i++) {
+        if (nvs_entries[i].ns == (h & 0xff) && strcmp(nvs_entries[i].key, key) == 0)
+            return &nvs_entries[i];
+    }
+    return NULL;
+}
+
+static esp_err_t nvs_get(nvs_handle_t h, const char *key, nvs_type_t type, void *value, size_t *len, bool exact)
+{
+    esp_err_t err = ESP_OK;
+
+    pthread_mutex_lock(&nvs_lock);
+    nvs_entry_t *e = nvs_find(h, key);
+    if (e == NULL || e->type != type) {
+        err = ESP_ERR_NVS_NOT_FOUND;
+    } else if (exact) {
+        memcpy(value, e->data, e->len);
+    } else if (value == NULL) {
+        *len = e->len;
+    } else if (*len < e->len) {
+        err = ESP_ERR_NVS_INVALID_LENGTH;
+    } else {
+        memcpy(value, e->data, e->len);
+        *len = e->len;
+    }
+    pthread_mutex_unlock(&nvs_lock);
+    return err;
+}
+
+static esp_err_t nvs_set(nvs_handle_t h, const char *key, nvs_type_t type, const void *value, size_t len)
+{
+    if (!(h & NVS_RW))
+        return ESP_ERR_NVS_READ_ONLY;
+    if (strlen(key) > 15)
+        return ESP_ERR_INVALID_ARG;
+    void *data = malloc(len ? len : 1);
+    if (data == NULL)
+        return ESP_ERR_NO_MEM;
+    memcpy(data, value, len);
+
+    pthread_mutex_lock(&nvs_lock);
+    nvs_entry_t *e = nvs_find(h, key);
+    for (int i = 0; e == NULL && i < NVS_ENTRIES; i++) {
+        if (nvs_entries[i].ns == 0)
+            e = &nvs_entries[i];
+    }
+    if (e == NULL) {
+        pthread_mutex_unlock(&nvs_lock);
+        free(data);
+        return ESP_ERR_NO_MEM;
+    }
+    free(e->data);
+    e->ns = h & 0xff;
+    strcpy(e->key, key);
+    e->type = type;
+    e->len = len;
+    e->data = data;
+    pthread_mutex_unlock(&nvs_lock);
+    return ESP_OK;
+}
+
+esp_err_t nvs_get_str(nvs_handle_t h, const char *key, char *value, size_t *len)
+{
+    return nvs_get(h, key, NVS_TYPE_STR, value, len, false);
+}
+
+esp_err_t nvs_set_str(nvs_handle_t h, const char *key, const char *value)
+{
+    return nvs_set(h, key, NVS_TYPE_STR, value, strlen(value) + 1);
+}
+
+esp_err_t nvs_get_u8(nvs_handle_t h, const char *key, uint8_t *value)
+{
+    return nvs_get(h, key, NVS_TYPE_U8, value, NULL, true);
+}
+
+esp_err_t nvs_set_u8(nvs_handle_t h, const char *key, uint8_t value)
+{
+    return nvs_set(h, key, NVS_TYPE_U8, &value, sizeof(value));
+}
+
+esp_err_t nvs_get_u16(nvs_handle_t h, const char *key, uint16_t *value)
+{
+    return nvs_get(h, key, NVS_TYPE_U16, value, NULL, true);
+}
+
+esp_err_t nvs_set_u16(nvs_handle_t h, const char *key, uint16_t value)
+{
+    return nvs_set(h, key, NVS_TYPE_U16, &value, sizeof(value));
+}
+
+esp_err_t nvs_get_u32(nvs_handle_t h, const char *key, uint32_t *value)
+{
+    return nvs_get(h, key, NVS_TYPE_U32, value, NULL, true);
+}
+
+esp_err_t nvs_set_u32(nvs_handle_t h, const char *key, uint32_t value)
+{
+    return nvs_set(h, key, NVS_TYPE_U32, &value, sizeof(value));
+}
+
+esp_err_t nvs_get_blob(nvs_handle_t h, const char *key, void *value, size_t *len)
+{
+    return nvs_get(h, key, NVS_TYPE_BLOB, value, len, false);
+}
+
+esp_err_t nvs_set_blob(nvs_handle_t h, const char *key, const void *value, size_t len)
+{
+    return nvs_set(h, key, NVS_TYPE_BLOB, value, len);
+}
+
+esp_err_t nvs_erase_key(nvs_handle_t h, const char *key)
+{
+    esp_err_t err = ESP_ERR_NVS_NOT_FOUND;
+
+    if (!(h & NVS_RW))
+        return ESP_ERR_NVS_READ_ONLY;
+    pthread_mutex_lock(&nvs_lock);
+    nvs_entry_t *e = nvs_find(h, key);
+    if (e) {
+        free(e->data);
+        memset(e, 0, sizeof(*e));
+        err = ESP_OK;
+    }
+    pthread_mutex_unlock(&nvs_lock);
+    return err;
+}
+
+/* Move the iterator to the next match at or after idx */
+static esp_err_t nvs_iter_seek(nvs_iterator_t *it, int idx)
+{
+    struct nvs_iter *i = *it;
+
+    pthread_mutex_lock(&nvs_lock);
+    for (; idx < NVS_ENTRIES; idx++) {
+        if (nvs_entries[idx].ns == i->ns && (i->type == NVS_TYPE_ANY || nvs_entries[idx].type == i->type))
+            break;
+    }
+    pthread_mutex_unlock(&nvs_lock);
+    if (idx == NVS_ENTRIES) {
+        free(i);
+        *it = NULL;
+        return ESP_ERR_NVS_NOT_FOUND;
+    }
+    i->idx = idx;
+    return ESP_OK;
+}
+
+esp_err_t nvs_entry_find(const char *part, const char *ns, nvs_type_t type, nvs_iterator_t *it)
+{
+    nvs_handle_t h;
+
+    *it = NULL;
+    if (nvs_open(ns, NVS_READONLY, &h) != ESP_OK)
+        return ESP_ERR_NVS_NOT_FOUND;
+    if ((*it = calloc(1, sizeof(**it))) == NULL)
+        return ESP_ERR_NO_MEM;
+    (*it)->ns = h & 0xff;
+    (*it)->type = type;
+    return nvs_iter_seek(it, 0);
+}
+
+esp_err_t nvs_entry_next(nvs_iterator_t *it)
+{
+    if (*it == NULL)
+        return ESP_ERR_INVALID_ARG;
+    return nvs_iter_seek(it, (*it)->idx + 1);
+}
+
+esp_err_t nvs_entry_info(nvs_iterator_t it, nvs_entry_info_t *info)
+{
+    if (it == NULL)
+        return ESP_ERR_INVALID_ARG;
+    pthread_mutex_lock(&nvs_lock);
+    strcpy(info->namespace_name, nvs_ns[it->ns]);
+    strcpy(info->key, nvs_entries[it->idx].key);
+    info->type = nvs_entries[it->idx].type;
+    pthread_mutex_unlock(&nvs_lock);
+    return ESP_OK;
+}
+
+void nvs_release_iterator(nvs_iterator_t it)
+{
+    free(it);
+}
+
+/* ---- OTA partition in a file ---- */
+
+const char *hb_flash_path;
+unsigned hb_flash_unerased;
+
+static esp_partition_t ota_part = {
+    .subtype = 0x11,        // ota_1 of the two OTA partition table
+    .address = 0x210000,
+    .size = 0x100000,
+    .label = "ota_1",
+};
+static uint8_t *flash;
+
+static struct {
+    bool open;
+    uint32_t pos;
+} ota_session;
+
+/* The file is mapped, so a partition sized erase costs a memset */
+static uint8_t *flash_get(void)
+{
+    FILE *f;
+
+    if (flash)
+        return flash;
+    f = hb_flash_path ? fopen(hb_flash_path, "w+b") : tmpfile();
+    if (f == NULL) {
+        perror(hb_flash_path ? hb_flash_path : "tmpfile");
+        exit(2);
+    }
+    // Fresh chips are not blank, so nothing passes without an erase
+    if (ftruncate(fileno(f), ota_part.size) != 0) {
+        perror("ftruncate");
+        exit(2);
+    }
+    flash = mmap(NULL, ota_part.size, PROT_READ | PROT_WRITE, MAP_SHARED, fileno(f), 0);
+    if (flash == MAP_FAILED) {
+        perror("mmap");
+        exit(2);
+    }
+    fclose(f);
+    return flash;
+}
+
+esp_err_t esp_partition_read(const esp_partition_t *part, size_t ofs, void *dst, size_t len)
+{
+    if (ofs > part->size || len > part->size - ofs)
+        return ESP_ERR_INVALID_SIZE;
+    memcpy(dst, flash_get() + ofs, len);
+    return ESP_OK;
+}
+
+esp_err_t esp_partition_erase_range(const esp_partition_t *part, size_t ofs, size_t len)
+{
+    if (ofs % SPI_FLASH_SEC_SIZE || len % SPI_FLASH_SEC_SIZE)
+        return ESP_ERR_INVALID_ARG;
+    if (ofs > part->size || len > part->size - ofs)
+        return ESP_ERR_INVALID_SIZE;
+    memset(flash_get() + ofs, 0xff, len);
+    return ESP_OK;
+}
+
+/* Program bytes, which can only clear bits */
+static esp_err_t flash_write(size_t ofs, const uint8_t *src, size_t len)
+{
+    uint8_t *cur = flash_get() + ofs;
+
+    if (ofs > ota_part.size || len > ota_part.size - ofs)
+        return ESP_ERR_INVALID_SIZE;
+    for (size_t i = 0; i < len; i++) {
+        if (src[i] & ~cur[i]) {
+            hb_flash_unerased++;
+            return ESP_FAIL;
+        }
+    }
+    memcpy(cur, src, len);
+    return ESP_OK;
+}
+
+const esp_partition_t *esp_ota_get_next_update_partition(const esp_partition_t *start)
+{
+    return &ota_part;
+}
+
+/* With a size, only that much is erased up front and writes do not erase */
+esp_err_t esp_ota_begin(const esp_partition_t *part, size_t size, esp_ota_handle_t *handle)
+{
+    size = (size + SPI_FLASH_SEC_SIZE - 1) & ~(size_t)(SPI_FLASH_SEC_SIZE - 1);
+    esp_err_t err = esp_partition_erase_range(part, 0, size);
+    if (err != ESP_OK)
+        return err;
+    ota_session.open = true;
+    ota_session.pos = 0;
+    *handle = 1;
+    return ESP_OK;
+}
+
+esp_err_t esp_ota_write(esp_ota_handle_t handle, const void *data, size_t len)
+{
+    if (!ota_session.open)
+        return ESP_ERR_INVALID_ARG;
+    // Anything but an app image is refused from the first byte
+    if (ota_session.pos == 0 && len > 0 && ((const uint8_t *)data)[0] != 0xe9)
+        return ESP_ERR_OTA_VALIDATE_FAILED;
+    esp_err_t err = flash_write(ota_session.pos, data, len);
+    if (err == ESP_OK)
+        ota_session.pos += len;
+    return err;
+}
+
+esp_err_t esp_ota_end(esp_ota_handle_t handle)
+{
+    if (!ota_session.open)
+        return ESP_ERR_INVALID_ARG;
+    ota_session.open = false;
+    return ota_session.pos > 0 ? ESP_OK : ESP_ERR_OTA_VALIDATE_FAILED;
+}
+
+esp_err_t esp_ota_abort(esp_ota_handle_t handle)
+{
+    ota_session.open = false;
+    return ESP_OK;
+}
+
+esp_err_t esp_ota_set_boot_partition(const esp_partition_t *part)
+{
+    return ESP_OK;
+}
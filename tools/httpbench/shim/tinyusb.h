@@ -0,0 +1,6 @@
+#pragma once
+
+/* HID usage codes profile.c uses for the default profile */
+#define HID_KEY_ENTER       0x28
+#define HID_KEY_SPACE       0x2C
+#define HID_KEY_ARROW_DOWN  0x51
@@ -0,0 +1,8 @@
+/* Stand-in for the header assets.cmake generates, used when the
+ * firmware has not been built yet */
+#define ASSET_INDEX_HTML_ETAG "\"0000000000000000\""
+#define ASSET_INDEX_HTML_ETAG_GZ "\"0000000000000000-gz\""
+#define ASSET_CONFIG_HTML_ETAG "\"0000000000000001\""
+#define ASSET_CONFIG_HTML_ETAG_GZ "\"0000000000000001-gz\""
+#define ASSET_FAVICON_ICO_ETAG "\"0000000000000002\""
+#define ASSET_FAVICON_ICO_ETAG_GZ "\"0000000000000002-gz\""
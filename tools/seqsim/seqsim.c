@@ -0,0 +1,468 @@
+/*
+ * Host-side key sequencer simulator
+ *
+ * Builds main/seq.c and main/profile.c unchanged against shims in
+ * shim/, with a virtual microsecond clock standing in for esp_timer and
+ * FreeRTOS, and a fake USB host standing in for TinyUSB. The sequencer
+ * runs as the only task: whenever it blocks, the clock jumps to the
+ * next event (a timer expiry, a host poll that collects a report, a
+ * resume) until it is woken.
+ *
+ * The fake host polls the keyboard endpoint every poll interval, may
+ * start suspended, and passes each delivered report to a model of the
+ * boot firmware. That model only accepts a key press once it is ready,
+ * held long enough, and far enough after the previous accepted press.
+ * Lost lead keys are harmless, a lost select key or Enter boots the
+ * wrong entry.
+ *
+ *     make && ./seqsim                run every profile on every host
+ *     ./seqsim -b 3 -p fast:0x2c:5:0x51:5000:60000 -v
+ *     ./seqsim -c                     also calibrate against each host
+ *     ./seqsim -f                     exit 1 if any selection failed
+ */
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "seq.c"
+
+int sim_verbose;
+
+/* ---- Virtual clock and the sequencer's task ---- */
+
+static int64_t sim_now;
+static uint32_t sim_notify;
+static bool sim_notified;       // notification pending, as FreeRTOS tracks it apart from the bits
+static struct sim_task { int unused; } sim_seq_task;
+
+#define SIM_LIMIT_US    (10 * 60 * 1000000LL)   // give up on a stuck run
+
+struct esp_timer {
+    esp_timer_cb_t cb;
+    void *arg;
+    int64_t due;
+    bool armed;
+};
+static struct esp_timer sim_timers[4];
+static int sim_ntimers;
+
+long long sim_now_us(void)
+{
+    return sim_now;
+}
+
+int64_t esp_timer_get_time(void)
+{
+    return sim_now;
+}
+
+esp_err_t esp_timer_create(const esp_timer_create_args_t *args, esp_timer_handle_t *handle)
+{
+    if (sim_ntimers == sizeof(sim_timers) / sizeof(sim_timers[0]))
+        return ESP_FAIL;
+    sim_timers[sim_ntimers] = (struct esp_timer){ .cb = args->callback, .arg = args->arg };
+    *handle = &sim_timers[sim_ntimers++];
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeout_us)
+{
+    if (timer->armed)
+        return ESP_ERR_INVALID_STATE;
+    timer->due = sim_now + timeout_us;
+    timer->armed = true;
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_stop(esp_timer_handle_t timer)
+{
+    if (!timer->armed)
+        return ESP_ERR_INVALID_STATE;
+    timer->armed = false;
+    return ESP_OK;
+}
+
+BaseType_t xTaskCreate(TaskFunction_t fn, const char *name, uint32_t stack, void *arg,
+                       UBaseType_t prio, TaskHandle_t *handle)
+{
+    // The task body is not run, seqsim calls seq_run() itself
+    *handle = &sim_seq_task;
+    return pdPASS;
+}
+
+BaseType_t xTaskNotify(TaskHandle_t task, uint32_t value, eNotifyAction action)
+{
+    sim_notify |= value;
+    sim_notified = true;
+    return pdPASS;
+}
+
+static bool sim_step(int64_t until);
+
+BaseType_t xTaskNotifyWait(uint32_t clear_on_entry, uint32_t clear_on_exit, uint32_t *value, TickType_t ticks)
+{
+    int64_t until = (ticks == portMAX_DELAY) ? sim_now + SIM_LIMIT_US
+                                             : sim_now + (int64_t)ticks * 1000000 / CONFIG_FREERTOS_HZ;
+
+    // Like FreeRTOS, only a notification since the last wait returned ends the wait
+    if (!sim_notified)
+        sim_notify &= ~clear_on_entry;
+    while (!sim_notified && sim_step(until))
+        ;
+    if (!sim_notified) {
+        if (ticks == portMAX_DELAY) {
+            fprintf(stderr, "seqsim: sequencer blocked forever at %lld us\n", (long long)sim_now);
+            exit(2);
+        }
+        return pdFALSE;
+    }
+    if (value)
+        *value = sim_notify;
+    sim_notify &= ~clear_on_exit;
+    sim_notified = false;
+    return pdTRUE;
+}
+
+/* Stand-ins for the metrics the sequencer records */
+metrics_hist_t metric_seq_first_key;
+metrics_hist_t metric_seq_done;
+
+void metrics_hist_observe(metrics_hist_t *h, int64_t us)
+{
+    h->count++;
+    h->sum_us += us;
+}
+
+/* No flash behind the settings cache: writes succeed and are thrown
+ * away, reads find nothing */
+esp_err_t config_get_rec(config_rec_t rec, void *data, size_t len)
+{
+    return ESP_ERR_NOT_FOUND;
+}
+
+esp_err_t config_set_rec(config_rec_t rec, const void *data, size_t len)
+{
+    return ESP_OK;
+}
+
+esp_err_t config_get_profile(const char *name, seq_profile_t *prof)
+{
+    return ESP_ERR_NOT_FOUND;
+}
+
+esp_err_t config_set_profile(const seq_profile_t *prof)
+{
+    return ESP_OK;
+}
+
+esp_err_t config_delete_profile(const char *name)
+{
+    return ESP_ERR_NOT_FOUND;
+}
+
+int config_list_profiles(seq_profile_t *profs, int max)
+{
+    return 0;
+}
+
+/* ---- Fake USB host and boot firmware ---- */
+
+typedef struct {
+    const char *name;
+    int64_t poll_us;            // endpoint polling interval (bInterval)
+    int64_t ready_us;           // firmware starts reading keys this long after start
+    int64_t min_gap_us;         // between accepted presses
+    int64_t min_hold_us;        // press to release
+    int64_t suspended_us;       // starts suspended, resumes on its own after this (0 = awake)
+    bool remote_wakeup;         // host honours remote wakeup while suspended
+    int64_t wakeup_us;          // resume signalling after a remote wakeup
+    int64_t led_echo_us;        // Num Lock LED report after an accepted press
+} sim_host_t;
+
+static const sim_host_t sim_hosts[] = {
+    { "fast",      1000,       0,  20000,     0,       0, false,     0,  2000 },
+    { "bios-8ms",  8000,       0,  30000,  8000,       0, false,     0,  8000 },
+    { "slow-menu", 10000, 2000000, 150000, 20000,      0, false,     0, 10000 },
+    { "suspended", 8000,       0,  30000,  8000, 3000000, true,  20000,  8000 },
+    { "no-wakeup", 8000,       0,  30000,  8000, 1500000, false,     0,  8000 },
+};
+
+static struct {
+    const sim_host_t *cfg;
+    int64_t start;
+    bool suspended;
+    int64_t resume_at;          // 0 if no resume is scheduled
+    bool pending;               // report waiting for the next poll
+    uint8_t report[6];
+    int64_t led_at;             // LED report due, 0 if none
+    uint8_t leds;
+    // Firmware model
+    uint8_t down;               // key currently held, 0 if none
+    int64_t down_at;
+    bool down_ok;               // press passed the ready and gap checks
+    int64_t last_accept;
+    int accepted[256];
+    int lost[256];
+    int64_t enter_at;           // Enter accepted, 0 if not
+} sim_host;
+
+static void sim_host_reset(const sim_host_t *cfg)
+{
+    memset(&sim_host, 0, sizeof(sim_host));
+    sim_host.cfg = cfg;
+    sim_host.start = sim_now;
+    sim_host.last_accept = INT64_MIN / 2;
+    if (cfg->suspended_us) {
+        sim_host.suspended = true;
+        sim_host.resume_at = sim_now + cfg->suspended_us;
+    }
+    // A new host starts with every LED off
+    seq_led_report(0);
+}
+
+bool tud_suspended(void)
+{
+    return sim_host.suspended;
+}
+
+bool tud_remote_wakeup(void)
+{
+    if (!sim_host.suspended || !sim_host.cfg->remote_wakeup)
+        return false;
+    if (sim_host.resume_at == 0 || sim_host.resume_at > sim_now + sim_host.cfg->wakeup_us)
+        sim_host.resume_at = sim_now + sim_host.cfg->wakeup_us;
+    return true;
+}
+
+bool tud_hid_ready(void)
+{
+    return !sim_host.suspended && !sim_host.pending;
+}
+
+bool tud_hid_keyboard_report(uint8_t report_id, uint8_t modifier, const uint8_t keycode[6])
+{
+    if (!tud_hid_ready())
+        return false;
+    if (keycode)
+        memcpy(sim_host.report, keycode, sizeof(sim_host.report));
+    else
+        memset(sim_host.report, 0, sizeof(sim_host.report));
+    sim_host.pending = true;
+    return true;
+}
+
+/* The firmware sees a report the moment the host collects it */
+static void sim_firmware(const uint8_t *report)
+{
+    const sim_host_t *cfg = sim_host.cfg;
+    uint8_t key = report[0];
+
+    if (sim_host.down && key != sim_host.down) {
+        // Release, or a different key, ends the held key
+        if (sim_host.down_ok && sim_now - sim_host.down_at >= cfg->min_hold_us) {
+            sim_host.accepted[sim_host.down]++;
+            sim_host.last_accept = sim_host.down_at;
+            if (sim_host.down == HID_KEY_ENTER && sim_host.enter_at == 0)
+                sim_host.enter_at = sim_host.down_at;
+            if (sim_host.down == HID_KEY_NUM_LOCK)
+                sim_host.led_at = sim_now + cfg->led_echo_us;
+        } else {
+            sim_host.lost[sim_host.down]++;
+        }
+        sim_host.down = 0;
+    }
+    if (key && key != sim_host.down) {
+        sim_host.down = key;
+        sim_host.down_at = sim_now;
+        sim_host.down_ok = sim_now - sim_host.start >= cfg->ready_us &&
+                           sim_now - sim_host.last_accept >= cfg->min_gap_us;
+    }
+}
+
+static int64_t sim_next_poll(void)
+{
+    int64_t poll = sim_host.cfg->poll_us;
+    return (sim_now / poll + 1) * poll;
+}
+
+/* Run the earliest event due by until, false if there was none */
+static bool sim_step(int64_t until)
+{
+    int64_t t = until + 1;
+    struct esp_timer *timer = NULL;
+    int what = 0;
+
+    for (int i = 0; i < sim_ntimers; i++) {
+        if (sim_timers[i].armed && sim_timers[i].due < t) {
+            t = sim_timers[i].due;
+            timer = &sim_timers[i];
+            what = 1;
+        }
+    }
+    if (sim_host.pending && !sim_host.suspended && sim_next_poll() < t) {
+        t = sim_next_poll();
+        what = 2;
+    }
+    if (sim_host.suspended && sim_host.resume_at && sim_host.resume_at < t) {
+        t = sim_host.resume_at;
+        what = 3;
+    }
+    if (sim_host.led_at && sim_host.led_at < t) {
+        t = sim_host.led_at;
+        what = 4;
+    }
+    if (what == 0) {
+        sim_now = until;
+        return false;
+    }
+
+    sim_now = t;
+    switch (what) {
+    case 1:
+        timer->armed = false;
+        timer->cb(timer->arg);
+        break;
+    case 2:
+        sim_host.pending = false;
+        sim_firmware(sim_host.report);
+        seq_report_complete();
+        break;
+    case 3:
+        sim_host.suspended = false;
+        sim_host.resume_at = 0;
+        seq_usb_event();
+        break;
+    case 4:
+        sim_host.led_at = 0;
+        sim_host.leds ^= KEYBOARD_LED_NUMLOCK;
+        seq_led_report(sim_host.leds);
+        break;
+    }
+    return true;
+}
+
+/* ---- Benchmarks ---- */
+
+#define SIM_MAX_PROFILES    16
+
+static bool sim_parse_profile(const char *arg, seq_profile_t *prof)
+{
+    char name[SEQ_PROFILE_NAME_LEN];
+    unsigned lead, count, select, press, gap;
+
+    if (sscanf(arg, "%12[^:]:%i:%i:%i:%i:%i", name, &lead, &count, &select, &press, &gap) != 6)
+        return false;
+    memset(prof, 0, sizeof(*prof));
+    strlcpy(prof->name, name, sizeof(prof->name));
+    prof->lead_key = lead;
+    prof->lead_count = count;
+    prof->select_key = select;
+    prof->press_us = press;
+    prof->gap_us = gap;
+    return true;
+}
+
+/* One boot selection, returns true if the right entry was booted */
+static bool sim_select(const seq_profile_t *prof, const sim_host_t *host, uint32_t btn)
+{
+    sim_notify = 0;
+    sim_notified = false;
+    sim_host_reset(host);
+    int64_t start = sim_now;
+    bool done = seq_run(btn, prof, start);
+
+    // Let the last release reach the firmware
+    sim_firmware((const uint8_t[6]){ 0 });
+
+    int lead_lost = sim_host.lost[prof->lead_key];
+    int sel_ok = sim_host.accepted[prof->select_key];
+    int sent = prof->lead_count + btn;
+    int lost = 0;
+    for (int k = 0; k < 256; k++)
+        lost += sim_host.lost[k];
+    bool ok = done && sel_ok == (int)btn - 1 && sim_host.enter_at &&
+              (prof->lead_count == 0 || lead_lost < prof->lead_count);
+
+    printf("%-12s %-10s %5d %5d %5d %10.1f %10.1f %8.2f %8.2f  %s\n",
+           prof->name, host->name, sent, lost, lead_lost,
+           sim_host.enter_at ? (sim_host.enter_at - start) / 1000.0 : -1.0,
+           seq_stats.first_key ? (seq_stats.first_key - start) / 1000.0 : -1.0,
+           seq_stats.ack_min == INT64_MAX ? 0 : seq_stats.ack_min / 1000.0,
+           seq_stats.ack_max / 1000.0,
+           ok ? "ok" : "FAIL");
+    sim_now += 5000000;     // idle between runs
+    return ok;
+}
+
+static void sim_calibrate(const seq_profile_t *start, const sim_host_t *host)
+{
+    seq_profile_t prof = *start;
+
+    sim_notify = 0;
+    sim_notified = false;
+    sim_host_reset(host);
+    bool ok = seq_calibrate(&prof);
+    printf("%-12s %-10s gap %8.1f ms -> %8.1f ms%s (host needs %.1f ms press to press)\n",
+           start->name, host->name, start->gap_us / 1000.0, prof.gap_us / 1000.0,
+           ok ? "" : ", no LED echo", host->min_gap_us / 1000.0);
+    sim_now += 5000000;
+}
+
+static void usage(void)
+{
+    fprintf(stderr,
+        "usage: seqsim [-b button] [-p name:lead:count:select:press_us:gap_us]... [-c] [-f] [-v]\n"
+        "  -b  boot entry to select, 1-4 (default 2)\n"
+        "  -p  add a timing profile, e.g. fast:0x2c:5:0x51:5000:60000\n"
+        "  -c  also calibrate each profile against each host\n"
+        "  -f  exit 1 if any selection booted the wrong entry\n"
+        "  -v  show the sequencer's log\n");
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    seq_profile_t profs[SIM_MAX_PROFILES];
+    int nprofs = 0;
+    uint32_t btn = 2;
+    bool cal = false, fail_exit = false, all_ok = true;
+    int opt;
+
+    // The built-in profile, plus a fast one tuned for a responsive host
+    profile_default(&profs[nprofs++]);
+    sim_parse_profile("fast:0x2c:5:0x51:5000:60000", &profs[nprofs++]);
+
+    while ((opt = getopt(argc, argv, "b:p:cfv")) != -1) {
+        switch (opt) {
+        case 'b':
+            btn = atoi(optarg);
+            if (btn < 1 || btn > 4)
+                usage();
+            break;
+        case 'p':
+            if (nprofs == SIM_MAX_PROFILES || !sim_parse_profile(optarg, &profs[nprofs++]))
+                usage();
+            break;
+        case 'c': cal = true; break;
+        case 'f': fail_exit = true; break;
+        case 'v': sim_verbose = 1; break;
+        default: usage();
+        }
+    }
+
+    seq_init();
+    printf("%-12s %-10s %5s %5s %5s %10s %10s %8s %8s\n",
+           "profile", "host", "keys", "lost", "lead", "enter_ms", "first_ms", "ack_min", "ack_max");
+    for (int p = 0; p < nprofs; p++) {
+        for (size_t h = 0; h < sizeof(sim_hosts) / sizeof(sim_hosts[0]); h++)
+            all_ok &= sim_select(&profs[p], &sim_hosts[h], btn);
+    }
+    if (cal) {
+        for (int p = 0; p < nprofs; p++) {
+            for (size_t h = 0; h < sizeof(sim_hosts) / sizeof(sim_hosts[0]); h++)
+                sim_calibrate(&profs[p], &sim_hosts[h]);
+        }
+    }
+    return (fail_exit && !all_ok) ? 1 : 0;
+}
@@ -0,0 +1,5 @@
+#pragma once
+#include "esp_err.h"
+
+/* Only what metrics.h needs */
+typedef struct httpd_req httpd_req_t;
@@ -0,0 +1,16 @@
+#pragma once
+#include <inttypes.h>
+#include <stdio.h>
+
+/* Set by seqsim -v, the sequencer's own logging goes to stderr */
+extern int sim_verbose;
+extern long long sim_now_us(void);
+
+#define SIM_LOG(l, tag, fmt, ...) do {                                  \
+        if (sim_verbose)                                                \
+            fprintf(stderr, l " (%lld) %s: " fmt "\n", sim_now_us() / 1000, tag, ##__VA_ARGS__); \
+    } while (0)
+#define ESP_LOGE(tag, fmt, ...) SIM_LOG("E", tag, fmt, ##__VA_ARGS__)
+#define ESP_LOGW(tag, fmt, ...) SIM_LOG("W", tag, fmt, ##__VA_ARGS__)
+#define ESP_LOGI(tag, fmt, ...) SIM_LOG("I", tag, fmt, ##__VA_ARGS__)
+#define ESP_LOGD(tag, fmt, ...) SIM_LOG("D", tag, fmt, ##__VA_ARGS__)
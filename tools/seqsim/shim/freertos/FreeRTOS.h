@@ -0,0 +1,20 @@
+#pragma once
+#include <stdint.h>
+
+typedef uint32_t TickType_t;
+typedef uint32_t UBaseType_t;
+typedef int32_t BaseType_t;
+
+#define pdTRUE              1
+#define pdFALSE             0
+#define pdPASS              pdTRUE
+#define portMAX_DELAY       ((TickType_t)0xffffffffUL)
+#define pdMS_TO_TICKS(ms)   ((TickType_t)((uint64_t)(ms) * CONFIG_FREERTOS_HZ / 1000))
+#define tskIDLE_PRIORITY    0
+#define tskNO_AFFINITY      0x7fffffff
+
+#define BIT0    0x01
+#define BIT1    0x02
+#define BIT2    0x04
+#define BIT3    0x08
+#define BIT4    0x10
@@ -0,0 +1,9 @@
+#pragma once
+#include "freertos/FreeRTOS.h"
+
+/* Single threaded, the lock is never contended */
+typedef int *SemaphoreHandle_t;
+static int sim_mutex;
+#define xSemaphoreCreateMutex()     (&sim_mutex)
+static inline BaseType_t xSemaphoreTake(SemaphoreHandle_t s, TickType_t t) { return pdTRUE; }
+static inline BaseType_t xSemaphoreGive(SemaphoreHandle_t s) { return pdTRUE; }
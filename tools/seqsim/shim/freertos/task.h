@@ -0,0 +1,14 @@
+#pragma once
+#include "freertos/FreeRTOS.h"
+
+typedef struct sim_task *TaskHandle_t;
+typedef void (*TaskFunction_t)(void *);
+typedef enum { eNoAction, eSetBits } eNotifyAction;
+
+/* There is only the sequencer, driven directly by seqsim.c */
+BaseType_t xTaskNotify(TaskHandle_t task, uint32_t value, eNotifyAction action);
+BaseType_t xTaskNotifyWait(uint32_t clear_on_entry, uint32_t clear_on_exit, uint32_t *value, TickType_t ticks);
+BaseType_t xTaskCreate(TaskFunction_t fn, const char *name, uint32_t stack, void *arg,
+                       UBaseType_t prio, TaskHandle_t *handle);
+#define xTaskCreatePinnedToCore(fn, name, stack, arg, prio, handle, core) \
+    xTaskCreate(fn, name, stack, arg, prio, handle)
@@ -0,0 +1,24 @@
+/* Kconfig values for the simulator build, forced in with -include */
+#pragma once
+#define CONFIG_WEBSTER_DEFAULT_PROFILE      "grub"
+#define CONFIG_WEBSTER_KEY_PRESS_US         10000
+#define CONFIG_WEBSTER_KEY_GAP_US           500000
+#define CONFIG_WEBSTER_ARMED_LEAD_COUNT     1
+#define CONFIG_WEBSTER_SEQ_POLICY_REJECT    1
+#define CONFIG_WEBSTER_SEQ_PRIORITY         6
+#define CONFIG_FREERTOS_HZ                  1000
+
+/* glibc only has strlcpy from 2.38 */
+#include <string.h>
+static inline size_t sim_strlcpy(char *dst, const char *src, size_t size)
+{
+    size_t len = strlen(src);
+
+    if (size) {
+        size_t n = len < size - 1 ? len : size - 1;
+        memcpy(dst, src, n);
+        dst[n] = '\0';
+    }
+    return len;
+}
+#define strlcpy sim_strlcpy
@@ -0,0 +1,16 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+
+/* HID usage codes used by the sequencer and profiles */
+#define HID_KEY_ENTER           0x28
+#define HID_KEY_SPACE           0x2C
+#define HID_KEY_NUM_LOCK        0x53
+#define HID_KEY_ARROW_DOWN      0x51
+#define KEYBOARD_LED_NUMLOCK    0x01
+
+/* Fake device stack, see seqsim.c */
+bool tud_hid_ready(void);
+bool tud_suspended(void);
+bool tud_remote_wakeup(void);
+bool tud_hid_keyboard_report(uint8_t report_id, uint8_t modifier, const uint8_t keycode[6]);
@@ -0,0 +1,80 @@
+#!/usr/bin/env python3
+"""Send a boot selection to one or more Webster devices over UDP.
+
+    udp_ctrl.py --key SECRET --button 2 host1 host2 ...
+
+The key is CONFIG_WEBSTER_UDP_KEY. Sequence numbers start from the
+current time and move past whatever a device last saw if it reports a
+replay, so no state needs to be kept between runs.
+"""
+
+import argparse
+import hashlib
+import hmac
+import socket
+import struct
+import time
+
+VERSION = 1
+OPS = {"select": 1, "arm": 2, "disarm": 3}
+STATUS = ["ok", "busy", "bad selection", "bad profile", "replay", "failed", "bad request"]
+ST_REPLAY = 4
+REQ = struct.Struct(">2sBBIB13s")
+RESP = struct.Struct(">2sBBIIB")
+MAC_LEN = 16
+
+
+def mac(key, msg):
+    return hmac.new(key, msg, hashlib.sha256).digest()[:MAC_LEN]
+
+
+def request(sock, key, host, port, op, seq, button, profile, timeout):
+    body = REQ.pack(b"WB", VERSION, op, seq, button, profile.encode())
+    sock.sendto(body + mac(key, body), (host, port))
+    deadline = time.monotonic() + timeout
+    while True:
+        sock.settimeout(max(deadline - time.monotonic(), 0.001))
+        data, addr = sock.recvfrom(64)
+        if addr[0] != host or len(data) != RESP.size + MAC_LEN:
+            continue
+        if not hmac.compare_digest(mac(key, data[:RESP.size]), data[RESP.size:]):
+            continue
+        magic, ver, rop, rseq, rid, status = RESP.unpack(data[:RESP.size])
+        if rop == op | 0x80 and rseq == seq:
+            return status, rid
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    ap.add_argument("hosts", nargs="+")
+    ap.add_argument("--key", required=True)
+    ap.add_argument("--port", type=int, default=5151)
+    ap.add_argument("--op", choices=OPS, default="select")
+    ap.add_argument("--button", type=int, default=1)
+    ap.add_argument("--profile", default="")
+    ap.add_argument("--timeout", type=float, default=1.0)
+    args = ap.parse_args()
+
+    key = args.key.encode()
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    for host in args.hosts:
+        host = socket.gethostbyname(host)
+        seq = int(time.time())
+        try:
+            start = time.perf_counter()
+            status, rid = request(sock, key, host, args.port, OPS[args.op], seq,
+                                  args.button, args.profile, args.timeout)
+            if status == ST_REPLAY:
+                seq = rid + 1
+                start = time.perf_counter()
+                status, rid = request(sock, key, host, args.port, OPS[args.op], seq,
+                                      args.button, args.profile, args.timeout)
+            ms = (time.perf_counter() - start) * 1000
+            name = STATUS[status] if status < len(STATUS) else str(status)
+            print(f"{host} {name} id={rid} {ms:.1f} ms")
+        except socket.timeout:
+            print(f"{host} no reply")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,34 @@
+#!/usr/bin/env python3
+"""Stand-in for a sleeping host: print Wake-on-LAN packets as they arrive.
+
+    wol_capture.py [--port 9]
+
+Point /boot at it with to=<this machine>&port=<port> to check the magic
+packet and see when it arrives.
+"""
+
+import argparse
+import socket
+import time
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    ap.add_argument("--port", type=int, default=9)
+    args = ap.parse_args()
+
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    sock.bind(("", args.port))
+    while True:
+        data, addr = sock.recvfrom(1500)
+        stamp = time.strftime("%H:%M:%S") + f".{int(time.time() * 1000) % 1000:03d}"
+        mac = data[6:12]
+        if len(data) >= 102 and data[:6] == b"\xff" * 6 and data[6:102] == mac * 16:
+            print(f"{stamp} {addr[0]} wake {mac.hex(':')}")
+        else:
+            print(f"{stamp} {addr[0]} not a magic packet ({len(data)} bytes)")
+
+
+if __name__ == "__main__":
+    main()